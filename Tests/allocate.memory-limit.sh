@@ -0,0 +1,13 @@
+# Run a pass that keeps about 8 MiB alive in its Lua state, with a limit that
+# it stays under, and then with a limit for that pass that it exceeds.
+# Exceeding the limit is fatal.
+igk --lua-options memory-limit=64M --pass $PASS --pass TeXOutputPass --file "$TEST.in" 2>/dev/null
+echo
+ERRORS=$(mktemp)
+if igk --lua-options memory-limit=64M --lua-options $PASS:memory-limit=4M --pass $PASS --pass TeXOutputPass --file "$TEST.in" > /dev/null 2> "$ERRORS"; then
+	echo "succeeded"
+else
+	echo "failed"
+fi
+grep -o "Lua pass $PASS exceeded its memory limit of 4194304 bytes" "$ERRORS"
+rm "$ERRORS"
@@ -0,0 +1,15 @@
+# Save a checkpoint after the first pass, resume from it, and check that the
+# result matches an uninterrupted run.  Then check that a checkpoint from
+# another version of the format is rejected.
+CHECKPOINTS=$(mktemp -d)
+PASSES="--pass $PASS --pass blank-is-paragraph --pass TeXOutputPass"
+igk $PASSES --file "$TEST.in" > "$CHECKPOINTS/uninterrupted" 2>/dev/null
+igk $PASSES --file "$TEST.in" --checkpoint-after $PASS --checkpoint-directory "$CHECKPOINTS" > /dev/null 2>&1
+igk $PASSES --file "$TEST.in" --resume-from-pass $PASS --checkpoint-directory "$CHECKPOINTS" > "$CHECKPOINTS/resumed" 2>/dev/null
+cat "$CHECKPOINTS/resumed"
+echo
+diff -u "$CHECKPOINTS/uninterrupted" "$CHECKPOINTS/resumed"
+# The format version is the 32-bit word after the 8-byte magic number.
+printf '\377\377\377\377' | dd of="$CHECKPOINTS/$PASS.igkckpt" bs=1 seek=8 conv=notrunc 2>/dev/null
+igk $PASSES --file "$TEST.in" --resume-from-pass $PASS --checkpoint-directory "$CHECKPOINTS" 2>&1 >/dev/null | grep -o 'is not a compatible igk checkpoint'
+rm -r "$CHECKPOINTS"
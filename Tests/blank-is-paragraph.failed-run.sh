@@ -0,0 +1,10 @@
+# A run that stops early, here because the checkpoint cannot be written over
+# a directory, must still report on the passes that it ran.  The times
+# depend on the machine, so only the names of the passes are kept.
+OUTPUT=$(mktemp -d)
+mkdir "$OUTPUT/$PASS.igkckpt"
+igk --pass $PASS --pass clean-empty --file "$TEST.in" --time-passes --time-passes-json "$OUTPUT/times.json" --trace "$OUTPUT/trace.json" --checkpoint-after $PASS --checkpoint-directory "$OUTPUT" > /dev/null 2> "$OUTPUT/errors" || echo "failed"
+sed -n -E 's/^(\(scan\)|[a-z-]+) +[0-9.]+ .*/\1/p' "$OUTPUT/errors"
+grep -o '"pass": "[^"]*"' "$OUTPUT/times.json"
+grep -o '"name": "[^"]*", "cat": "pass"' "$OUTPUT/trace.json"
+rm -r "$OUTPUT"
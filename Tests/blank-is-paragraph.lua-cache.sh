@@ -0,0 +1,41 @@
+# Run a pass with an empty cache of compiled Lua passes, and again once it has
+# filled the cache, and check that both match a run without the cache.  The
+# run that finds the entries must not write them again.  Then check that
+# damaged entries are replaced, and that a pass whose source changes does not
+# run the stale compiled version.
+CACHE=$(mktemp -d)
+PASSES="--pass $PASS --pass TeXOutputPass"
+entries()
+{
+	ls -i "$CACHE/luac"
+}
+igk $PASSES --file "$TEST.in" > "$CACHE/uncached" 2>/dev/null
+igk --lua-cache-directory "$CACHE/luac" $PASSES --file "$TEST.in" > "$CACHE/filled" 2>/dev/null
+entries > "$CACHE/filled-entries"
+igk --lua-cache-directory "$CACHE/luac" $PASSES --file "$TEST.in" > "$CACHE/cached" 2>/dev/null
+cat "$CACHE/cached"
+echo
+diff -u "$CACHE/uncached" "$CACHE/filled"
+diff -u "$CACHE/uncached" "$CACHE/cached"
+entries | diff -u "$CACHE/filled-entries" - && echo "entries reused"
+# Drop the last byte of each entry, so that its bytecode fails to load.
+mkdir "$CACHE/saved"
+for ENTRY in "$CACHE"/luac/*.luac; do
+	cp "$ENTRY" "$CACHE/saved/"
+	SIZE=$(wc -c < "$ENTRY")
+	head -c $((SIZE - 1)) "$CACHE/saved/$(basename "$ENTRY")" > "$ENTRY"
+done
+igk --lua-cache-directory "$CACHE/luac" $PASSES --file "$TEST.in" > "$CACHE/damaged" 2>/dev/null
+diff -u "$CACHE/uncached" "$CACHE/damaged"
+for ENTRY in "$CACHE"/luac/*.luac; do
+	cmp "$ENTRY" "$CACHE/saved/$(basename "$ENTRY")" || echo "$ENTRY was not replaced"
+done
+# Change the source of a pass after it has been cached.
+mkdir "$CACHE/lua"
+echo 'function process(tree) tree:append_text("version 1") return tree end' > "$CACHE/lua/version.lua"
+igk --lua-cache-directory "$CACHE/luac" --lua-directory "$CACHE/lua" --pass version --pass TeXOutputPass --file "$TEST.in" 2>/dev/null
+echo
+echo 'function process(tree) tree:append_text("version 2") return tree end' > "$CACHE/lua/version.lua"
+igk --lua-cache-directory "$CACHE/luac" --lua-directory "$CACHE/lua" --pass version --pass TeXOutputPass --file "$TEST.in" 2>/dev/null
+echo
+rm -r "$CACHE"
@@ -0,0 +1,13 @@
+# Print the statistics after each pass, as a table and as JSON.  The heap and
+# resident set sizes depend on the platform, so they are left out.
+OUTPUT=$(mktemp -d)
+igk --pass $PASS --pass clean-empty --file "$TEST.in" --stats --stats-json "$OUTPUT/stats.json" 2>&1 >/dev/null |
+	grep -v '^Running pass' |
+	sed -E 's/ \(resident set: [0-9]+ KiB\)//; s/ +([0-9]+|Heap)$//'
+sed -E 's/("(resident|heap)_bytes"): [0-9]+/\1: 0/g' "$OUTPUT/stats.json"
+# The array must be closed even if the run stops early, here because the
+# checkpoint cannot be written over a directory.
+mkdir "$OUTPUT/$PASS.igkckpt"
+igk --pass $PASS --pass clean-empty --file "$TEST.in" --stats-json "$OUTPUT/stats.json" --checkpoint-after $PASS --checkpoint-directory "$OUTPUT" > /dev/null 2>&1
+sed -E 's/("(resident|heap)_bytes"): [0-9]+/\1: 0/g' "$OUTPUT/stats.json"
+rm -r "$OUTPUT"
@@ -0,0 +1,6 @@
+# Run a pass that adds a function to the string library and then a pass that
+# looks for it, with a Lua state for each pass and with one shared state.
+PASSES="--pass $PASS --pass use-shout --pass TeXOutputPass"
+igk $PASSES --file "$TEST.in" 2>/dev/null
+echo
+igk --share-lua-state $PASSES --file "$TEST.in" 2>/dev/null
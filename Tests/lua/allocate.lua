@@ -0,0 +1,10 @@
+-- Test pass for the `memory-limit` Lua option.  Keeps about 8 MiB of
+-- strings alive and then appends how many it made.
+function process(textTree)
+	local strings = {}
+	for i = 1, 8192 do
+		strings[i] = string.rep(string.char(65 + i % 26), 1024) .. i
+	end
+	textTree:append_text("allocated " .. #strings .. " strings")
+	return textTree
+end
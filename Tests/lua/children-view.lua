@@ -0,0 +1,72 @@
+-- Test pass for the `children` view.  Each `list` node is replaced by a
+-- `results` node that describes what indexing and iterating its children
+-- returns, including while the list is edited.  The view is taken once, so
+-- each line also checks that it reflects the edits made since.
+local function describe(child)
+	if type(child) == "string" then
+		return "'" .. child .. "'"
+	end
+	if child == nil then
+		return "nil"
+	end
+	return child.kind .. "(" .. child:text() .. ")"
+end
+
+local function iterate(view, iterator)
+	local seen = {}
+	for i, child in iterator(view) do
+		seen[#seen + 1] = i .. "=" .. describe(child)
+	end
+	return table.concat(seen, " ")
+end
+
+function process(textTree)
+	textTree:match("list", function(list)
+		local result   = TextTree.new("results")
+		local children = list.children
+		local function line(label, value)
+			result:append_text("\n" .. label .. ": " .. value)
+		end
+		line("length", #children)
+		line("first", describe(children[1]))
+		line("last", describe(children[#children]))
+		line("zero", describe(children[0]))
+		line("past end", describe(children[#children + 1]))
+		line("string key", describe(children.kind))
+		line("pairs", iterate(children, pairs))
+		line("ipairs", iterate(children, ipairs))
+		-- A deep clone shares the children until one side is modified, and
+		-- its view must not see the edits below.
+		local clone = list:deep_clone()
+		local cloned = clone.children
+		-- Removing the current child shifts the later ones down, so the one
+		-- after it is skipped, as with `table.remove` in a loop over a
+		-- table.  Removing a later child must not leave a hole.
+		local visited = {}
+		for i, child in pairs(children) do
+			visited[#visited + 1] = describe(child)
+			if type(child) ~= "string" then
+				if child:has_attribute("remove") then
+					list:remove_child(child)
+				elseif child:has_attribute("remove-next") then
+					list:remove_child(children[i + 1])
+				end
+			end
+		end
+		line("visited while removing", table.concat(visited, " "))
+		line("after removing", iterate(children, pairs))
+		-- Children appended during iteration are visited.
+		visited = {}
+		for _, child in ipairs(children) do
+			visited[#visited + 1] = describe(child)
+			if child == "b" then
+				list:append_child(TextTree.new("appended"))
+			end
+		end
+		line("visited while appending", table.concat(visited, " "))
+		line("length after appending", #children)
+		line("clone", iterate(cloned, pairs))
+		return { result }
+	end)
+	return textTree
+end
@@ -0,0 +1,9 @@
+-- Test pass for shared Lua states.  Adds a function to the string library,
+-- which `use-shout` sees when it runs later only if the passes share a
+-- state.
+function process(textTree)
+	string.shout = function(text)
+		return text:upper() .. "!"
+	end
+	return textTree
+end
@@ -0,0 +1,51 @@
+-- Test pass for `edit_children`, `edit_matches`, and `edit_matches_any`.
+-- The `action` attribute of each node says what the visitor returns for it:
+-- a new node (`replace`), an empty table or false (`delete`, `false`),
+-- nil, nothing, or true (`nil`, `nothing`, `true`), a string (`text`), or an
+-- array of strings and nodes (`array`).  Nodes without one are kept.
+local function edit(node)
+	local action = node:attribute("action")
+	if action == "replace" then
+		local new = TextTree.new("replaced")
+		new:append_text(node:text())
+		return new
+	elseif action == "delete" then
+		return {}
+	elseif action == "false" then
+		return false
+	elseif action == "nil" then
+		return nil
+	elseif action == "nothing" then
+		return
+	elseif action == "true" then
+		return true
+	elseif action == "text" then
+		return "text(" .. node:text() .. ")"
+	elseif action == "array" then
+		return { "[", node, "]", TextTree.new("after") }
+	end
+end
+
+local function run(tree)
+	tree:edit_children(function(node)
+		if node.kind == "top" then
+			return edit(node)
+		end
+	end)
+	tree:edit_matches("m", edit)
+	tree:edit_matches_any({ "x", "y" }, edit)
+end
+
+function process(textTree)
+	-- Editing a deep clone must give the same result without changing the
+	-- original.
+	local clone  = textTree:deep_clone()
+	local before = textTree:text()
+	run(clone)
+	local unchanged = textTree:text() == before
+	run(textTree)
+	textTree:append_text("\noriginal unchanged: " .. tostring(unchanged) ..
+	                     ", clone matches: " ..
+	                     tostring(textTree:text() == clone:text()))
+	return textTree
+end
@@ -0,0 +1,43 @@
+-- Test pass for `parallel_map`.  Each `item` node is replaced by a `done`
+-- node holding its text and the value of `config.mode` that the worker
+-- saw, except that items with a `keep` attribute are kept by returning nil.
+-- Mapping with a function that does not exist, one that writes to
+-- `config`, and one that calls `parallel_map` must each fail, and the
+-- errors are appended to the tree.
+function done(item)
+	if item:has_attribute("keep") then
+		return nil
+	end
+	local result = TextTree.new("done")
+	result:append_text(item:text() .. " " .. tostring(config.mode))
+	return { result }
+end
+
+function write_config(item)
+	config.mode = "changed"
+	return nil
+end
+
+function nested(item)
+	item:parallel_map("item", "done")
+	return nil
+end
+
+local function try(textTree, name)
+	local ok, message = pcall(function()
+		textTree:parallel_map("item", name)
+	end)
+	-- Keep only the first line, without the traceback.
+	message = tostring(message):match("^[^\n]*")
+	textTree:append_text("\n" .. name .. ": " .. (ok and "ok" or message))
+end
+
+function process(textTree)
+	config.mode = "read"
+	try(textTree, "missing")
+	try(textTree, "write_config")
+	try(textTree, "nested")
+	textTree:parallel_map("item", "done")
+	textTree:append_text("\nmode: " .. tostring(config.mode))
+	return textTree
+end
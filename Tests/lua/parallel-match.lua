@@ -0,0 +1,33 @@
+-- Test pass for splicing the results of parallel matching, through
+-- `parallel_map`.  Each `m` node is bracketed, deleted if it has a `drop`
+-- attribute, or replaced by two nodes if it has a `two` attribute.  Before
+-- that, a map that replaces every node but fails on the one with a `fail`
+-- attribute checks that a failed map leaves the tree as it was.
+function bracket(node)
+	if node:has_attribute("drop") then
+		return {}
+	end
+	if node:has_attribute("two") then
+		return { TextTree.new("first"), TextTree.new("second") }
+	end
+	return { "<", node, ">" }
+end
+
+function fail(node)
+	if node:has_attribute("fail") then
+		error("failed on purpose")
+	end
+	return { "replaced" }
+end
+
+function process(textTree)
+	local before = textTree:text()
+	local ok     = pcall(function()
+		textTree:parallel_map("m", "fail")
+	end)
+	local after  = textTree:text()
+	textTree:parallel_map("m", "bracket")
+	textTree:append_text("\nfailed: " .. tostring(not ok) .. ", unchanged: " ..
+	                     tostring(before == after))
+	return textTree
+end
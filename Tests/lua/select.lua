@@ -0,0 +1,38 @@
+-- Test pass for selectors.  Each selector below is matched against the tree
+-- and against a deep clone of it, and the `id` attributes of the matches,
+-- each with the index of the selector in the list that it matched, replace
+-- the tree.
+local selectors = {
+	"item",
+	"list item",
+	"list > item",
+	"list > * > item",
+	"[done]",
+	"item[done=yes]",
+	"item[done='no']",
+	"item, [done]",
+	"item[done], item[done=yes]",
+	"list list, list > item[done]",
+}
+
+local function matches(tree, selector)
+	local results = {}
+	tree:select(selector, function(node, index)
+		results[#results + 1] = node:attribute("id") .. ":" .. index
+	end)
+	return table.concat(results, " ")
+end
+
+function process(textTree)
+	local clone  = textTree:deep_clone()
+	local result = TextTree.new("results")
+	for _, selector in ipairs(selectors) do
+		local original = matches(textTree, selector)
+		local cloned   = matches(clone, selector)
+		result:append_text("\n" .. selector .. ": " .. original)
+		if cloned ~= original then
+			result:append_text(" (clone: " .. cloned .. ")")
+		end
+	end
+	return result
+end
@@ -0,0 +1,28 @@
+-- Test pass for templates.  Each `note` node is replaced by a template that
+-- uses the `body` hole three times, so that the later uses get copies of
+-- the nodes that fill it, and the `level` hole as an attribute.  The first
+-- copy is then changed, to check that the copies are independent.
+local boxed = TextTree.template({
+	kind = "box",
+	attributes = { level = { hole = "level" } },
+	children = {
+		{ kind = "first", children = { { hole = "body" } } },
+		{ kind = "second", children = { "[", { hole = "body" }, "]" } },
+		{ hole = "body" },
+	},
+})
+
+function process(textTree)
+	textTree:match("note", function(note)
+		local box = boxed({
+			level = note:attribute("level"),
+			body  = note:extract_children(),
+		})
+		box.children[1]:match("b", function(b)
+			b.kind = "changed"
+			return { b }
+		end)
+		return { box }
+	end)
+	return textTree
+end
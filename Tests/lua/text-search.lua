@@ -0,0 +1,24 @@
+-- Test pass for `find_all` and `find_string`.  Each `search` node is
+-- searched for the patterns in its `for` attribute, separated by `|`.  The
+-- matches that `find_all` returns, as pattern:offset pairs, and the offset
+-- that `find_string` returns for each pattern are appended to the node.
+function process(textTree)
+	textTree:match("search", function(search)
+		local patterns = {}
+		for pattern in search:attribute("for"):gmatch("[^|]+") do
+			patterns[#patterns + 1] = pattern
+		end
+		local all = {}
+		for _, match in ipairs(search:find_all(patterns)) do
+			all[#all + 1] = patterns[match.pattern] .. ":" .. match.offset
+		end
+		local first = {}
+		for _, pattern in ipairs(patterns) do
+			first[#first + 1] = pattern .. ":" .. search:find_string(pattern)
+		end
+		search:append_text(" -> all " .. table.concat(all, " ") ..
+		                   "; first " .. table.concat(first, " "))
+		return { search }
+	end)
+	return textTree
+end
@@ -0,0 +1,31 @@
+-- Test pass for typed attributes.  Nodes whose kind names a value in the
+-- table below get that value as their `value` attribute, which the output
+-- pass formats as text.  The type and value read back, and whether a missing
+-- attribute is nil, are appended to each node.
+local values = {
+	int       = 42,
+	negative  = -7,
+	double    = 0.1,
+	large     = 2.5e10,
+	bool      = true,
+	["false"] = false,
+}
+
+function process(textTree)
+	textTree:match_any({ "int", "negative", "double", "large", "bool", "false",
+	                     "text" }, function(node)
+		if values[node.kind] ~= nil then
+			node:attribute_set("value", values[node.kind])
+		end
+		local value = node:attribute("value")
+		node:append_text(type(value) .. ":" .. tostring(value) .. " missing:" ..
+		                 tostring(node:attribute("missing") == nil))
+		return { node }
+	end)
+	local sum = TextTree.new("sum")
+	sum:attribute_set("int", 40)
+	sum:attribute_set("int", sum:attribute("int") + 2)
+	sum:append_text(tostring(sum:attribute("int") + 0.5))
+	textTree:append_child(sum)
+	return textTree
+end
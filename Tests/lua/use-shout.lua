@@ -0,0 +1,10 @@
+-- Test pass for shared Lua states.  Appends a line that says whether the
+-- function that `define-shout` adds to the string library is visible.
+function process(textTree)
+	if string.shout then
+		textTree:append_text(("shared"):shout())
+	else
+		textTree:append_text("not shared")
+	end
+	return textTree
+end
@@ -0,0 +1,42 @@
+-- Test pass for visitors that change the siblings of the child that they
+-- visit.  Each `take-next` node takes the child after it, each `drop-next`
+-- node removes the child after it, each `append` node appends a `count` node
+-- to its parent, each `count` node is replaced by the number of children
+-- that its parent has when it is visited, and each `last` node is replaced
+-- by the kind of its parent's last child node.
+function process(textTree)
+	local children = {}
+	for i, child in ipairs(textTree.children) do
+		children[i] = child
+	end
+	local function next_sibling(node)
+		for i, sibling in ipairs(children) do
+			if sibling == node then
+				return children[i + 1]
+			end
+		end
+	end
+	textTree:visit(function(child)
+		if type(child) == "string" then
+			return { child }
+		end
+		if child.kind == "take-next" then
+			child:append_child(next_sibling(child))
+		elseif child.kind == "drop-next" then
+			textTree:remove_child(next_sibling(child))
+		elseif child.kind == "append" then
+			textTree:new_child("count")
+		elseif child.kind == "count" then
+			return { tostring(#textTree.children) }
+		elseif child.kind == "last" then
+			local siblings = textTree.children
+			for i = #siblings, 1, -1 do
+				if type(siblings[i]) ~= "string" then
+					return { siblings[i].kind }
+				end
+			end
+		end
+		return { child }
+	end)
+	return textTree
+end
@@ -0,0 +1,39 @@
+-- Test pass for walkers over a tree that is modified while it is walked.
+-- `drop` nodes are removed with the walker and `swap` nodes are replaced
+-- with it.  `remove-self` nodes remove themselves from their parent, and
+-- `remove-self-and-next` nodes also remove the node after them, without
+-- telling the walker.  The kinds of the visited nodes are appended to the
+-- tree.
+function process(textTree)
+	local visited = {}
+	local walker = textTree:walker()
+	while walker:next() do
+		local kind = walker.kind
+		visited[#visited + 1] = kind
+		if kind == "drop" then
+			walker:remove()
+		elseif kind == "swap" then
+			local new = TextTree.new("new")
+			walker:replace("swapped", new)
+		elseif (kind == "remove-self") or (kind == "remove-self-and-next") then
+			local node = walker.node
+			local parent = node:parent()
+			if kind == "remove-self-and-next" then
+				local children = {}
+				for i, child in ipairs(parent.children) do
+					children[i] = child
+				end
+				for i, child in ipairs(children) do
+					if child == node then
+						parent:remove_child(children[i + 1])
+						break
+					end
+				end
+			end
+			parent:remove_child(node)
+			walker:skip_children()
+		end
+	end
+	textTree:append_text("\nvisited: " .. table.concat(visited, " "))
+	return textTree
+end
@@ -5,5 +5,23 @@ if [ "$(uname)" == "Darwin" ]; then
 	LIBSUFFIX=dylib
 fi
 
-echo $1/igk --plugin "$1/libigk-clang.$LIBSUFFIX" --plugin "$1/libigk-treesitter.$LIBSUFFIX" --lua-directory "$2/lua/" --pass $4 --file "$3.in" --pass TeXOutputPass \| diff -u "$3.out" -
-$1/igk --plugin "$1/libigk-clang.$LIBSUFFIX" --plugin "$1/libigk-treesitter.$LIBSUFFIX" --lua-directory "$2/lua/" --pass $4 --file "$3.in" --pass TeXOutputPass | diff -u "$3.out" -
+BUILD_DIR="$1"
+SOURCE_DIR="$2"
+TEST="$3"
+PASS="$4"
+
+igk()
+{
+	"$BUILD_DIR/igk" --plugin "$BUILD_DIR/libigk-clang.$LIBSUFFIX" --plugin "$BUILD_DIR/libigk-treesitter.$LIBSUFFIX" --lua-directory "$SOURCE_DIR/lua/" --lua-directory "$SOURCE_DIR/Tests/lua/" "$@"
+}
+
+# Tests that need more than one run, or extra options, provide a script that
+# runs igk and writes the output to compare.
+if [ -f "$TEST.sh" ]; then
+	echo . "$TEST.sh" \| diff -u "$TEST.out" -
+	. "$TEST.sh" | diff -u "$TEST.out" -
+	exit
+fi
+
+echo igk --pass $PASS --file "$TEST.in" --pass TeXOutputPass \| diff -u "$TEST.out" -
+igk --pass $PASS --file "$TEST.in" --pass TeXOutputPass | diff -u "$TEST.out" -
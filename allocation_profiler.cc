@@ -0,0 +1,105 @@
+// Replacement global allocation functions for `--profile-allocations`.
+//
+// Only the throwing forms of `operator new` are replaced.  The standard
+// library implements the nothrow forms in terms of these.  Every form of
+// `operator delete` is replaced, because some runtimes, such as the
+// sanitizers, provide their own sized forms that would not match.
+#include "allocation_profiler.hh"
+
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	/**
+	 * Allocate `size` bytes with `allocate`, calling the new handler until
+	 * it succeeds, as `operator new` must.
+	 */
+	template<typename Allocate>
+	void *allocate_or_throw(size_t size, Allocate &&allocate)
+	{
+		if (size == 0)
+		{
+			size = 1;
+		}
+		while (true)
+		{
+			if (void *pointer = allocate(size))
+			{
+				AllocationProfiler::record(size);
+				return pointer;
+			}
+			auto handler = std::get_new_handler();
+			if (handler == nullptr)
+			{
+				throw std::bad_alloc();
+			}
+			handler();
+		}
+	}
+} // namespace
+
+void *operator new(size_t size)
+{
+	return allocate_or_throw(size, [](size_t size) { return malloc(size); });
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	return allocate_or_throw(size, [&](size_t size) {
+		// `aligned_alloc` requires the size to be a multiple of the
+		// alignment.
+		size_t align = static_cast<size_t>(alignment);
+		return aligned_alloc(align, (size + align - 1) & ~(align - 1));
+	});
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void operator delete(void *pointer) noexcept
+{
+	free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+	free(pointer);
+}
+
+void operator delete(void *pointer, std::align_val_t) noexcept
+{
+	free(pointer);
+}
+
+void operator delete[](void *pointer, std::align_val_t) noexcept
+{
+	free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+	free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept
+{
+	free(pointer);
+}
+
+void operator delete(void *pointer, size_t, std::align_val_t) noexcept
+{
+	free(pointer);
+}
+
+void operator delete[](void *pointer, size_t, std::align_val_t) noexcept
+{
+	free(pointer);
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+/**
+ * Counts heap allocations, for `--profile-allocations`, and attributes them
+ * to the pass that was running and, in Lua passes, to the Lua function that
+ * was running.
+ *
+ * C++ allocations are counted by the replacement `operator new` in
+ * `allocation_profiler.cc`.  Lua allocations are counted by `record_lua`,
+ * which the allocator of Lua states calls.  Lua passes track the current
+ * function with a debug hook, which is installed only when profiling.  Native
+ * functions called from Lua are charged to the Lua function that called
+ * them.
+ *
+ * Passes and functions are entered and left only on the thread that runs
+ * the passes.  Allocations on worker threads are charged to the pass that is
+ * running, and not to any Lua function, because the function running on the
+ * pass thread is unrelated to the work that the worker is doing.
+ */
+class AllocationProfiler
+{
+	public:
+	/**
+	 * Allocations made in a function of a pass.  The function is empty for
+	 * allocations made by the pass outside of any Lua function.
+	 */
+	struct Site
+	{
+		std::string           pass;
+		std::string           function;
+		std::atomic<uint64_t> allocations    = 0;
+		std::atomic<uint64_t> bytes          = 0;
+		std::atomic<uint64_t> luaAllocations = 0;
+		std::atomic<uint64_t> luaBytes       = 0;
+
+		Site(std::string pass, std::string function)
+		  : pass(std::move(pass)), function(std::move(function))
+		{
+		}
+
+		/**
+		 * Returns the total number of bytes allocated.
+		 */
+		uint64_t total_bytes() const
+		{
+			return bytes + luaBytes;
+		}
+	};
+
+	private:
+	/**
+	 * True if profiling is enabled.  This is checked on every allocation,
+	 * including those made before `main`, so it is a constant-initialised
+	 * static rather than a member of the singleton.
+	 */
+	static inline std::atomic<bool> enabled = false;
+
+	/// Every site that has been seen.  A deque, so that sites do not move.
+	std::deque<Site> sites;
+
+	/// The sites, indexed by pass and function.
+	std::map<std::pair<std::string, std::string>, Site *> siteIndex;
+
+	/**
+	 * The sites of the Lua functions seen in the current pass, indexed by
+	 * their source and first line, to avoid building their names on every
+	 * call.
+	 */
+	std::map<std::pair<const void *, int>, Site *> functionSites;
+
+	/// The name of the current pass.
+	std::string currentPass;
+
+	/// The sites of the functions that are running, innermost last.
+	std::vector<Site *> stack;
+
+	/// The site that allocations on the pass thread are charged to.
+	std::atomic<Site *> current = nullptr;
+
+	/// The site that allocations on other threads are charged to.
+	std::atomic<Site *> currentPassSite = nullptr;
+
+	/// True on the thread that runs the passes.
+	static inline thread_local bool isPassThread = false;
+
+	/// The site for allocations made outside any pass.
+	Site *outside = nullptr;
+
+	/**
+	 * Returns the site for `function` in `pass`, creating it if necessary.
+	 */
+	Site *site(const std::string &pass, const std::string &function)
+	{
+		auto &entry = siteIndex[{pass, function}];
+		if (entry == nullptr)
+		{
+			entry = &sites.emplace_back(pass, function);
+		}
+		return entry;
+	}
+
+	/**
+	 * Charge allocations to the innermost function.
+	 */
+	void update_current()
+	{
+		current         = stack.empty() ? outside : stack.back();
+		currentPassSite = stack.empty() ? outside : stack.front();
+	}
+
+	/**
+	 * Returns the site that an allocation on this thread is charged to, or
+	 * null if there is none yet.
+	 */
+	static Site *charged_site()
+	{
+		auto &instance = shared_instance();
+		return (isPassThread ? instance.current : instance.currentPassSite)
+		  .load(std::memory_order_relaxed);
+	}
+
+	public:
+	/**
+	 * Enable profiling.  Must be called on the thread that runs the passes.
+	 */
+	void enable()
+	{
+		outside      = site("(outside passes)", "");
+		isPassThread = true;
+		update_current();
+		enabled = true;
+	}
+
+	/**
+	 * Returns true if profiling is enabled.
+	 */
+	static bool is_enabled()
+	{
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Start charging allocations to a pass.  `name` is the name of the pass,
+	 * or a description of another phase such as scanning the input.
+	 */
+	void begin(std::string name)
+	{
+		if (!is_enabled())
+		{
+			return;
+		}
+		currentPass = std::move(name);
+		functionSites.clear();
+		stack.assign(1, site(currentPass, ""));
+		update_current();
+	}
+
+	/**
+	 * Stop charging allocations to the current pass.
+	 */
+	void end()
+	{
+		stack.clear();
+		update_current();
+	}
+
+	/**
+	 * Enter a Lua function, identified by its source and first line.
+	 * `name` returns the name to report it under and is called only the
+	 * first time the function is seen in a pass.
+	 */
+	template<typename NameFn>
+	void enter_lua_function(const void *source, int line, NameFn &&name)
+	{
+		if (stack.empty())
+		{
+			return;
+		}
+		auto &entry = functionSites[{source, line}];
+		if (entry == nullptr)
+		{
+			entry = site(currentPass, name());
+		}
+		stack.push_back(entry);
+		update_current();
+	}
+
+	/**
+	 * Enter a native function called from Lua, which is charged to its
+	 * caller.
+	 */
+	void enter_native_function()
+	{
+		if (stack.empty())
+		{
+			return;
+		}
+		stack.push_back(stack.back());
+	}
+
+	/**
+	 * Leave the innermost function.  The pass itself is never left.
+	 */
+	void leave_function()
+	{
+		if (stack.size() < 2)
+		{
+			return;
+		}
+		stack.pop_back();
+		update_current();
+	}
+
+	/**
+	 * Record a C++ allocation of `size` bytes.
+	 */
+	static void record(size_t size)
+	{
+		if (!is_enabled())
+		{
+			return;
+		}
+		if (Site *site = charged_site())
+		{
+			site->allocations.fetch_add(1, std::memory_order_relaxed);
+			site->bytes.fetch_add(size, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Record a call to a Lua state's allocator, with the arguments of
+	 * `lua_Alloc`.  Each allocation and each resize that grows a block is
+	 * counted as an allocation of the new size.
+	 */
+	static void
+	record_lua(const void *pointer, size_t oldSize, size_t newSize)
+	{
+		// When `pointer` is null, `oldSize` is the type of the object.
+		if (!is_enabled() || (newSize == 0) ||
+		    ((pointer != nullptr) && (newSize <= oldSize)))
+		{
+			return;
+		}
+		if (Site *site = charged_site())
+		{
+			site->luaAllocations.fetch_add(1, std::memory_order_relaxed);
+			site->luaBytes.fetch_add(newSize, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Print the `count` sites that allocated the most bytes, and a total.
+	 */
+	void print_report(std::ostream &out, size_t count) const
+	{
+		out << "Allocations on worker threads are charged to their pass, "
+		       "not to a Lua function.\n";
+		std::vector<const Site *> sorted;
+		for (auto &site : sites)
+		{
+			sorted.push_back(&site);
+		}
+		std::ranges::stable_sort(sorted, [](auto *a, auto *b) {
+			return a->total_bytes() > b->total_bytes();
+		});
+		auto row = [&](std::string_view pass,
+		               std::string_view function,
+		               uint64_t         allocations,
+		               uint64_t         bytes,
+		               uint64_t         luaAllocations,
+		               uint64_t         luaBytes) {
+			fmt::print(out,
+			           "{:<24} {:<32} {:>12} {:>14} {:>12} {:>14}\n",
+			           pass,
+			           function.empty() ? "-" : function,
+			           allocations,
+			           bytes,
+			           luaAllocations,
+			           luaBytes);
+		};
+		fmt::print(out,
+		           "{:<24} {:<32} {:>12} {:>14} {:>12} {:>14}\n",
+		           "Pass",
+		           "Lua function",
+		           "Allocations",
+		           "Bytes",
+		           "Lua allocs",
+		           "Lua bytes");
+		uint64_t totals[4] = {0, 0, 0, 0};
+		for (size_t i = 0; i < sorted.size(); i++)
+		{
+			auto *site = sorted[i];
+			if (i < count)
+			{
+				row(site->pass,
+				    site->function,
+				    site->allocations,
+				    site->bytes,
+				    site->luaAllocations,
+				    site->luaBytes);
+			}
+			totals[0] += site->allocations;
+			totals[1] += site->bytes;
+			totals[2] += site->luaAllocations;
+			totals[3] += site->luaBytes;
+		}
+		row("Total", "", totals[0], totals[1], totals[2], totals[3]);
+		out << std::flush;
+	}
+
+	/**
+	 * Returns a singleton instance of this class.  This is never destroyed,
+	 * because allocations made by later destructors still record into it.
+	 */
+	static AllocationProfiler &shared_instance()
+	{
+		static AllocationProfiler *instance = new AllocationProfiler;
+		return *instance;
+	}
+};
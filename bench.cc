@@ -0,0 +1,450 @@
+// Microbenchmarks for text tree operations.
+//
+// Each benchmark runs at several sizes, doubling each time, and estimates
+// how the time grows with the size: the slope of log(time) against
+// log(size), which is 1 for a linear operation and 2 for a quadratic one.
+// A benchmark fails if the slope is above a limit, so that accidentally
+// quadratic operations are caught.  Cache effects make large linear
+// operations a little superlinear, so the default limit is 1.5 rather than
+// 1.
+//
+// The Lua benchmarks use the real bindings, so this includes the driver
+// without its `main`.
+#define IGK_NO_MAIN
+#include "scanner.cc"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <unistd.h>
+
+namespace
+{
+	/**
+	 * A benchmark.  `run` builds whatever input it needs for size `n` and
+	 * returns the time taken by the operation being measured, excluding the
+	 * setup.
+	 */
+	struct Benchmark
+	{
+		std::string                  name;
+		std::vector<size_t>          sizes;
+		std::function<double(size_t)> run;
+	};
+
+	using Clock = std::chrono::steady_clock;
+
+	/**
+	 * Time `fn`, in seconds.
+	 */
+	template<typename Fn>
+	double time(Fn &&fn)
+	{
+		auto start = Clock::now();
+		fn();
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	/**
+	 * Sizes doubling from `first`, four of them.
+	 */
+	std::vector<size_t> doubling(size_t first)
+	{
+		return {first, first * 2, first * 4, first * 8};
+	}
+
+	/**
+	 * Build a root with `n` paragraph children, each holding some text.
+	 * Every eighth paragraph contains an emphasis node.
+	 */
+	TextTreePointer wide_tree(size_t n)
+	{
+		auto root = TextTree::create();
+		root->kind("document");
+		for (size_t i = 0; i < n; i++)
+		{
+			auto para = root->new_child();
+			para->kind("para");
+			para->append_text("Some words in a paragraph, ");
+			if ((i % 8) == 0)
+			{
+				auto emphasis = para->new_child();
+				emphasis->kind("emph");
+				emphasis->append_text("emphasised");
+			}
+			para->append_text(" and some more.\n");
+		}
+		return root;
+	}
+
+	/**
+	 * Build a chain of `n` nested nodes, each with a little text before its
+	 * child.
+	 */
+	TextTreePointer deep_tree(size_t n)
+	{
+		auto root = TextTree::create();
+		root->kind("document");
+		auto node = root;
+		for (size_t i = 0; i < n; i++)
+		{
+			node->append_text("text ");
+			node = node->new_child();
+			node->kind((i % 8) == 0 ? "emph" : "span");
+		}
+		node->append_text("needle");
+		return root;
+	}
+
+	/**
+	 * A Lua pass loaded from `source`, written to a temporary file.  The
+	 * benchmark names contain slashes, which are replaced in the file name.
+	 */
+	std::shared_ptr<TextPass> lua_pass(std::string_view name,
+	                                   std::string_view source)
+	{
+		std::string fileName{name};
+		std::ranges::replace(fileName, '/', '-');
+		auto path = std::filesystem::temp_directory_path() /
+		            fmt::format("igk-bench-{}-{}.lua", getpid(), fileName);
+		{
+			std::ofstream file(path);
+			file << source;
+		}
+		std::shared_ptr<TextPass> pass = std::make_shared<LuaPass>(path);
+		std::filesystem::remove(path);
+		return pass;
+	}
+
+	/**
+	 * Returns a benchmark that runs a Lua pass over a wide tree.  The pass
+	 * is loaded once, outside the timing.
+	 */
+	Benchmark lua_benchmark(std::string name, std::string_view source)
+	{
+		auto pass = lua_pass(name, source);
+		return {name, doubling(2048), [pass](size_t n) {
+			        auto tree = wide_tree(n);
+			        return time([&] { pass->process(tree); });
+		        }};
+	}
+
+	/**
+	 * Returns a benchmark that creates `n` Lua passes, as a pipeline of `n`
+	 * passes does, either each with its own state or sharing one.  The time
+	 * for a shared state includes setting it up once.
+	 */
+	Benchmark lua_startup_benchmark(std::string name, bool share)
+	{
+		return {name, doubling(8), [share](size_t n) {
+			        auto path =
+			          std::filesystem::temp_directory_path() /
+			          fmt::format("igk-bench-{}-startup.lua", getpid());
+			        {
+				        std::ofstream file(path);
+				        file << "function process(tree)\n\treturn tree\nend\n";
+			        }
+			        std::vector<std::shared_ptr<TextPass>> passes;
+			        LuaPass::share_states(share);
+			        double elapsed = time([&] {
+				        for (size_t i = 0; i < n; i++)
+				        {
+					        passes.push_back(std::make_shared<LuaPass>(path));
+				        }
+			        });
+			        LuaPass::share_states(false);
+			        std::filesystem::remove(path);
+			        return elapsed;
+		        }};
+	}
+
+	std::vector<Benchmark> benchmarks()
+	{
+		TextTree::Visitor keep = [](TextTree::Child &child) {
+			return std::vector<TextTree::Child>{child};
+		};
+		std::vector<Benchmark> all;
+		all.push_back({"visit/wide", doubling(8192), [=](size_t n) {
+			               auto tree    = wide_tree(n);
+			               auto visitor = keep;
+			               return time([&] { tree->visit(std::move(visitor)); });
+		               }});
+		all.push_back({"match/wide", doubling(8192), [=](size_t n) {
+			               auto tree    = wide_tree(n);
+			               auto visitor = keep;
+			               return time([&] { tree->match("emph", visitor); });
+		               }});
+		// A visitor that does some work on each child, as passes that
+		// extract or index text do, to compare sequential and parallel
+		// visits.  Run with different --threads values to see how the
+		// parallel version scales.
+		TextTree::Visitor extract = [](TextTree::Child &child) {
+			static std::atomic<size_t> length;
+			if (auto *node = std::get_if<TextTreePointer>(&child))
+			{
+				length += (*node)->text().size();
+			}
+			return std::vector<TextTree::Child>{child};
+		};
+		all.push_back({"visit/text", doubling(8192), [=](size_t n) {
+			               auto tree    = wide_tree(n);
+			               auto visitor = extract;
+			               return time([&] { tree->visit(std::move(visitor)); });
+		               }});
+		all.push_back({"parallel_visit/text", doubling(8192), [=](size_t n) {
+			               auto tree = wide_tree(n);
+			               return time([&] { tree->parallel_visit(extract); });
+		               }});
+		// Every paragraph matches, so the results are spliced into one
+		// parent many times.
+		TextTree::Visitor separate = [](TextTree::Child &child) {
+			return std::vector<TextTree::Child>{child, "\n"};
+		};
+		all.push_back({"parallel_match/wide", doubling(8192), [=](size_t n) {
+			               auto tree = wide_tree(n);
+			               return time(
+			                 [&] { tree->parallel_match("para", separate); });
+		               }});
+		all.push_back({"match/deep", doubling(512), [=](size_t n) {
+			               // Nothing matches, so this walks the whole chain.
+			               auto tree    = deep_tree(n);
+			               auto visitor = keep;
+			               return time([&] { tree->match("missing", visitor); });
+		               }});
+		all.push_back({"split_at_byte_index/wide",
+		               doubling(8192),
+		               [](size_t n) {
+			               auto tree   = wide_tree(n);
+			               auto middle = tree->text_length() / 2;
+			               return time([&] { tree->split_at_byte_index(middle); });
+		               }});
+		all.push_back({"split_at_byte_index/deep",
+		               doubling(512),
+		               [](size_t n) {
+			               auto tree   = deep_tree(n);
+			               auto middle = tree->text_length() / 2;
+			               return time([&] { tree->split_at_byte_index(middle); });
+		               }});
+		all.push_back({"find_string/wide", doubling(8192), [](size_t n) {
+			               auto tree = wide_tree(n);
+			               tree->append_text("needle");
+			               return time([&] { tree->find_string("needle"); });
+		               }});
+		all.push_back({"find_string/deep", doubling(512), [](size_t n) {
+			               auto tree = deep_tree(n);
+			               return time([&] { tree->find_string("needle"); });
+		               }});
+		all.push_back({"deep_clone+read/wide", doubling(8192), [](size_t n) {
+			               auto tree = wide_tree(n);
+			               return time([&] {
+				               auto clone = tree->deep_clone();
+				               clone->node_count();
+			               });
+		               }});
+		all.push_back({"deep_clone+modify/wide",
+		               doubling(8192),
+		               [](size_t n) {
+			               auto tree  = wide_tree(n);
+			               auto clone = tree->deep_clone();
+			               return time([&] {
+				               for (auto &child : tree->children())
+				               {
+					               std::get<TextTreePointer>(child)->kind("p");
+				               }
+			               });
+		               }});
+		all.push_back({"text/wide", doubling(8192), [](size_t n) {
+			               auto tree = wide_tree(n);
+			               return time([&] { tree->text(); });
+		               }});
+		all.push_back({"text/deep", doubling(512), [](size_t n) {
+			               auto tree = deep_tree(n);
+			               return time([&] { tree->text(); });
+		               }});
+		all.push_back({"append_child/new", doubling(8192), [](size_t n) {
+			               auto tree = TextTree::create();
+			               std::vector<TextTreePointer> nodes;
+			               for (size_t i = 0; i < n; i++)
+			               {
+				               nodes.push_back(TextTree::create());
+			               }
+			               return time([&] {
+				               for (auto &node : nodes)
+				               {
+					               tree->append_child(node);
+				               }
+			               });
+		               }});
+		all.push_back({"append_child/reparent",
+		               doubling(8192),
+		               [](size_t n) {
+			               auto from = wide_tree(n);
+			               auto to   = TextTree::create();
+			               std::vector<TextTreePointer> nodes;
+			               for (auto &child : from->children())
+			               {
+				               nodes.push_back(std::get<TextTreePointer>(child));
+			               }
+			               return time([&] {
+				               for (auto &node : nodes)
+				               {
+					               to->append_child(node);
+				               }
+			               });
+		               }});
+		all.push_back(lua_benchmark("lua/match",
+		                            R"(
+function process(tree)
+	local length = 0
+	tree:match("para", function(node)
+		length = length + node:text_length()
+		node:attribute_set("seen", true)
+		return {node}
+	end)
+	return tree
+end
+)"));
+		all.push_back(lua_benchmark("lua/edit_matches",
+		                            R"(
+function process(tree)
+	local length = 0
+	tree:edit_matches("para", function(node)
+		length = length + node:text_length()
+	end)
+	return tree
+end
+)"));
+		all.push_back(lua_benchmark("lua/walker",
+		                            R"(
+function process(tree)
+	local count = 0
+	local walker = tree:walker()
+	while walker:next() do
+		if walker.kind == "para" then
+			count = count + 1
+		end
+	end
+	return tree
+end
+)"));
+		all.push_back(lua_benchmark("lua/children",
+		                            R"(
+function process(tree)
+	local count = 0
+	for _, child in ipairs(tree.children) do
+		if child.kind == "para" then
+			count = count + 1
+		end
+	end
+	return tree
+end
+)"));
+		all.push_back(lua_benchmark("lua/create",
+		                            R"(
+function process(tree)
+	local root = TextTree.new("list")
+	for i = 1, #tree.children do
+		local item = root:new_child("item")
+		item:append_text("entry")
+	end
+	tree:append_child(root)
+	return tree
+end
+)"));
+		all.push_back(lua_benchmark("lua/template",
+		                            R"(
+local item = TextTree.template({
+	kind = "item",
+	attributes = { index = { hole = "index" } },
+	children = { { kind = "font", children = { { hole = "text" } } } },
+})
+function process(tree)
+	local root = TextTree.new("list")
+	for i = 1, #tree.children do
+		root:append_child(item({ index = i, text = "entry" }))
+	end
+	tree:append_child(root)
+	return tree
+end
+)"));
+		all.push_back(lua_startup_benchmark("lua/startup/fresh", false));
+		all.push_back(lua_startup_benchmark("lua/startup/shared", true));
+		return all;
+	}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	double      minimumTime     = 0.05;
+	double      maximumExponent = 1.5;
+	std::string filter;
+	size_t      threads         = 0;
+
+	CLI::App app{"Microbenchmarks for text tree operations"};
+	app.add_option("--min-time",
+	               minimumTime,
+	               "Minimum time, in seconds, to spend on each size");
+	app.add_option("--max-exponent",
+	               maximumExponent,
+	               "Fail if the time grows faster than the size raised to this "
+	               "power (defaults to 1.5, between linear and quadratic)");
+	app.add_option(
+	  "--filter", filter, "Run only benchmarks whose names contain this");
+	app.add_option("--threads",
+	               threads,
+	               "Number of threads for the parallel benchmarks (defaults "
+	               "to the number of cores)");
+	CLI11_PARSE(app, argc, argv);
+
+	WorkStealingPool::set_thread_count(threads);
+
+	bool failed = false;
+	for (auto &benchmark : benchmarks())
+	{
+		if (!benchmark.name.contains(filter))
+		{
+			continue;
+		}
+		// Take the fastest of several runs of each size, which is the least
+		// affected by noise.
+		std::vector<double> times;
+		for (size_t size : benchmark.sizes)
+		{
+			double best  = std::numeric_limits<double>::infinity();
+			double total = 0;
+			for (size_t runs = 0; (runs < 3) || (total < minimumTime); runs++)
+			{
+				double elapsed = benchmark.run(size);
+				best           = std::min(best, elapsed);
+				total += elapsed;
+			}
+			times.push_back(best);
+		}
+		fmt::print("{:<26}", benchmark.name);
+		for (size_t i = 0; i < times.size(); i++)
+		{
+			fmt::print(" {:>7}: {:>9.1f}us", benchmark.sizes[i], times[i] * 1e6);
+		}
+		// Least-squares fit of log(time) against log(size).
+		double meanX = 0;
+		double meanY = 0;
+		for (size_t i = 0; i < times.size(); i++)
+		{
+			meanX += std::log(double(benchmark.sizes[i])) / times.size();
+			meanY += std::log(times[i]) / times.size();
+		}
+		double covariance = 0;
+		double variance   = 0;
+		for (size_t i = 0; i < times.size(); i++)
+		{
+			double x = std::log(double(benchmark.sizes[i])) - meanX;
+			covariance += x * (std::log(times[i]) - meanY);
+			variance += x * x;
+		}
+		double exponent = covariance / variance;
+		bool   ok       = exponent <= maximumExponent;
+		fmt::print("  n^{:.2f} {}\n", exponent, ok ? "ok" : "FAILED");
+		failed |= !ok;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,664 @@
+#pragma once
+
+#include "document.hh"
+
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+/**
+ * Binary checkpoints of a text tree, so that a pipeline can be resumed after
+ * a pass without rescanning the input and rerunning the earlier passes.
+ *
+ * A checkpoint is a fixed-size header followed by flat tables of fixed-size
+ * records and a blob of string data.  Records refer to each other and to
+ * strings by index, so a checkpoint is read by mapping the file and walking
+ * the tables in place; the only copies are into the reconstructed tree.
+ * Kinds and attributes are interned, text runs are stored once each.
+ * Highlighted code that has not been expanded is stored as its text and
+ * spans, and is not expanded when the checkpoint is written or read.
+ *
+ * As well as the tree, a checkpoint records the source files that its
+ * locations refer to (so diagnostics still work after loading), the shared
+ * `config` state, and the name of the pass after which it was written.
+ * Integers are stored in native byte order and a marker in the header rejects
+ * checkpoints written on a machine with the other byte order.
+ */
+class TreeCheckpoint
+{
+	public:
+	/**
+	 * The type of the configuration state shared between passes.
+	 */
+	using Config =
+	  std::unordered_map<std::string, std::variant<double, bool, std::string>>;
+
+	private:
+	/// Magic number at the start of every checkpoint.
+	static constexpr char Magic[8] = {'I', 'G', 'K', 'C', 'K', 'P', 'T', '\0'};
+	/// Version of the format.  Bump this when changing any record.
+	static constexpr uint32_t Version = 3;
+	/// Value written to detect byte-order mismatches.
+	static constexpr uint32_t ByteOrderMark = 0x01020304;
+	/// Index used for an absent string or file.
+	static constexpr uint32_t None = std::numeric_limits<uint32_t>::max();
+
+	/// The location and number of records in a table.
+	struct Table
+	{
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	struct Header
+	{
+		char     magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		Table    strings;
+		Table    nodes;
+		Table    children;
+		Table    attributes;
+		Table    spans;
+		Table    files;
+		Table    config;
+		/// Offset of the string data blob.
+		uint64_t stringData;
+		/// Size of the string data blob.
+		uint64_t stringDataSize;
+		/// String index of the name of the pass that produced this tree.
+		uint32_t pass;
+		uint32_t padding;
+	};
+
+	/// A string, as a range in the string data blob.
+	struct StringRecord
+	{
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	/// An expanded source location.
+	struct Location
+	{
+		uint32_t file;
+		uint32_t line;
+		uint32_t offset;
+	};
+
+	/**
+	 * A node.  Its children, attributes, and spans are contiguous runs in
+	 * their tables.  Node 0 is the root.
+	 */
+	struct NodeRecord
+	{
+		uint32_t kind;
+		uint32_t firstChild;
+		uint32_t childCount;
+		uint32_t firstAttribute;
+		uint32_t attributeCount;
+		/// String index of the text of unexpanded highlighted code, or None.
+		uint32_t codeText;
+		uint32_t firstSpan;
+		uint32_t spanCount;
+		Location start;
+		Location end;
+	};
+
+	/// A highlighted token in a node's code text.  `kind` is a string index.
+	struct SpanRecord
+	{
+		uint32_t offset;
+		uint32_t length;
+		uint32_t kind;
+	};
+
+	/// A child, either a text run (a string index) or a node index.
+	struct ChildRecord
+	{
+		uint32_t isNode;
+		uint32_t index;
+	};
+
+	/// A source file that locations refer to, by its index in this table.
+	struct FileRecord
+	{
+		uint32_t name;
+		uint32_t contents;
+	};
+
+	/**
+	 * A named, typed value: an attribute or a config entry.  `value` is a
+	 * string index, a bool, an integer, or the bits of a double.
+	 */
+	struct ValueRecord
+	{
+		enum Type : uint32_t
+		{
+			Double,
+			Bool,
+			String,
+			Integer,
+		};
+		uint32_t name;
+		Type     type;
+		uint64_t value;
+	};
+
+	using AttributeRecord = ValueRecord;
+	using ConfigRecord    = ValueRecord;
+
+	static_assert(std::is_trivially_copyable_v<Header> &&
+	                std::is_trivially_copyable_v<NodeRecord> &&
+	                std::is_trivially_copyable_v<ValueRecord>,
+	              "Checkpoint records must be trivially copyable");
+
+	/**
+	 * Accumulates the tables for a checkpoint while walking a tree.
+	 */
+	class Writer
+	{
+		std::vector<StringRecord>                  strings;
+		std::string                                stringData;
+		std::unordered_map<std::string, uint32_t>  interned;
+		std::vector<NodeRecord>                    nodes;
+		std::vector<ChildRecord>                   children;
+		std::vector<AttributeRecord>               attributes;
+		std::vector<SpanRecord>                    spans;
+		std::vector<FileRecord>                    files;
+		std::vector<ConfigRecord>                  config;
+		std::unordered_map<uint32_t, uint32_t>     fileIndexes;
+		SourceManager                             &sourceManager;
+
+		/// Add a string without deduplicating it.
+		uint32_t add_string(std::string_view string)
+		{
+			strings.push_back({stringData.size(), string.size()});
+			stringData += string;
+			return strings.size() - 1;
+		}
+
+		/// Add a string, reusing an earlier copy if there is one.
+		uint32_t intern(const std::string &string)
+		{
+			if (auto it = interned.find(string); it != interned.end())
+			{
+				return it->second;
+			}
+			auto index = add_string(string);
+			interned.emplace(string, index);
+			return index;
+		}
+
+		/**
+		 * Encode `value`, which is an attribute or config variant.
+		 */
+		template<typename Variant>
+		ValueRecord value_record(const std::string &name, const Variant &value)
+		{
+			ValueRecord record{intern(name), ValueRecord::String, 0};
+			std::visit(
+			  [&](auto &value) {
+				  using T = std::remove_cvref_t<decltype(value)>;
+				  if constexpr (std::is_same_v<T, std::string>)
+				  {
+					  record.value = intern(value);
+				  }
+				  else if constexpr (std::is_same_v<T, bool>)
+				  {
+					  record.type  = ValueRecord::Bool;
+					  record.value = value;
+				  }
+				  else if constexpr (std::is_same_v<T, double>)
+				  {
+					  record.type = ValueRecord::Double;
+					  std::memcpy(&record.value, &value, sizeof(double));
+				  }
+				  else
+				  {
+					  record.type  = ValueRecord::Integer;
+					  record.value = static_cast<uint64_t>(value);
+				  }
+			  },
+			  value);
+			return record;
+		}
+
+		Location location(SourceLocation location)
+		{
+			if (!location.is_valid())
+			{
+				return {None, None, None};
+			}
+			auto expanded = sourceManager.expand(location);
+			auto [it, inserted] =
+			  fileIndexes.try_emplace(expanded.fileID, files.size());
+			if (inserted)
+			{
+				files.push_back(
+				  {intern(std::string(sourceManager.file_for_id(expanded.fileID))),
+				   add_string(sourceManager.contents_for_id(expanded.fileID))});
+			}
+			return {it->second, expanded.line, expanded.offset};
+		}
+
+		/**
+		 * Fill in the record for `node`, which has already been allocated at
+		 * `index`.  Children are allocated as a contiguous run before any of
+		 * them is visited.  The node is read through its stored contents,
+		 * so that saving does not copy lazy clones, drop removed children,
+		 * or expand highlighted code.
+		 */
+		void add_node(const TextTree &node, size_t index)
+		{
+			NodeRecord record;
+			record.kind           = intern(node.kind());
+			record.start          = location(node.sourceRange.first);
+			record.end            = location(node.sourceRange.second);
+			auto &nodeAttributes  = node.stored_attributes();
+			record.firstAttribute = attributes.size();
+			record.attributeCount = nodeAttributes.size();
+			for (auto &[name, value] : nodeAttributes)
+			{
+				attributes.push_back(value_record(name, value));
+			}
+			record.codeText  = None;
+			record.firstSpan = spans.size();
+			record.spanCount = 0;
+			if (auto code = node.stored_code_spans())
+			{
+				record.codeText  = add_string(code->text());
+				record.spanCount = code->spans().size();
+				for (auto &span : code->spans())
+				{
+					auto kind = intern(code->kind_name(span.kind));
+					spans.push_back({span.offset, span.length, kind});
+				}
+			}
+			// Removed children are null and are not written.
+			auto &nodeChildren = node.stored_children();
+			record.firstChild  = children.size();
+			record.childCount  = 0;
+			for (auto &child : nodeChildren)
+			{
+				auto *childNode = std::get_if<TextTreePointer>(&child);
+				if ((childNode == nullptr) || (*childNode != nullptr))
+				{
+					record.childCount++;
+				}
+			}
+			children.resize(children.size() + record.childCount);
+			nodes[index] = record;
+			size_t i     = record.firstChild;
+			for (auto &child : nodeChildren)
+			{
+				if (std::holds_alternative<std::string>(child))
+				{
+					auto text     = add_string(std::get<std::string>(child));
+					children[i++] = {0, text};
+					continue;
+				}
+				auto &childNode = std::get<TextTreePointer>(child);
+				if (childNode == nullptr)
+				{
+					continue;
+				}
+				size_t childIndex = nodes.size();
+				nodes.emplace_back();
+				children[i++] = {1, uint32_t(childIndex)};
+				add_node(*childNode, childIndex);
+			}
+		}
+
+		template<typename T>
+		static Table
+		write_table(std::ostream &out, uint64_t &offset, const std::vector<T> &table)
+		{
+			// Keep every table aligned for in-place access.
+			static constexpr char Padding[alignof(uint64_t)] = {};
+			size_t padding = (alignof(uint64_t) - (offset % alignof(uint64_t))) %
+			                 alignof(uint64_t);
+			out.write(Padding, padding);
+			offset += padding;
+			Table result{offset, table.size()};
+			out.write(reinterpret_cast<const char *>(table.data()),
+			          table.size() * sizeof(T));
+			offset += table.size() * sizeof(T);
+			return result;
+		}
+
+		public:
+		Writer(SourceManager &sourceManager) : sourceManager(sourceManager) {}
+
+		void add_tree(const TextTree &root)
+		{
+			nodes.emplace_back();
+			add_node(root, 0);
+		}
+
+		void add_config(const Config &entries)
+		{
+			for (auto &[name, value] : entries)
+			{
+				config.push_back(value_record(name, value));
+			}
+		}
+
+		void write(std::ostream &out, const std::string &pass)
+		{
+			Header header{};
+			std::memcpy(header.magic, Magic, sizeof(Magic));
+			header.version   = Version;
+			header.byteOrder = ByteOrderMark;
+			header.pass      = intern(pass);
+			header.padding   = 0;
+			out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			uint64_t offset     = sizeof(header);
+			header.strings      = write_table(out, offset, strings);
+			header.nodes        = write_table(out, offset, nodes);
+			header.children     = write_table(out, offset, children);
+			header.attributes   = write_table(out, offset, attributes);
+			header.spans        = write_table(out, offset, spans);
+			header.files        = write_table(out, offset, files);
+			header.config       = write_table(out, offset, config);
+			header.stringData   = offset;
+			header.stringDataSize = stringData.size();
+			out.write(stringData.data(), stringData.size());
+			out.seekp(0);
+			out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		}
+	};
+
+	/**
+	 * A read-only mapping of a checkpoint file.
+	 */
+	class Mapping
+	{
+		const char *base = nullptr;
+		size_t      size = 0;
+
+		public:
+		Mapping(const std::filesystem::path &path)
+		{
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+			{
+				throw std::runtime_error("Unable to open checkpoint " +
+				                         path.string());
+			}
+			struct stat sb;
+			if (fstat(fd, &sb) == 0)
+			{
+				size = sb.st_size;
+			}
+			void *mapped =
+			  size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+			           : MAP_FAILED;
+			close(fd);
+			if (mapped == MAP_FAILED)
+			{
+				throw std::runtime_error("Unable to map checkpoint " +
+				                         path.string());
+			}
+			base = static_cast<const char *>(mapped);
+		}
+
+		~Mapping()
+		{
+			munmap(const_cast<char *>(base), size);
+		}
+
+		/**
+		 * Returns a pointer to the records in `table`, checking that they
+		 * lie inside the file.
+		 */
+		template<typename T>
+		const T *records(const Table &table) const
+		{
+			if ((table.offset > size) ||
+			    (table.count > (size - table.offset) / sizeof(T)) ||
+			    (table.offset % alignof(T) != 0))
+			{
+				throw std::runtime_error("Corrupt checkpoint table");
+			}
+			return reinterpret_cast<const T *>(base + table.offset);
+		}
+
+		const char *data() const
+		{
+			return base;
+		}
+
+		size_t length() const
+		{
+			return size;
+		}
+	};
+
+	/**
+	 * Decode a value record into `Variant`.  Integers are stored as doubles
+	 * if the variant cannot hold them.
+	 */
+	template<typename Variant, typename StringLookup>
+	static Variant read_value(const ValueRecord &record, StringLookup &string)
+	{
+		switch (record.type)
+		{
+			case ValueRecord::Double:
+			{
+				double value;
+				std::memcpy(&value, &record.value, sizeof(double));
+				return value;
+			}
+			case ValueRecord::Bool:
+				return record.value != 0;
+			case ValueRecord::String:
+				if (record.value > std::numeric_limits<uint32_t>::max())
+				{
+					break;
+				}
+				return std::string(string(record.value));
+			case ValueRecord::Integer:
+				if constexpr (std::is_constructible_v<Variant, int64_t>)
+				{
+					return static_cast<int64_t>(record.value);
+				}
+				else
+				{
+					return static_cast<double>(
+					  static_cast<int64_t>(record.value));
+				}
+		}
+		throw std::runtime_error("Corrupt checkpoint value");
+	}
+
+	public:
+	/**
+	 * Write `tree` and `config` to `path`, recording that the tree is the
+	 * output of `pass`.
+	 */
+	static void save(const std::filesystem::path &path,
+	                 const TextTree              &tree,
+	                 const Config                &config,
+	                 const std::string           &pass)
+	{
+		Writer writer(SourceManager::shared_instance());
+		writer.add_tree(tree);
+		writer.add_config(config);
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		if (!out)
+		{
+			throw std::runtime_error("Unable to write checkpoint " +
+			                         path.string());
+		}
+		writer.write(out, pass);
+	}
+
+	/**
+	 * Load a checkpoint written by `save`.  Source files are registered with
+	 * the source manager, config entries are merged into `config`, and
+	 * `pass` is set to the name of the pass that produced the tree.
+	 */
+	static TextTreePointer load(const std::filesystem::path &path,
+	                            Config                      &config,
+	                            std::string                 &pass)
+	{
+		Mapping mapping(path);
+		if (mapping.length() < sizeof(Header))
+		{
+			throw std::runtime_error("Truncated checkpoint " + path.string());
+		}
+		Header header;
+		std::memcpy(&header, mapping.data(), sizeof(header));
+		if ((std::memcmp(header.magic, Magic, sizeof(Magic)) != 0) ||
+		    (header.version != Version) || (header.byteOrder != ByteOrderMark))
+		{
+			throw std::runtime_error(path.string() +
+			                         " is not a compatible igk checkpoint");
+		}
+		if ((header.stringData > mapping.length()) ||
+		    (header.stringDataSize > mapping.length() - header.stringData))
+		{
+			throw std::runtime_error("Corrupt checkpoint string data");
+		}
+		auto *strings    = mapping.records<StringRecord>(header.strings);
+		auto *nodes      = mapping.records<NodeRecord>(header.nodes);
+		auto *children   = mapping.records<ChildRecord>(header.children);
+		auto *attributes = mapping.records<AttributeRecord>(header.attributes);
+		auto *spans      = mapping.records<SpanRecord>(header.spans);
+		auto *files      = mapping.records<FileRecord>(header.files);
+		auto *configs    = mapping.records<ConfigRecord>(header.config);
+		const char *stringData = mapping.data() + header.stringData;
+
+		auto string = [&](uint32_t index) {
+			if (index >= header.strings.count)
+			{
+				throw std::runtime_error("Corrupt checkpoint string index");
+			}
+			auto &record = strings[index];
+			if ((record.offset > header.stringDataSize) ||
+			    (record.length > header.stringDataSize - record.offset))
+			{
+				throw std::runtime_error("Corrupt checkpoint string");
+			}
+			return std::string_view(stringData + record.offset, record.length);
+		};
+		auto range = [](uint32_t first, uint32_t count, uint64_t limit) {
+			if ((first > limit) || (count > limit - first))
+			{
+				throw std::runtime_error("Corrupt checkpoint range");
+			}
+		};
+
+		auto &sourceManager = SourceManager::shared_instance();
+		std::vector<size_t> fileIDs;
+		for (uint64_t i = 0; i < header.files.count; i++)
+		{
+			auto [id, contents] = sourceManager.add_file(
+			  std::string(string(files[i].name)),
+			  std::string(string(files[i].contents)));
+			fileIDs.push_back(id);
+		}
+		auto location = [&](const Location &location) -> SourceLocation {
+			if (location.file == None)
+			{
+				return {};
+			}
+			if (location.file >= fileIDs.size())
+			{
+				throw std::runtime_error("Corrupt checkpoint location");
+			}
+			return sourceManager.compress(
+			  fileIDs[location.file], location.line, location.offset);
+		};
+
+		for (uint64_t i = 0; i < header.config.count; i++)
+		{
+			config[std::string(string(configs[i].name))] =
+			  read_value<Config::mapped_type>(configs[i], string);
+		}
+
+		if (header.nodes.count == 0)
+		{
+			throw std::runtime_error("Checkpoint contains no tree");
+		}
+		std::vector<TextTreePointer> tree(header.nodes.count);
+		for (auto &node : tree)
+		{
+			node = TextTree::create();
+		}
+		for (uint64_t i = 0; i < header.nodes.count; i++)
+		{
+			auto &record = nodes[i];
+			auto &node   = tree[i];
+			node->kind(std::string(string(record.kind)));
+			node->sourceRange = {location(record.start), location(record.end)};
+			range(record.firstAttribute,
+			      record.attributeCount,
+			      header.attributes.count);
+			for (uint32_t a = 0; a < record.attributeCount; a++)
+			{
+				auto &attribute = attributes[record.firstAttribute + a];
+				node->attribute_set(
+				  std::string(string(attribute.name)),
+				  read_value<TextTree::AttributeValue>(attribute, string));
+			}
+			if (record.codeText != None)
+			{
+				range(record.firstSpan, record.spanCount, header.spans.count);
+				auto      text = string(record.codeText);
+				CodeSpans code;
+				size_t    end  = 0;
+				for (uint32_t s = 0; s < record.spanCount; s++)
+				{
+					auto &span = spans[record.firstSpan + s];
+					if ((span.offset < end) || (span.offset > text.size()) ||
+					    (span.length > text.size() - span.offset))
+					{
+						throw std::runtime_error("Corrupt checkpoint span");
+					}
+					code.append_text(text.substr(end, span.offset - end));
+					code.append_span(text.substr(span.offset, span.length),
+					                 string(span.kind));
+					end = span.offset + span.length;
+				}
+				code.append_text(text.substr(end));
+				node->code_spans(std::move(code));
+			}
+			range(record.firstChild, record.childCount, header.children.count);
+			for (uint32_t c = 0; c < record.childCount; c++)
+			{
+				auto &child = children[record.firstChild + c];
+				if (!child.isNode)
+				{
+					node->append_child(std::string(string(child.index)));
+					continue;
+				}
+				// Nodes are written in preorder, so children always follow
+				// their parents.  Rejecting anything else (or a node that
+				// already has a parent) rules out cycles.
+				if ((child.index <= i) || (child.index >= tree.size()) ||
+				    (tree[child.index]->parent() != nullptr))
+				{
+					throw std::runtime_error("Corrupt checkpoint tree");
+				}
+				node->append_child(tree[child.index]);
+			}
+		}
+		pass = string(header.pass);
+		return tree[0];
+	}
+};
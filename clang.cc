@@ -1,5 +1,7 @@
 #include "document.hh"
+#include "pass_timer.hh"
 #include "sol.hh"
+#include "trace.hh"
 #include <clang-c/Documentation.h>
 #include <clang-c/Index.h>
 #include <filesystem>
@@ -55,11 +57,14 @@ namespace
 		ClangTextBuilder(const std::string              &fileName,
 		                 const std::vector<std::string> &args)
 		{
+			PassTimer::Scope timer(PassTimer::Category::Clang);
 			std::vector<const char *> argv;
 			for (auto &arg : args)
 			{
 				argv.push_back(arg.c_str());
 			}
+			TraceRecorder::Span span(
+			  "clang_parseTranslationUnit", "clang", fileName);
 			translationUnit = clang_parseTranslationUnit(
 			  index,
 			  fileName.c_str(),
@@ -73,6 +78,7 @@ namespace
 		std::vector<std::string> usrs_for_entity(const std::string &name,
 		                                         CXCursorKind       entityKind)
 		{
+			PassTimer::Scope timer(PassTimer::Category::Clang);
 			std::unordered_set<std::string> usrs;
 			auto visit = [&](CXCursor cursor, CXCursor parent) {
 				if (entityKind == cursor.kind)
@@ -133,6 +139,7 @@ namespace
 		                                 unsigned    firstLine,
 		                                 unsigned    lastLine)
 		{
+			PassTimer::Scope timer(PassTimer::Category::Clang);
 			CXFile file = clang_getFile(translationUnit, fileName.c_str());
 			CXSourceLocation startLocation =
 			  clang_getLocation(translationUnit, file, firstLine, 1);
@@ -140,7 +147,7 @@ namespace
 			  clang_getLocation(translationUnit, file, lastLine + 1, 1);
 			auto tree =
 			  build_source_range(fileName, startLocation, endLocation, true);
-			tree->attribute_set("first-line", std::to_string(firstLine));
+			tree->attribute_set("first-line", int64_t(firstLine));
 			return tree;
 		}
 
@@ -168,7 +175,10 @@ namespace
 			auto     range = clang_getRange(startLocation, endLocation);
 			CXToken *tokens;
 			unsigned tokenCount;
-			clang_tokenize(translationUnit, range, &tokens, &tokenCount);
+			{
+				TraceRecorder::Span span("clang_tokenize", "clang", fileName);
+				clang_tokenize(translationUnit, range, &tokens, &tokenCount);
+			}
 			if (tokenCount == 0)
 			{
 				return nullptr;
@@ -177,14 +187,18 @@ namespace
 			std::vector<CXCursor> cursors;
 			cursors.resize(tokenCount);
 			auto tree  = TextTree::create();
-			tree->kind = "code";
+			tree->kind("code");
 			tree->attribute_set("code-kind", "listing");
-			clang_annotateTokens(
-			  translationUnit, tokens, tokenCount, cursors.data());
-			CXCursor        last      = clang_getNullCursor();
-			auto            tokenTree = TextTree::create();
-			TextTreePointer currentToken;
-			CXTokenKind     lastKind = CXTokenKind(-1);
+			{
+				TraceRecorder::Span span(
+				  "clang_annotateTokens", "clang", fileName);
+				clang_annotateTokens(
+				  translationUnit, tokens, tokenCount, cursors.data());
+			}
+			CXCursor    last      = clang_getNullCursor();
+			auto        tokenTree = TextTree::create();
+			CodeSpans   spans;
+			CXTokenKind lastKind = CXTokenKind(-1);
 			for (unsigned i = 0; i < tokenCount; i++)
 			{
 				CXToken       token  = tokens[i];
@@ -218,10 +232,10 @@ namespace
 				{
 					if (endOffset > lastOffset)
 					{
-						currentToken->append_text(text.substr(
-						  lastOffset - start, startOffset - lastOffset));
+						spans.extend_span(text.substr(lastOffset - start,
+						                              startOffset - lastOffset));
 					}
-					currentToken->append_text(spelling);
+					spans.extend_span(std::string_view(spelling));
 					lastOffset = endOffset;
 					continue;
 				}
@@ -229,11 +243,9 @@ namespace
 				lastKind = clang_getTokenKind(token);
 				if (startOffset > lastOffset)
 				{
-					tree->append_text(text.substr(lastOffset - start,
+					spans.append_text(text.substr(lastOffset - start,
 					                              startOffset - lastOffset));
 				}
-				currentToken = tree->new_child();
-				currentToken->append_text(spelling);
 				const char *tokenKind = "UnknownToken";
 				switch (cursors[i].kind)
 				{
@@ -273,11 +285,11 @@ namespace
 				{
 					tokenKind = "Punctuation";
 				}
-				currentToken->kind = "code-run";
-				currentToken->attribute_set("token-kind", tokenKind);
+				spans.append_span(std::string_view(spelling), tokenKind);
 				lastOffset = endOffset;
 			}
 			clang_disposeTokens(translationUnit, tokens, tokenCount);
+			tree->code_spans(std::move(spans));
 			return {tree};
 		}
 
@@ -301,7 +313,7 @@ namespace
 				case CXComment_Paragraph:
 				{
 					auto paragraph  = parent->new_child();
-					paragraph->kind = "p";
+					paragraph->kind("p");
 					addChildren(paragraph);
 					return;
 				}
@@ -321,6 +333,7 @@ namespace
 
 		TextTreePointer build_doc_comment(const std::string &usr)
 		{
+			PassTimer::Scope timer(PassTimer::Category::Clang);
 			CXCursor declaration = clang_getNullCursor();
 			auto     visit       = [&](CXCursor cursor, CXCursor parent) {
                 if (clang_isDeclaration(cursor.kind) ||
@@ -362,19 +375,19 @@ namespace
 				return nullptr;
 			}
 			auto tree  = TextTree::create();
-			tree->kind = "clang-doc";
+			tree->kind("clang-doc");
 			if (clang_getCursorKind(declaration) == CXCursor_FunctionDecl)
 			{
 				auto functionTree = tree->new_child();
 				auto addToken     = [&](const std::string &kind,
                                     const std::string &text) {
                     auto token  = functionTree->new_child();
-                    token->kind = "code-run";
+                    token->kind("code-run");
                     token->attribute_set("token-kind", kind);
                     token->append_text(text);
                     return token;
 				};
-				functionTree->kind = "code";
+				functionTree->kind("code");
 				functionTree->attribute_set("code-kind", "listing");
 				tree->attribute_set("code-declaration-kind", "function");
 				CXType type     = clang_getCursorType(declaration);
@@ -411,12 +424,12 @@ namespace
 				auto addToken  = [&](const std::string &kind,
                                     const std::string &text) {
                     auto token  = macroTree->new_child();
-                    token->kind = "code-run";
+                    token->kind("code-run");
                     token->attribute_set("token-kind", kind);
                     token->append_text(text);
                     return token;
 				};
-				macroTree->kind = "code";
+				macroTree->kind("code");
 				macroTree->attribute_set("code-kind", "listing");
 				tree->attribute_set("code-declaration-kind", "macro");
 				String spelling = clang_getCursorSpelling(declaration);
@@ -474,7 +487,7 @@ namespace
 				clang_getExpansionLocation(
 				  location, &file, &line, nullptr, nullptr);
 				auto commentTree  = tree->new_child();
-				commentTree->kind = "p";
+				commentTree->kind("p");
 				bool commentFound = false;
 				line--;
 				CXToken *commentTokens;
@@ -553,7 +566,7 @@ namespace
 								if (line == "*")
 								{
 									commentTree       = tree->new_child();
-									commentTree->kind = "p";
+									commentTree->kind("p");
 									continue;
 								}
 							}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Compact storage for syntax-highlighted source code.
+ *
+ * The highlighters produce long runs of short tokens.  Storing each token as
+ * a `code-run` node with its own `token-kind` attribute costs a node, an
+ * attribute map, and two strings per token.  This instead holds the text of
+ * the whole block in one buffer and, for each highlighted token, its offset,
+ * length, and an index into a small table of token kinds.  Text that is not
+ * covered by a span is plain, unhighlighted, text.
+ *
+ * A text tree node holding one of these behaves as if its children were the
+ * equivalent sequence of text runs and `code-run` nodes, which are created
+ * when a pass first looks at or modifies the children.
+ */
+class CodeSpans
+{
+	public:
+	/**
+	 * A highlighted token.  `kind` indexes the table of token kinds.
+	 */
+	struct Span
+	{
+		uint32_t offset;
+		uint32_t length;
+		uint16_t kind;
+	};
+
+	private:
+	/// The text of the whole block.
+	std::string textStorage;
+
+	/// The highlighted spans, in order and not overlapping.
+	std::vector<Span> spanStorage;
+
+	/// The distinct token kinds used by the spans.
+	std::vector<std::string> kindStorage;
+
+	/**
+	 * Returns the index of `kind` in the token kind table, adding it if it is
+	 * not there.  Blocks use a handful of kinds, so a linear search is
+	 * cheaper than a map.
+	 */
+	uint16_t kind_index(std::string_view kind)
+	{
+		for (size_t i = 0; i < kindStorage.size(); i++)
+		{
+			if (kindStorage[i] == kind)
+			{
+				return i;
+			}
+		}
+		if (kindStorage.size() > std::numeric_limits<uint16_t>::max())
+		{
+			throw std::length_error("Too many token kinds in a code block");
+		}
+		kindStorage.emplace_back(kind);
+		return kindStorage.size() - 1;
+	}
+
+	/**
+	 * Check that the text buffer can still be indexed by a span.
+	 */
+	void check_size(size_t extra)
+	{
+		if (textStorage.size() + extra > std::numeric_limits<uint32_t>::max())
+		{
+			throw std::length_error("Code block is too large");
+		}
+	}
+
+	public:
+	/**
+	 * Append unhighlighted text.
+	 */
+	void append_text(std::string_view text)
+	{
+		check_size(text.size());
+		textStorage += text;
+	}
+
+	/**
+	 * Append a highlighted token of the given kind.  Empty tokens are kept,
+	 * as empty runs, so that a later `extend_span` extends this token and
+	 * not an earlier one.
+	 */
+	void append_span(std::string_view text, std::string_view kind)
+	{
+		check_size(text.size());
+		spanStorage.push_back({static_cast<uint32_t>(textStorage.size()),
+		                       static_cast<uint32_t>(text.size()),
+		                       kind_index(kind)});
+		textStorage += text;
+	}
+
+	/**
+	 * Append text to the last span, which must end at the end of the text.
+	 * Used to merge adjacent tokens that belong to the same run, including
+	 * the space between them.
+	 */
+	void extend_span(std::string_view text)
+	{
+		if (!ends_with_span())
+		{
+			throw std::logic_error("No code span to extend");
+		}
+		check_size(text.size());
+		spanStorage.back().length += text.size();
+		textStorage += text;
+	}
+
+	/**
+	 * Returns the kind of the last span, or null if there are no spans.
+	 */
+	const std::string *last_kind() const
+	{
+		return spanStorage.empty() ? nullptr
+		                           : &kindStorage[spanStorage.back().kind];
+	}
+
+	/**
+	 * Returns true if the last span ends at the end of the text.
+	 */
+	bool ends_with_span() const
+	{
+		return !spanStorage.empty() &&
+		       (spanStorage.back().offset + spanStorage.back().length ==
+		        textStorage.size());
+	}
+
+	/**
+	 * Returns the text of the whole block.
+	 */
+	const std::string &text() const
+	{
+		return textStorage;
+	}
+
+	/**
+	 * Returns the spans.
+	 */
+	const std::vector<Span> &spans() const
+	{
+		return spanStorage;
+	}
+
+	/**
+	 * Returns the name of a token kind.
+	 */
+	const std::string &kind_name(uint16_t kind) const
+	{
+		return kindStorage[kind];
+	}
+
+	/**
+	 * Invoke `fn(text, kind)` for each piece of the block in order.  `kind`
+	 * is the token kind for a span and null for unhighlighted text.
+	 */
+	template<typename Fn>
+	void for_each(Fn &&fn) const
+	{
+		std::string_view text   = textStorage;
+		size_t           offset = 0;
+		for (auto &span : spanStorage)
+		{
+			if (span.offset > offset)
+			{
+				fn(text.substr(offset, span.offset - offset),
+				   static_cast<const std::string *>(nullptr));
+			}
+			fn(text.substr(span.offset, span.length), &kindStorage[span.kind]);
+			offset = span.offset + span.length;
+		}
+		if (offset < text.size())
+		{
+			fn(text.substr(offset), static_cast<const std::string *>(nullptr));
+		}
+	}
+};
@@ -1,21 +1,38 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <ranges>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <variant>
 #include <vector>
 
+#include "code_spans.hh"
 #include "source_manager.hh"
+#include "text_search.hh"
+#include "thread_pool.hh"
 
 class TextTree;
 using TextTreePointer = std::shared_ptr<TextTree>;
 /**
  * A text tree.  Each node may have a kind and a set of attributes, and
  * contains a sequence of child nodes or text runs.
+ *
+ * Deep clones are copy-on-write.  A clone initially shares the attributes and
+ * children of the node that it was cloned from and copies them, one level at
+ * a time, when they are first accessed through the clone or when the original
+ * (or one of its ancestors) is about to be modified.  The kind, attributes,
+ * and children of a node are therefore accessible only through methods, which
+ * perform the copy when needed.
  */
 class TextTree : public std::enable_shared_from_this<TextTree>
 {
@@ -23,56 +40,828 @@ class TextTree : public std::enable_shared_from_this<TextTree>
 	using Child        = std::variant<std::string, TextTreePointer>;
 	using Visitor      = std::function<std::vector<Child>(Child &)>;
 	using ConstVisitor = std::function<void(const Child &)>;
+	/**
+	 * The result of an `EditVisitor`: nothing to keep the node as it is, or
+	 * the children to replace it with.
+	 */
+	using Edit        = std::optional<std::vector<Child>>;
+	using EditVisitor = std::function<Edit(const TextTreePointer &)>;
+	/**
+	 * The value of an attribute.  Attributes that come from the input are
+	 * strings, but passes may store numbers and booleans, which keep their
+	 * type (including across the Lua boundary) and are formatted only when
+	 * the tree is written out.
+	 */
+	using AttributeValue = std::variant<std::string, int64_t, double, bool>;
+
+	std::weak_ptr<TextTree> parentPointer;
+
+	SourceRange sourceRange;
+
+	private:
+	/**
+	 * The kind of this node.  Each clone has its own copy.
+	 */
+	std::string kindStorage;
+
+	/**
+	 * The children of this node.  Empty until materialised if this is a
+	 * copy-on-write clone.
+	 */
+	mutable std::vector<Child> childStorage;
+
+	/**
+	 * The attributes of this node.  Empty until materialised if this is a
+	 * copy-on-write clone.
+	 */
+	mutable std::unordered_map<std::string, AttributeValue> attributeStorage;
+
+	/**
+	 * The state of a `visit` that has set this node's later children aside.
+	 */
+	struct VisitState
+	{
+		/// The children that were moved aside.
+		std::vector<Child> *pending;
+
+		/// The index in `pending` of the first child not yet visited.
+		size_t next;
+
+		/// True once the children not yet visited have been put back.
+		bool restored;
+	};
+
+	/**
+	 * State that most nodes never need: copy-on-write bookkeeping, cached
+	 * text, slots left by removed children, and unexpanded highlighted code.
+	 * It is kept out of line, and allocated the first time that any of it is
+	 * set, so that ordinary nodes stay small.  Each field is protected by
+	 * the lock that would protect it in the node.
+	 */
+	struct RareState
+	{
+		/**
+		 * If this is a copy-on-write clone that has not yet copied its
+		 * contents, the node that holds them.  The source is never itself a
+		 * lazy clone.
+		 */
+		TextTreePointer cowSource;
+
+		/**
+		 * Lazy clones whose source is this node.  These must copy this
+		 * node's contents before it is modified.
+		 */
+		std::vector<std::weak_ptr<TextTree>> cowClones;
+
+		/**
+		 * The text of this subtree, if text caching is enabled for this
+		 * node and nothing in the subtree has changed since it was computed.
+		 * Protected by `textCacheLock`, because visitors running in
+		 * parallel may read text.  Read it with `cached_text`.
+		 */
+		std::shared_ptr<const std::string> cachedText;
+
+		/**
+		 * Highlighted code standing in for the children of this node, if
+		 * they have not yet been expanded.  Shared between copy-on-write
+		 * clones.
+		 */
+		std::shared_ptr<const CodeSpans> codeSpanStorage;
+
+		/**
+		 * The number of slots in `childStorage` left by `remove_child` and
+		 * not yet dropped.
+		 */
+		std::atomic<size_t> removedChildren = 0;
+
+		/**
+		 * The innermost `visit` of this node that is running, if any.
+		 */
+		VisitState *visit = nullptr;
+	};
+
+	/**
+	 * The rarely used state of this node, or null if none has been set.
+	 */
+	mutable std::atomic<RareState *> rareState = nullptr;
+
+	/**
+	 * True if `cowSource` is set.  This can be checked without holding
+	 * `cowLock`.
+	 */
+	mutable std::atomic<bool> isLazy = false;
+
+	/**
+	 * True if `codeSpanStorage` is set.  This can be checked without holding
+	 * `cowLock`.
+	 */
+	mutable std::atomic<bool> hasCodeSpans = false;
+
+	/**
+	 * True if `cache_text` has enabled caching for this node.
+	 */
+	bool textCacheEnabled = false;
+
+	/**
+	 * True while a `visit` of this node has set its later children aside.
+	 */
+	mutable bool isVisiting = false;
+
+	/**
+	 * The index of this node in its parent's children when it was last
+	 * added or found there.  Inserting or dropping earlier siblings makes
+	 * this stale, so it is only a starting point for `index_of`.  It is
+	 * updated whenever a child is added, so it is kept in the node, where it
+	 * fits beside the flags.
+	 */
+	mutable uint32_t indexHint = 0;
+
+	/**
+	 * Lock protecting the copy-on-write state of every node.
+	 */
+	inline static std::mutex cowLock;
+
+	/**
+	 * Number of lazy clones that have not yet been materialised.  When this
+	 * is zero, modifications do not need to look for clones to materialise.
+	 */
+	inline static std::atomic<size_t> lazyCloneCount = 0;
+
+	/**
+	 * Number of nodes with text caching enabled.  When this is zero,
+	 * modifications do not need to invalidate caches in their ancestors.
+	 */
+	inline static std::atomic<size_t> textCacheCount = 0;
+
+	/**
+	 * Lock serialising cache invalidation, which may touch ancestors that
+	 * are shared between parallel visitors.
+	 */
+	inline static std::mutex textCacheLock;
+
+	/**
+	 * Returns the rarely used state of this node, or null if none has been
+	 * set.
+	 */
+	RareState *rare() const
+	{
+		return rareState.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * Returns the rarely used state of this node, allocating it if needed.
+	 * Different fields are set under different locks, so this may race with
+	 * itself, and the loser frees its copy.
+	 */
+	RareState &rare_state() const
+	{
+		if (auto *state = rare())
+		{
+			return *state;
+		}
+		auto      *state    = new RareState;
+		RareState *existing = nullptr;
+		if (!rareState.compare_exchange_strong(existing,
+		                                       state,
+		                                       std::memory_order_acq_rel))
+		{
+			delete state;
+			return *existing;
+		}
+		return *state;
+	}
+
+	/**
+	 * Returns the number of slots left by `remove_child` and not yet
+	 * dropped.
+	 */
+	size_t removed_children() const
+	{
+		auto *state = rare();
+		return (state == nullptr) ? 0 : state->removedChildren.load();
+	}
+
+	/**
+	 * If a `visit` of this node has set its later children aside, put them
+	 * back after the replacements made so far, so that anything that looks
+	 * at or modifies the children while the visitor runs sees them all.
+	 */
+	void restore_visit_pending() const
+	{
+		if (!isVisiting)
+		{
+			return;
+		}
+		auto *visit = rare()->visit;
+		auto &later = *visit->pending;
+		auto  first = later.begin() + visit->next;
+		childStorage.insert(childStorage.end(),
+		                    std::make_move_iterator(first),
+		                    std::make_move_iterator(later.end()));
+		later.clear();
+		visit->restored = true;
+		isVisiting      = false;
+	}
+
+	/**
+	 * Returns the node that holds this node's attributes and children: the
+	 * node that a lazy clone shares them with, or this node.  A lazy clone
+	 * keeps its source alive until it is materialised.
+	 */
+	const TextTree &storage() const
+	{
+		restore_visit_pending();
+		if (!isLazy)
+		{
+			return *this;
+		}
+		std::lock_guard lock(cowLock);
+		return isLazy ? *rare()->cowSource : *this;
+	}
+
+	/**
+	 * Make this freshly created node a lazy clone of the contents of
+	 * `source`.  Must be called with `cowLock` held.
+	 */
+	void make_lazy_locked(const TextTree *source)
+	{
+		// Lazy clones always point at the node that owns the contents, never
+		// at another lazy clone.
+		if (source->isLazy)
+		{
+			source = source->rare()->cowSource.get();
+		}
+		auto  owner  = const_cast<TextTree *>(source);
+		auto &clones = owner->rare_state().cowClones;
+		std::erase_if(clones, [](auto &clone) { return clone.expired(); });
+		clones.push_back(weak_from_this());
+		rare_state().cowSource = owner->shared_from_this();
+		isLazy                 = true;
+		lazyCloneCount++;
+	}
+
+	/**
+	 * Copy the contents of the source into this node if this is a lazy
+	 * clone.  Child nodes become lazy clones of the source's children.  Must
+	 * be called with `cowLock` held.
+	 */
+	void materialize_locked() const
+	{
+		if (!isLazy)
+		{
+			return;
+		}
+		auto self        = const_cast<TextTree *>(this);
+		auto source      = std::move(rare()->cowSource);
+		attributeStorage = source->attributeStorage;
+		if (source->hasCodeSpans)
+		{
+			rare_state().codeSpanStorage = source->rare()->codeSpanStorage;
+			hasCodeSpans                 = true;
+		}
+		childStorage.reserve(source->childStorage.size());
+		for (auto &child : source->childStorage)
+		{
+			if (std::holds_alternative<std::string>(child))
+			{
+				childStorage.push_back(std::get<std::string>(child));
+				continue;
+			}
+			auto &node = std::get<TextTreePointer>(child);
+			if (node == nullptr)
+			{
+				continue;
+			}
+			auto copy           = create();
+			copy->kindStorage   = node->kindStorage;
+			copy->sourceRange   = node->sourceRange;
+			copy->parentPointer = self->weak_from_this();
+			copy->indexHint     = childStorage.size();
+			copy->make_lazy_locked(node.get());
+			childStorage.push_back(std::move(copy));
+		}
+		std::erase_if(source->rare()->cowClones, [&](auto &clone) {
+			return clone.expired() || (clone.lock().get() == this);
+		});
+		isLazy = false;
+		lazyCloneCount--;
+	}
+
+	/**
+	 * Materialise all of the lazy clones of this node.  Must be called with
+	 * `cowLock` held.
+	 */
+	void materialize_clones_locked()
+	{
+		auto *state = rare();
+		if (state == nullptr)
+		{
+			return;
+		}
+		auto clones = std::move(state->cowClones);
+		state->cowClones.clear();
+		for (auto &weak : clones)
+		{
+			if (auto clone = weak.lock())
+			{
+				clone->materialize_locked();
+			}
+		}
+	}
+
+	/**
+	 * Ensure that this node owns its contents and, unless `normalize` is
+	 * false, that its children contain no removed slots and any highlighted
+	 * code has been expanded.  Called before any read of the attributes or
+	 * children.  Reads of only the attributes pass false.
+	 */
+	void materialize(bool normalize = true) const
+	{
+		restore_visit_pending();
+		if (!isLazy &&
+		    (!normalize || ((removed_children() == 0) && !hasCodeSpans)))
+		{
+			return;
+		}
+		std::lock_guard lock(cowLock);
+		materialize_locked();
+		if (normalize)
+		{
+			compact_children();
+			expand_code_spans();
+		}
+	}
+
+	/**
+	 * Replace the highlighted code of this node, if it has any, with the
+	 * equivalent children: a text run for each piece of unhighlighted text
+	 * and a `code-run` node, with a `token-kind` attribute, for each span.
+	 */
+	void expand_code_spans() const
+	{
+		if (!hasCodeSpans)
+		{
+			return;
+		}
+		auto spans = std::move(rare()->codeSpanStorage);
+		auto self  = const_cast<TextTree *>(this)->weak_from_this();
+		childStorage.reserve(spans->spans().size() * 2 + 1);
+		spans->for_each([&](std::string_view text, const std::string *kind) {
+			if (kind == nullptr)
+			{
+				childStorage.emplace_back(std::string(text));
+				return;
+			}
+			auto run         = create();
+			run->kindStorage = "code-run";
+			run->attributeStorage.emplace("token-kind", *kind);
+			run->childStorage.emplace_back(std::string(text));
+			run->parentPointer = self;
+			run->indexHint     = childStorage.size();
+			childStorage.emplace_back(std::move(run));
+		});
+		// Cleared last so that readers that do not take the lock never see
+		// the children half built.
+		hasCodeSpans = false;
+	}
+
+	/**
+	 * Returns the highlighted code of this node if it has not been expanded,
+	 * or null otherwise.  Readers that can work on the text buffer use this
+	 * to avoid expanding it.
+	 */
+	std::shared_ptr<const CodeSpans> pending_code_spans() const
+	{
+		materialize(false);
+		if (!hasCodeSpans)
+		{
+			return nullptr;
+		}
+		std::lock_guard lock(cowLock);
+		return rare()->codeSpanStorage;
+	}
+
+	/**
+	 * Returns the structural hash that a `code-run` node expanded from a span
+	 * would have, as a child.
+	 */
+	static size_t code_run_hash(std::string_view text, const std::string &kind)
+	{
+		size_t attributes =
+		  hash_combine(std::hash<std::string_view>{}("token-kind"),
+		               std::hash<AttributeValue>{}(AttributeValue(kind)));
+		size_t hash = std::hash<std::string_view>{}("code-run");
+		hash        = hash_combine(hash, attributes);
+		hash        = hash_combine(
+		  hash, hash_combine(0, std::hash<std::string_view>{}(text)));
+		return hash_combine(1, hash);
+	}
+
+	/**
+	 * Drop the slots left by `remove_child`.  Removal leaves a null pointer
+	 * in place of the child so that removing many children is not
+	 * quadratic.  They are dropped in one pass before anything else reads or
+	 * modifies the children.
+	 */
+	void compact_children() const
+	{
+		if (removed_children() == 0)
+		{
+			return;
+		}
+		std::erase_if(childStorage, [](auto &child) {
+			return std::holds_alternative<TextTreePointer>(child) &&
+			       (std::get<TextTreePointer>(child) == nullptr);
+		});
+		for (size_t i = 0; i < childStorage.size(); i++)
+		{
+			if (std::holds_alternative<TextTreePointer>(childStorage[i]))
+			{
+				std::get<TextTreePointer>(childStorage[i])->indexHint = i;
+			}
+		}
+		rare()->removedChildren = 0;
+	}
+
+	/**
+	 * Called before any modification of this node.  Materialises this node
+	 * and then, from the root down, any lazy clones of this node or its
+	 * ancestors, so that they do not observe the change.  Unless `normalize`
+	 * is false, removed slots are then dropped from the children and any
+	 * highlighted code is expanded.  Modifications that do not touch the
+	 * children pass false.
+	 */
+	void will_mutate(bool normalize = true)
+	{
+		restore_visit_pending();
+		if (caches_active())
+		{
+			invalidate_caches();
+		}
+		if (isLazy || (lazyCloneCount != 0))
+		{
+			std::lock_guard lock(cowLock);
+			materialize_locked();
+			std::vector<TextTreePointer> path;
+			for (auto node = shared_from_this(); node != nullptr;
+			     node      = node->parentPointer.lock())
+			{
+				path.push_back(node);
+			}
+			for (auto &node : std::ranges::reverse_view(path))
+			{
+				node->materialize_clones_locked();
+			}
+		}
+		if (normalize)
+		{
+			compact_children();
+			expand_code_spans();
+		}
+	}
+
+	/**
+	 * Returns true if any node has cached text, and so modifications must
+	 * invalidate the caches of their ancestors.
+	 */
+	static bool caches_active()
+	{
+		return textCacheCount != 0;
+	}
+
+	/**
+	 * Discard the cached text of this node and all of its ancestors.
+	 */
+	void invalidate_caches()
+	{
+		std::lock_guard lock(textCacheLock);
+		for (auto node = shared_from_this(); node != nullptr;
+		     node      = node->parentPointer.lock())
+		{
+			if (auto *state = node->rare())
+			{
+				state->cachedText.reset();
+			}
+		}
+	}
+
+	/**
+	 * Returns the cached text of this node, or null if there is none.
+	 */
+	std::shared_ptr<const std::string> cached_text() const
+	{
+		if (!textCacheEnabled)
+		{
+			return nullptr;
+		}
+		std::lock_guard lock(textCacheLock);
+		auto           *state = rare();
+		return (state == nullptr) ? nullptr : state->cachedText;
+	}
+
+	/**
+	 * Mix `value` into the running hash `seed`.
+	 */
+	static size_t hash_combine(size_t seed, size_t value)
+	{
+		return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 12) +
+		               (seed >> 4));
+	}
+
+	/**
+	 * Append the text of the children of this node to `buffer`, ignoring
+	 * any cache for this node.
+	 */
+	void collect_text(std::string &buffer) const
+	{
+		if (auto spans = pending_code_spans())
+		{
+			buffer += spans->text();
+			return;
+		}
+		materialize();
+		for (auto &child : childStorage)
+		{
+			if (std::holds_alternative<std::string>(child))
+			{
+				buffer += std::get<std::string>(child);
+			}
+			else
+			{
+				std::get<TextTreePointer>(child)->text_into(buffer);
+			}
+		}
+	}
+
+	/**
+	 * Returns the index of `child` in this node's children, if it is there.
+	 * Starts at the child's index hint and searches outwards from it, so
+	 * this is constant time unless many siblings have been inserted before
+	 * the child since the hint was set.  Removed slots are not dropped, so
+	 * the result is an index into `childStorage` as it currently is.
+	 */
+	std::optional<size_t> index_of(const TextTree *child) const
+	{
+		restore_visit_pending();
+		if (isLazy)
+		{
+			std::lock_guard lock(cowLock);
+			materialize_locked();
+		}
+		auto isChild = [&](size_t i) {
+			return std::holds_alternative<TextTreePointer>(childStorage[i]) &&
+			       (std::get<TextTreePointer>(childStorage[i]).get() == child);
+		};
+		size_t size = childStorage.size();
+		size_t hint = std::min<size_t>(child->indexHint, size);
+		for (size_t distance = 0; (distance <= hint) || (hint + distance < size);
+		     distance++)
+		{
+			if ((hint + distance < size) && isChild(hint + distance))
+			{
+				child->indexHint = hint + distance;
+				return child->indexHint;
+			}
+			if ((distance > 0) && (distance <= hint) &&
+			    isChild(hint - distance))
+			{
+				child->indexHint = hint - distance;
+				return child->indexHint;
+			}
+		}
+		return std::nullopt;
+	}
+
+	public:
+	~TextTree()
+	{
+		if (isLazy)
+		{
+			lazyCloneCount--;
+		}
+		if (textCacheEnabled)
+		{
+			textCacheCount--;
+		}
+		delete rare();
+	}
+
+	/**
+	 * Returns the kind of this node.
+	 */
+	const std::string &kind() const
+	{
+		return kindStorage;
+	}
+
+	/**
+	 * Set the kind of this node.
+	 */
+	void kind(std::string newKind)
+	{
+		will_mutate(false);
+		kindStorage = std::move(newKind);
+	}
+
+	/**
+	 * Returns the children of this node.
+	 */
+	const std::vector<Child> &children() const
+	{
+		materialize();
+		return childStorage;
+	}
+
+	/**
+	 * Returns true if this node is a lazy clone, which shares its attributes
+	 * and children with another node until it is first modified.
+	 */
+	bool is_lazy() const
+	{
+		return isLazy;
+	}
+
+	/**
+	 * Returns the children as stored, for readers that must not change the
+	 * tree.  Unlike `children`, this does not copy a lazy clone, drop
+	 * removed children, which are null, or expand highlighted code (see
+	 * `stored_code_spans`).  The children of a lazy clone belong to the node
+	 * that it shares them with and must not be modified.
+	 */
+	const std::vector<Child> &stored_children() const
+	{
+		return storage().childStorage;
+	}
 
-	std::string             kind;
-	std::weak_ptr<TextTree> parentPointer;
-	std::vector<Child>      children;
+	/**
+	 * Returns the attributes as stored, without copying a lazy clone.
+	 */
+	const decltype(attributeStorage) &stored_attributes() const
+	{
+		return storage().attributeStorage;
+	}
 
-	std::unordered_map<std::string, std::string> attributeStorage;
+	/**
+	 * Returns the highlighted code of this node if it has not been expanded,
+	 * or null otherwise, without copying a lazy clone.
+	 */
+	std::shared_ptr<const CodeSpans> stored_code_spans() const
+	{
+		auto &node = storage();
+		if (!node.hasCodeSpans)
+		{
+			return nullptr;
+		}
+		std::lock_guard lock(cowLock);
+		return node.hasCodeSpans ? node.rare()->codeSpanStorage : nullptr;
+	}
 
-	SourceRange sourceRange;
+	/**
+	 * Returns the heap memory used by the rarely used state of this node,
+	 * not counting the text or highlighted code that it refers to.
+	 */
+	size_t rare_state_bytes() const
+	{
+		auto *state = rare();
+		if (state == nullptr)
+		{
+			return 0;
+		}
+		std::lock_guard lock(cowLock);
+		return sizeof(RareState) +
+		       state->cowClones.capacity() * sizeof(std::weak_ptr<TextTree>);
+	}
 
+	/**
+	 * Replace each child with the children that `visitor` returns for it.
+	 *
+	 * While the visitor runs, the child being visited is not in
+	 * `children()`, which holds the replacements for the earlier children
+	 * followed by the later children.  Changes that the visitor makes to the
+	 * later children, including appending new ones, are seen by the rest of
+	 * the walk.  Replacements are not visited.
+	 *
+	 * Until something looks at or modifies this node's children, the later
+	 * children are kept aside and the replacements appended, so a visit that
+	 * does not look at its siblings is linear in the number of children.
+	 * Looking at the children puts the later children back, and the rest of
+	 * the walk replaces each child in place.
+	 */
 	void visit(Visitor &&visitor)
 	{
-		for (size_t i = 0; i < children.size();)
+		will_mutate();
+		auto               self    = shared_from_this();
+		std::vector<Child> pending = std::move(childStorage);
+		childStorage.clear();
+		childStorage.reserve(pending.size());
+		auto &state      = rare_state();
+		auto *outerVisit = state.visit;
+		auto  endVisit   = [&]() {
+			state.visit = outerVisit;
+			isVisiting  = false;
+		};
+		VisitState visitState{&pending, 0, false};
+		state.visit = &visitState;
+		isVisiting  = true;
+		// The index in `childStorage` of the child being visited, once the
+		// later children have been put back.
+		size_t index = 0;
+		for (size_t i = 0; (i < pending.size()) || visitState.restored;)
 		{
-			auto child = std::move(children[i]);
-			children.erase(children.begin() + i);
-			auto newChildren = visitor(child);
+			Child child;
+			if (visitState.restored)
+			{
+				if (index >= childStorage.size())
+				{
+					break;
+				}
+				child = std::move(childStorage[index]);
+				childStorage.erase(childStorage.begin() + index);
+			}
+			else
+			{
+				child           = std::move(pending[i]);
+				visitState.next = ++i;
+				index           = childStorage.size();
+			}
+			// Drop slots left by removing children.
+			if (auto *node = std::get_if<TextTreePointer>(&child);
+			    (node != nullptr) && (*node == nullptr))
+			{
+				if (visitState.restored)
+				{
+					rare()->removedChildren--;
+				}
+				continue;
+			}
+			std::vector<Child> newChildren;
+			try
+			{
+				newChildren = visitor(child);
+			}
+			catch (...)
+			{
+				restore_visit_pending();
+				endVisit();
+				childStorage.insert(
+				  childStorage.begin() + std::min(index, childStorage.size()),
+				  std::move(child));
+				throw;
+			}
 			// Detach the current child from the tree.  We may reattach it
-			// later.
+			// later.  If the visitor moved it somewhere else, leave it there.
 			if (std::holds_alternative<TextTreePointer>(child))
 			{
 				auto childNode = std::get<TextTreePointer>(child);
-				if (childNode != nullptr)
+				if (childNode->parent().get() == this)
 				{
 					childNode->parent(nullptr);
 				}
 			}
-			if (newChildren.size() > 0)
+			for (auto &newChild : newChildren)
 			{
-				for (auto &newChild : newChildren)
+				if (std::holds_alternative<TextTreePointer>(newChild))
 				{
-					if (std::holds_alternative<TextTreePointer>(newChild))
-					{
-						std::get<TextTreePointer>(newChild)->parent(
-						  shared_from_this());
-					}
+					auto &newNode = std::get<TextTreePointer>(newChild);
+					newNode->parent(self);
+				}
+			}
+			// The visitor may have removed earlier children.
+			index = std::min(index, childStorage.size());
+			childStorage.insert(childStorage.begin() + index,
+			                    std::make_move_iterator(newChildren.begin()),
+			                    std::make_move_iterator(newChildren.end()));
+			for (size_t j = 0; j < newChildren.size(); j++, index++)
+			{
+				if (auto *node =
+				      std::get_if<TextTreePointer>(&childStorage[index]))
+				{
+					(*node)->indexHint = index;
 				}
-				children.insert(
-				  children.begin() + i, newChildren.begin(), newChildren.end());
 			}
-			i += newChildren.size();
+		}
+		endVisit();
+		// The visitor may have cached text or hashes for this subtree while
+		// children were detached.
+		if (caches_active())
+		{
+			invalidate_caches();
 		}
 	}
 
 	void match_any(const std::unordered_set<std::string> &kinds, Visitor &visitor)
 	{
+		// Highlighted code contains only code runs, so leave it unexpanded
+		// unless they are wanted.
+		if (!kinds.contains("code-run") && has_code_spans())
+		{
+			return;
+		}
 		visit([&kinds, &visitor](Child &child) {
 			if (std::holds_alternative<TextTreePointer>(child))
 			{
 				auto childNode = std::get<TextTreePointer>(child);
-				if (kinds.contains(childNode->kind))
+				if (kinds.contains(childNode->kind()))
 				{
 					return visitor(child);
 				}
@@ -84,11 +873,15 @@ class TextTree : public std::enable_shared_from_this<TextTree>
 
 	void match(const std::string &kind, Visitor &visitor)
 	{
+		if ((kind != "code-run") && has_code_spans())
+		{
+			return;
+		}
 		visit([&kind, &visitor](Child &child) {
 			if (std::holds_alternative<TextTreePointer>(child))
 			{
 				auto childNode = std::get<TextTreePointer>(child);
-				if (childNode->kind == kind)
+				if (childNode->kind() == kind)
 				{
 					return visitor(child);
 				}
@@ -98,18 +891,198 @@ class TextTree : public std::enable_shared_from_this<TextTree>
 		});
 	}
 
+	/**
+	 * Pass each child node to `visitor`, skipping text runs, and replace a
+	 * node only if the visitor returns replacements for it.  Unlike `visit`,
+	 * nodes that the visitor keeps are not copied or reattached, so a
+	 * visitor that keeps everything does not allocate or modify the tree.
+	 */
+	void edit_children(const EditVisitor &visitor)
+	{
+		edit_if([](const TextTree &) { return true; }, true, visitor);
+	}
+
+	/**
+	 * Version of `match` that takes an `EditVisitor`.  See `edit_children`.
+	 */
+	void edit_matches(const std::string &kind, const EditVisitor &visitor)
+	{
+		edit_if([&kind](const TextTree &node) { return node.kind() == kind; },
+		        kind == "code-run",
+		        visitor);
+	}
+
+	/**
+	 * Version of `match_any` that takes an `EditVisitor`.  See
+	 * `edit_children`.
+	 */
+	void edit_matches_any(const std::unordered_set<std::string> &kinds,
+	                      const EditVisitor                     &visitor)
+	{
+		edit_if(
+		  [&kinds](const TextTree &node) {
+			  return kinds.contains(node.kind());
+		  },
+		  kinds.contains("code-run"),
+		  visitor);
+	}
+
 	void const_visit(ConstVisitor &&visitor) const
 	{
-		for (size_t i = 0; i < children.size(); i++)
+		materialize();
+		for (size_t i = 0; i < childStorage.size(); i++)
+		{
+			visitor(childStorage[i]);
+		}
+	}
+
+	/**
+	 * The default minimum number of nodes that a task handed to the thread
+	 * pool by the parallel visitors should contain.  Smaller siblings are
+	 * batched together.
+	 */
+	static constexpr size_t ParallelThreshold = 256;
+
+	/**
+	 * Parallel version of `visit`.  The visitor is called once for each child
+	 * and may run concurrently on different threads, so it must touch only
+	 * the subtree that it is given and must not use `parent()` to reach
+	 * outside it.  Runs of adjacent children are batched into tasks of at
+	 * least `threshold` nodes.
+	 *
+	 * Parent links are updated on the calling thread once every visitor has
+	 * returned, and replacements are spliced in the original order, so the
+	 * result is the same as calling `visit` with the same visitor.
+	 */
+	void parallel_visit(const Visitor &visitor,
+	                    size_t         threshold = ParallelThreshold)
+	{
+		will_mutate();
+		std::vector<Child> pending = std::move(childStorage);
+		childStorage.clear();
+		std::vector<Child *> work;
+		work.reserve(pending.size());
+		for (auto &child : pending)
+		{
+			work.push_back(&child);
+		}
+		std::vector<std::vector<Child>> results;
+		try
+		{
+			results = parallel_apply(work, visitor, threshold);
+		}
+		catch (...)
+		{
+			// Put the children back, so that a caller that handles the error
+			// has a valid tree.
+			childStorage = std::move(pending);
+			throw;
+		}
+		auto self = shared_from_this();
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			if (std::holds_alternative<TextTreePointer>(pending[i]))
+			{
+				auto &childNode = std::get<TextTreePointer>(pending[i]);
+				if ((childNode != nullptr) && (childNode->parent() == self))
+				{
+					childNode->parent(nullptr);
+				}
+			}
+			for (auto &newChild : results[i])
+			{
+				if (std::holds_alternative<TextTreePointer>(newChild))
+				{
+					auto &newNode = std::get<TextTreePointer>(newChild);
+					newNode->parent(self);
+					newNode->indexHint = childStorage.size();
+				}
+				childStorage.push_back(std::move(newChild));
+			}
+		}
+		if (caches_active())
+		{
+			invalidate_caches();
+		}
+	}
+
+	/**
+	 * Parallel version of `match_any`.  Matching nodes are collected in a
+	 * single walk and the visitor is then run on them concurrently.  Matches
+	 * never contain other matches, so each visitor owns a disjoint subtree.
+	 * Replacements are spliced in on the calling thread.
+	 */
+	void parallel_match_any(const std::unordered_set<std::string> &kinds,
+	                        const Visitor                         &visitor,
+	                        size_t threshold = ParallelThreshold)
+	{
+		parallel_match_if(
+		  [&kinds](const TextTree &node) {
+			  return kinds.contains(node.kind());
+		  },
+		  kinds.contains("code-run"),
+		  visitor,
+		  threshold);
+	}
+
+	/**
+	 * Parallel version of `match`.  See `parallel_match_any`.
+	 */
+	void parallel_match(const std::string &kind,
+	                    const Visitor     &visitor,
+	                    size_t             threshold = ParallelThreshold)
+	{
+		parallel_match_if(
+		  [&kind](const TextTree &node) { return node.kind() == kind; },
+		  kind == "code-run",
+		  visitor,
+		  threshold);
+	}
+
+	/**
+	 * Returns the number of nodes in this subtree, including this node.  Text
+	 * runs are not counted.
+	 */
+	size_t node_count() const
+	{
+		if (auto spans = pending_code_spans())
+		{
+			return 1 + spans->spans().size();
+		}
+		materialize();
+		size_t count = 1;
+		for (auto &child : childStorage)
 		{
-			visitor(children[i]);
+			if (std::holds_alternative<TextTreePointer>(child))
+			{
+				count += std::get<TextTreePointer>(child)->node_count();
+			}
 		}
+		return count;
 	}
 
 	size_t length()
 	{
+		return text_length();
+	}
+
+	/**
+	 * Returns the length, in bytes, of the text of this subtree without
+	 * constructing it.
+	 */
+	size_t text_length() const
+	{
+		if (auto text = cached_text())
+		{
+			return text->size();
+		}
+		if (auto spans = pending_code_spans())
+		{
+			return spans->text().size();
+		}
+		materialize();
 		size_t length = 0;
-		for (auto &child : children)
+		for (auto &child : childStorage)
 		{
 			if (std::holds_alternative<std::string>(child))
 			{
@@ -117,121 +1090,323 @@ class TextTree : public std::enable_shared_from_this<TextTree>
 			}
 			else
 			{
-				length += std::get<TextTreePointer>(child)->length();
+				length += std::get<TextTreePointer>(child)->text_length();
 			}
 		}
 		return length;
 	}
 
-	TextTreePointer shallow_clone()
+	/**
+	 * Returns true if this subtree contains any text.  Stops at the first
+	 * non-empty text run.
+	 */
+	bool has_text() const
 	{
-		auto clone         = create();
-		clone->kind        = kind;
-		clone->sourceRange = sourceRange;
-		for (auto &attribute : attributeStorage)
+		if (auto text = cached_text())
 		{
-			clone->attributeStorage[attribute.first] = attribute.second;
+			return !text->empty();
 		}
-		return clone;
-	}
-
-	TextTreePointer deep_clone()
-	{
-		auto clone = shallow_clone();
-		for (auto &child : children)
+		if (auto spans = pending_code_spans())
+		{
+			return !spans->text().empty();
+		}
+		materialize();
+		for (auto &child : childStorage)
 		{
 			if (std::holds_alternative<std::string>(child))
 			{
-				clone->append_text(std::get<std::string>(child));
+				if (!std::get<std::string>(child).empty())
+				{
+					return true;
+				}
 			}
-			else
+			else if (std::get<TextTreePointer>(child)->has_text())
 			{
-				clone->append_child(
-				  std::get<TextTreePointer>(child)->deep_clone());
+				return true;
 			}
 		}
-		return clone;
+		return false;
 	}
 
-	std::pair<Child, Child> split_at_byte_index(size_t index)
+	/**
+	 * Append the text of this subtree to `buffer`, in a single walk.  Unlike
+	 * `text()`, this does not allocate a string for each level of the tree.
+	 */
+	void text_into(std::string &buffer) const
 	{
-		TextTreePointer left  = shallow_clone();
-		TextTreePointer right = shallow_clone();
-		size_t          i;
-		for (i = 0; i < children.size(); i++)
+		if (!textCacheEnabled)
 		{
-			auto  &child       = children[i];
-			size_t childLength = 0;
-			if (std::holds_alternative<std::string>(child))
+			collect_text(buffer);
+			return;
+		}
+		auto text = cached_text();
+		if (!text)
+		{
+			auto collected = std::make_shared<std::string>();
+			collect_text(*collected);
+			std::lock_guard lock(textCacheLock);
+			// Another thread may have cached the text while this one was
+			// collecting it.
+			auto &cachedText = rare_state().cachedText;
+			if (!cachedText)
 			{
-				childLength = std::get<std::string>(child).size();
+				cachedText = std::move(collected);
 			}
-			else
+			text = cachedText;
+		}
+		buffer += *text;
+	}
+
+	/**
+	 * Enable or disable caching of the result of `text()` for this node.
+	 * This is intended for read-mostly subtrees whose text is requested
+	 * repeatedly.  The cache is discarded whenever anything in the subtree
+	 * changes.
+	 */
+	void cache_text(bool enable)
+	{
+		if (enable == textCacheEnabled)
+		{
+			return;
+		}
+		textCacheEnabled = enable;
+		if (enable)
+		{
+			textCacheCount++;
+		}
+		else
+		{
+			textCacheCount--;
+			std::lock_guard lock(textCacheLock);
+			rare_state().cachedText.reset();
+		}
+	}
+
+	/**
+	 * Structural hashes, by node, for callers that compare trees without
+	 * modifying them.  Nodes do not store their hashes, because keeping them
+	 * valid would make every modification walk its ancestors.
+	 */
+	using HashCache = std::unordered_map<const TextTree *, size_t>;
+
+	/**
+	 * Returns a hash of the structure of this subtree: its kind, attributes,
+	 * text, and the hashes of its children.  Source locations are ignored,
+	 * so equal subtrees have equal hashes wherever they came from.
+	 *
+	 * If `cache` is not null, hashes are looked up in and added to it, so
+	 * each subtree is hashed once however many times it is compared.  The
+	 * cache is valid only while none of the hashed nodes change.
+	 */
+	size_t structural_hash(HashCache *cache = nullptr) const
+	{
+		if (cache != nullptr)
+		{
+			if (auto found = cache->find(this); found != cache->end())
 			{
-				childLength = std::get<TextTreePointer>(child)->length();
+				return found->second;
 			}
-			if (index < childLength)
+		}
+		// A lazy clone has the same contents as its source, so reuse the
+		// source's hash rather than materialising the clone.
+		if (isLazy)
+		{
+			TextTreePointer source;
 			{
-				if (std::holds_alternative<std::string>(child))
-				{
-					auto &text = std::get<std::string>(child);
-					if (index > 0)
-					{
-						left->append_text(text.substr(0, index));
-					}
-					if (index < text.size())
-					{
-						right->append_text(text.substr(index));
-					}
-				}
-				else
-				{
-					auto &node  = std::get<TextTreePointer>(child);
-					auto  split = node->split_at_byte_index(index);
-					left->append_child(split.first);
-					right->append_child(split.second);
-				}
-				i++;
-				break;
+				std::lock_guard lock(cowLock);
+				source = rare()->cowSource;
+			}
+			if (source && (source->kindStorage == kindStorage))
+			{
+				return source->structural_hash(cache);
+			}
+		}
+		// Highlighted code hashes the same as its expansion.
+		auto spans = pending_code_spans();
+		if (!spans)
+		{
+			materialize();
+		}
+		size_t hash = std::hash<std::string>{}(kindStorage);
+		// Attribute order is not significant, so combine them commutatively.
+		size_t attributes = 0;
+		for (auto &[name, value] : attributeStorage)
+		{
+			attributes += hash_combine(std::hash<std::string>{}(name),
+			                           std::hash<AttributeValue>{}(value));
+		}
+		hash = hash_combine(hash, attributes);
+		if (spans)
+		{
+			spans->for_each(
+			  [&](std::string_view text, const std::string *kind) {
+				  hash = hash_combine(
+				    hash,
+				    kind ? code_run_hash(text, *kind)
+				         : hash_combine(0, std::hash<std::string_view>{}(text)));
+			  });
+		}
+		else
+		{
+			for (auto &child : childStorage)
+			{
+				hash = hash_combine(hash, structural_hash(child, cache));
 			}
-			index -= childLength;
-			left->append_child(std::move(child));
 		}
-		for (; i < children.size(); i++)
+		if (cache != nullptr)
+		{
+			cache->emplace(this, hash);
+		}
+		return hash;
+	}
+
+	/**
+	 * Returns the structural hash of a child, which is either a text run or a
+	 * node.  See `structural_hash` for `cache`.
+	 */
+	static size_t structural_hash(const Child &child,
+	                              HashCache   *cache = nullptr)
+	{
+		if (std::holds_alternative<std::string>(child))
+		{
+			return hash_combine(0, std::hash<std::string>{}(
+			                         std::get<std::string>(child)));
+		}
+		auto &node = std::get<TextTreePointer>(child);
+		return node ? hash_combine(1, node->structural_hash(cache)) : 0;
+	}
+
+	TextTreePointer shallow_clone()
+	{
+		materialize(false);
+		auto clone         = create();
+		clone->kindStorage = kindStorage;
+		clone->sourceRange = sourceRange;
+		for (auto &attribute : attributeStorage)
+		{
+			clone->attributeStorage[attribute.first] = attribute.second;
+		}
+		return clone;
+	}
+
+	/**
+	 * Returns a copy of this subtree.  This is O(1): the clone shares this
+	 * node's contents and nodes are copied only along the paths that are
+	 * later read through the clone or modified in either copy.
+	 */
+	TextTreePointer deep_clone()
+	{
+		restore_visit_pending();
+		auto clone         = create();
+		clone->kindStorage = kindStorage;
+		clone->sourceRange = sourceRange;
+		std::lock_guard lock(cowLock);
+		clone->make_lazy_locked(this);
+		return clone;
+	}
+
+	/**
+	 * Split this node at byte `index` of its text, returning two copies of
+	 * this node (without the children) holding the text before and after
+	 * that point.  Nodes that contain the split point are split in the same
+	 * way.  This node is left with no children.
+	 */
+	std::pair<Child, Child> split_at_byte_index(size_t index)
+	{
+		if (auto halves = split_if_within(index))
+		{
+			return *std::move(halves);
+		}
+		will_mutate();
+		TextTreePointer left  = shallow_clone();
+		TextTreePointer right = shallow_clone();
+		for (size_t i = 0; i < childStorage.size(); i++)
 		{
-			right->append_child(std::move(children[i]));
+			left->append_child(take_child(i));
 		}
-		children.clear();
+		childStorage.clear();
 		return {left, right};
 	}
 
-	ssize_t find_string(const std::string needle)
+	/**
+	 * Invoke `fn` with each piece of the text of this subtree in order,
+	 * without building the text.  If `fn` returns false, stops and returns
+	 * false.
+	 */
+	template<typename Fn>
+	bool for_each_text(Fn &&fn) const
 	{
-		size_t startOffset = 0;
-		size_t i           = 0;
-		for (auto &child : children)
+		if (auto text = cached_text())
+		{
+			return fn(std::string_view(*text));
+		}
+		if (auto spans = pending_code_spans())
+		{
+			return fn(std::string_view(spans->text()));
+		}
+		materialize();
+		for (auto &child : childStorage)
 		{
 			if (std::holds_alternative<std::string>(child))
 			{
-				auto &text = std::get<std::string>(child);
-				if (auto found = text.find(needle); found != std::string::npos)
+				if (!fn(std::string_view(std::get<std::string>(child))))
 				{
-					return startOffset + found;
+					return false;
 				}
-				startOffset += text.size();
 			}
-			else
+			else if (!std::get<TextTreePointer>(child)->for_each_text(fn))
 			{
-				auto childTree = std::get<TextTreePointer>(child);
-				if (auto found = childTree->find_string(needle);
-				    found != std::string::npos)
-				{
-					return startOffset + found;
-				}
-				startOffset += childTree->length();
+				return false;
 			}
 		}
-		return std::string::npos;
+		return true;
+	}
+
+	/**
+	 * Returns every occurrence of the patterns of `searcher` in the text of
+	 * this subtree, including those that span text runs or nodes, ordered
+	 * by offset and then by pattern.  The text is read once, however many
+	 * patterns there are.
+	 */
+	std::vector<TextSearcher::Match> find_all(const TextSearcher &searcher) const
+	{
+		std::vector<TextSearcher::Match> matches;
+		TextSearcher::Cursor             cursor(searcher);
+		for_each_text([&](std::string_view text) {
+			return cursor.feed(text, [&](size_t pattern, size_t offset) {
+				matches.push_back({pattern, offset});
+				return true;
+			});
+		});
+		// Matches are found in the order in which they end.
+		std::ranges::sort(matches, [](auto &a, auto &b) {
+			return (a.offset < b.offset) ||
+			       ((a.offset == b.offset) && (a.pattern < b.pattern));
+		});
+		return matches;
+	}
+
+	/**
+	 * Returns the byte offset of the first occurrence of `needle` in the
+	 * text of this subtree, or `std::string::npos` if there is none.
+	 * Occurrences may span text runs or nodes.
+	 */
+	ssize_t find_string(const std::string needle)
+	{
+		if (needle.empty())
+		{
+			return has_text() ? 0 : std::string::npos;
+		}
+		auto                 searcher = TextSearcher::compiled({needle});
+		TextSearcher::Cursor cursor(*searcher);
+		size_t               result = std::string::npos;
+		for_each_text([&](std::string_view text) {
+			return cursor.feed(text, [&](size_t, size_t offset) {
+				result = offset;
+				return false;
+			});
+		});
+		return result;
 	}
 
 	void take_children(TextTreePointer other)
@@ -240,37 +1415,111 @@ class TextTree : public std::enable_shared_from_this<TextTree>
 		{
 			return;
 		}
-		children.insert(children.end(),
-		                std::make_move_iterator(other->children.begin()),
-		                std::make_move_iterator(other->children.end()));
-		other->children.clear();
+		will_mutate();
+		other->will_mutate();
+		auto self = shared_from_this();
+		for (auto &child : other->childStorage)
+		{
+			if (std::holds_alternative<TextTreePointer>(child))
+			{
+				std::get<TextTreePointer>(child)->parent(self);
+			}
+		}
+		childStorage.insert(
+		  childStorage.end(),
+		  std::make_move_iterator(other->childStorage.begin()),
+		  std::make_move_iterator(other->childStorage.end()));
+		other->childStorage.clear();
 	}
 
 	bool has_attribute(const std::string &name) const
 	{
+		materialize(false);
 		return attributeStorage.find(name) != attributeStorage.end();
 	}
 
 	const decltype(attributeStorage) &attributes() const
 	{
+		materialize(false);
 		return attributeStorage;
 	}
 
 	void attribute_erase(const std::string &name)
 	{
+		will_mutate(false);
 		attributeStorage.erase(name);
 	}
 
-	void attribute_set(const std::string &name, const std::string &value)
+	void attribute_set(const std::string &name, AttributeValue value)
 	{
-		attributeStorage[name] = value;
+		will_mutate(false);
+		attributeStorage[name] = std::move(value);
 	}
 
 	auto &attribute(const std::string &name)
 	{
+		will_mutate(false);
 		return attributeStorage[name];
 	}
 
+	/**
+	 * Returns the value of an attribute, or null if it is not set.  Unlike
+	 * `attribute`, this does not add the attribute or copy a lazy clone.
+	 */
+	const AttributeValue *find_attribute(const std::string &name) const
+	{
+		auto &attributes = stored_attributes();
+		auto  found      = attributes.find(name);
+		if (found == attributes.end())
+		{
+			return nullptr;
+		}
+		return &found->second;
+	}
+
+	/**
+	 * Returns the value of an attribute formatted as a string, or an empty
+	 * string if it is not set.
+	 */
+	std::string attribute_string(const std::string &name) const
+	{
+		materialize(false);
+		auto found = attributeStorage.find(name);
+		if (found == attributeStorage.end())
+		{
+			return {};
+		}
+		return to_string(found->second);
+	}
+
+	/**
+	 * Format an attribute value as text, for output.  Doubles use the
+	 * shortest representation that reads back as the same value.
+	 */
+	static std::string to_string(const AttributeValue &value)
+	{
+		return std::visit(
+		  [](auto &value) -> std::string {
+			  using T = std::remove_cvref_t<decltype(value)>;
+			  if constexpr (std::is_same_v<T, std::string>)
+			  {
+				  return value;
+			  }
+			  else if constexpr (std::is_same_v<T, bool>)
+			  {
+				  return value ? "true" : "false";
+			  }
+			  else
+			  {
+				  char buffer[32];
+				  auto result =
+				    std::to_chars(buffer, buffer + sizeof(buffer), value);
+				  return std::string(buffer, result.ptr);
+			  }
+		  },
+		  value);
+	}
+
 	TextTreePointer parent() const
 	{
 		return parentPointer.lock();
@@ -283,103 +1532,223 @@ class TextTree : public std::enable_shared_from_this<TextTree>
 
 	TextTreePointer new_child()
 	{
+		will_mutate();
 		auto child             = create();
 		child->parentPointer   = shared_from_this();
 		auto endSourceLocation = child->sourceRange.second;
+		// The new child starts where the last node child ended.  Adjacent
+		// text runs are merged, so this normally looks at most two children.
 		for (auto &child :
-		     std::ranges::subrange(children.rbegin(), children.rend()))
+		     std::ranges::subrange(childStorage.rbegin(), childStorage.rend()))
 		{
 			if (std::holds_alternative<TextTreePointer>(child))
 			{
 				endSourceLocation =
 				  std::get<TextTreePointer>(child)->sourceRange.second;
+				break;
 			}
 		}
 		child->sourceRange = {endSourceLocation, endSourceLocation};
-		children.push_back(child);
+		child->indexHint   = childStorage.size();
+		childStorage.push_back(child);
 		return child;
 	}
 
 	void append_text(const std::string &text)
 	{
-		if (!children.empty() &&
-		    std::holds_alternative<std::string>(children.back()))
+		will_mutate();
+		if (!childStorage.empty() &&
+		    std::holds_alternative<std::string>(childStorage.back()))
 		{
-			std::get<std::string>(children.back()) += text;
+			std::get<std::string>(childStorage.back()) += text;
 		}
 		else
 		{
-			children.push_back(text);
+			childStorage.push_back(text);
 		}
 	}
 
 	void insert_text(size_t index, const std::string &text)
 	{
-		if (index >= children.size())
+		will_mutate();
+		if (index >= childStorage.size())
 		{
 			append_text(text);
 			return;
 		}
-		if (std::holds_alternative<std::string>(children[index]))
+		if (std::holds_alternative<std::string>(childStorage[index]))
 		{
-			std::get<std::string>(children[index]).insert(0, text);
+			std::get<std::string>(childStorage[index]).insert(0, text);
 		}
 		else
 		{
-			children.insert(children.begin() + index, text);
+			childStorage.insert(childStorage.begin() + index, text);
 		}
 	}
 
 	void remove_child(TextTreePointer child)
 	{
-		for (auto it = children.begin(); it != children.end(); ++it)
+		will_mutate(false);
+		auto index = index_of(child.get());
+		if (!index)
 		{
-			if (std::holds_alternative<TextTreePointer>(*it) &&
-			    std::get<TextTreePointer>(*it) == child)
+			// A later sibling of a child that `edit_children` is visiting
+			// may have been set aside.  Detaching it tells `edit_children`
+			// to drop it.
+			if (child->parentPointer.lock().get() == this)
 			{
-				children.erase(it);
-				return;
+				child->parentPointer.reset();
+			}
+			return;
+		}
+		// Leave a null slot rather than shifting the later children.
+		std::get<TextTreePointer>(childStorage[*index]) = nullptr;
+		auto &removedChildren = rare_state().removedChildren;
+		removedChildren++;
+		while (!childStorage.empty() &&
+		       std::holds_alternative<TextTreePointer>(childStorage.back()) &&
+		       (std::get<TextTreePointer>(childStorage.back()) == nullptr))
+		{
+			childStorage.pop_back();
+			removedChildren--;
+		}
+	}
+
+	/**
+	 * Replace `child` with `replacements`, which may include `child` itself.
+	 * Does nothing if `child` is not a child of this node.  Replacing a
+	 * child with nothing removes it as `remove_child` does.
+	 */
+	void replace_child(const TextTreePointer  &child,
+	                   std::vector<Child>      replacements)
+	{
+		if (replacements.empty())
+		{
+			remove_child(child);
+			return;
+		}
+		will_mutate();
+		auto index = index_of(child.get());
+		if (!index)
+		{
+			return;
+		}
+		// Removing the replacements from their old parents leaves slots in
+		// place of them, so this does not move `child`, even if some of them
+		// were its siblings.
+		for (auto &replacement : replacements)
+		{
+			auto *node = std::get_if<TextTreePointer>(&replacement);
+			if ((node != nullptr) && (*node != child))
+			{
+				if (auto oldParent = (*node)->parent())
+				{
+					oldParent->remove_child(*node);
+				}
+			}
+		}
+		child->parent(nullptr);
+		auto self = shared_from_this();
+		for (size_t i = 0; i < replacements.size(); i++)
+		{
+			if (auto *node = std::get_if<TextTreePointer>(&replacements[i]))
+			{
+				(*node)->parent(self);
+				(*node)->indexHint = *index + i;
 			}
 		}
+		childStorage[*index] = std::move(replacements.front());
+		childStorage.insert(childStorage.begin() + *index + 1,
+		                    std::make_move_iterator(replacements.begin() + 1),
+		                    std::make_move_iterator(replacements.end()));
+	}
+
+	/**
+	 * Returns the index of `child` in `children()`, or nothing if it is not
+	 * a child of this node.
+	 */
+	std::optional<size_t> child_index(const TextTreePointer &child) const
+	{
+		materialize();
+		return index_of(child.get());
 	}
 
 	void append_child(Child child)
 	{
+		will_mutate();
 		if (std::holds_alternative<TextTreePointer>(child))
 		{
 			auto &childNode = std::get<TextTreePointer>(child);
-			if (childNode->parent() != nullptr)
+			if (auto oldParent = childNode->parent())
 			{
-				childNode->parent()->remove_child(childNode);
+				oldParent->remove_child(childNode);
 			}
 			childNode->parent(shared_from_this());
+			childNode->indexHint = childStorage.size();
 		}
-		children.push_back(child);
+		childStorage.push_back(std::move(child));
 	}
 
-	decltype(children) extract_children()
+	decltype(childStorage) extract_children()
 	{
-		decltype(children) extracted = std::move(children);
+		will_mutate();
+		decltype(childStorage) extracted = std::move(childStorage);
 		return extracted;
 	}
 
 	bool is_empty()
 	{
-		return children.empty() && attributeStorage.empty();
+		materialize();
+		return childStorage.empty() && attributeStorage.empty();
 	}
 
 	void clear()
 	{
+		will_mutate();
 		// Children that are nodes may be referenced elsewhere.  Detach them
 		// first.
-		for (auto &child : children)
+		for (auto &child : childStorage)
 		{
 			if (std::holds_alternative<TextTreePointer>(child))
 			{
 				std::get<TextTreePointer>(child)->parent(nullptr);
 			}
 		}
-		children.clear();
+		childStorage.clear();
+	}
+
+	/**
+	 * Replace the children of this node with highlighted code.  The node
+	 * reads as if its children were text runs and `code-run` nodes with a
+	 * `token-kind` attribute, which are created only when something
+	 * accesses or modifies the children.
+	 */
+	void code_spans(CodeSpans spans)
+	{
+		clear();
+		rare_state().codeSpanStorage =
+		  std::make_shared<const CodeSpans>(std::move(spans));
+		hasCodeSpans = true;
+	}
+
+	/**
+	 * Returns the highlighted code of this node if its children have not
+	 * been expanded from it, or null otherwise.  Output passes use this to
+	 * write highlighted code without expanding it.
+	 */
+	std::shared_ptr<const CodeSpans> code_spans() const
+	{
+		return pending_code_spans();
+	}
+
+	/**
+	 * Returns true if the children of this node are unexpanded highlighted
+	 * code.
+	 */
+	bool has_code_spans() const
+	{
+		materialize(false);
+		return hasCodeSpans;
 	}
 
 	static TextTreePointer create()
@@ -395,35 +1764,480 @@ class TextTree : public std::enable_shared_from_this<TextTree>
 	 */
 	std::string text()
 	{
+		if (auto spans = pending_code_spans())
+		{
+			return spans->text();
+		}
+		materialize();
 		// Special case if we have only one child and it's a string: just return
 		// it.
-		if ((children.size() == 1) &&
-		    std::holds_alternative<std::string>(children[0]))
+		if ((childStorage.size() == 1) &&
+		    std::holds_alternative<std::string>(childStorage[0]))
+		{
+			return std::get<std::string>(childStorage[0]);
+		}
+		if (auto text = cached_text())
 		{
-			return std::get<std::string>(children[0]);
+			return *text;
 		}
 		std::string result;
-		for (auto &child : children)
+		text_into(result);
+		return result;
+	}
+
+	void dump();
+
+	private:
+	TextTree() = default;
+
+	/**
+	 * Helper for `split_at_byte_index`.  If byte `index` is within the text
+	 * of this subtree, splits it there.  Otherwise, subtracts the length of
+	 * the text from `index` and leaves the subtree unchanged.  The text of
+	 * each node is measured only once, so this is linear in the size of the
+	 * subtree however deep the split point is.
+	 */
+	std::optional<std::pair<Child, Child>> split_if_within(size_t &index)
+	{
+		if (auto spans = pending_code_spans();
+		    spans && (index >= spans->text().size()))
+		{
+			index -= spans->text().size();
+			return std::nullopt;
+		}
+		materialize();
+		size_t                                 i = 0;
+		std::optional<std::pair<Child, Child>> childHalves;
+		for (; i < childStorage.size(); i++)
+		{
+			auto &child = childStorage[i];
+			if (std::holds_alternative<std::string>(child))
+			{
+				auto &text = std::get<std::string>(child);
+				if (index < text.size())
+				{
+					break;
+				}
+				index -= text.size();
+			}
+			else if ((childHalves = std::get<TextTreePointer>(child)
+			                          ->split_if_within(index)))
+			{
+				break;
+			}
+		}
+		if (i == childStorage.size())
+		{
+			return std::nullopt;
+		}
+		will_mutate();
+		TextTreePointer left  = shallow_clone();
+		TextTreePointer right = shallow_clone();
+		for (size_t j = 0; j < i; j++)
+		{
+			left->append_child(take_child(j));
+		}
+		if (childHalves)
+		{
+			left->append_child(std::move(childHalves->first));
+			right->append_child(std::move(childHalves->second));
+		}
+		else
+		{
+			auto &text = std::get<std::string>(childStorage[i]);
+			if (index > 0)
+			{
+				left->append_text(text.substr(0, index));
+			}
+			right->append_text(text.substr(index));
+		}
+		for (i++; i < childStorage.size(); i++)
+		{
+			right->append_child(take_child(i));
+		}
+		childStorage.clear();
+		return std::pair<Child, Child>{left, right};
+	}
+
+	/**
+	 * Move out the child at `index` and detach it, so that adding it to
+	 * another node does not need to look for it here.  The slot is left
+	 * empty and the caller must clear the children afterwards.
+	 */
+	Child take_child(size_t index)
+	{
+		auto child = std::move(childStorage[index]);
+		if (std::holds_alternative<TextTreePointer>(child))
+		{
+			std::get<TextTreePointer>(child)->parentPointer.reset();
+		}
+		return child;
+	}
+
+	/**
+	 * Run `visitor` on each of `work`, batching adjacent entries into pool
+	 * tasks of at least `threshold` nodes.  Returns the visitor results in the
+	 * same order as `work`.
+	 */
+	static std::vector<std::vector<Child>>
+	parallel_apply(const std::vector<Child *> &work,
+	               const Visitor              &visitor,
+	               size_t                      threshold)
+	{
+		std::vector<std::vector<Child>> results(work.size());
+		WorkStealingPool::TaskGroup group(WorkStealingPool::shared_instance());
+		size_t                      batchStart  = 0;
+		size_t                      batchWeight = 0;
+		auto                        flush       = [&](size_t end) {
+			if (batchStart < end)
+			{
+				group.run([&, start = batchStart, end]() {
+					for (size_t i = start; i < end; i++)
+					{
+						results[i] = visitor(*work[i]);
+					}
+				});
+			}
+			batchStart  = end;
+			batchWeight = 0;
+		};
+		for (size_t i = 0; i < work.size(); i++)
+		{
+			if (std::holds_alternative<TextTreePointer>(*work[i]))
+			{
+				batchWeight += std::get<TextTreePointer>(*work[i])->node_count();
+			}
+			else
+			{
+				batchWeight++;
+			}
+			if (batchWeight >= threshold)
+			{
+				flush(i + 1);
+			}
+		}
+		flush(work.size());
+		group.wait();
+		return results;
+	}
+
+	/**
+	 * Helper for the edit functions.  Passes each child node for which
+	 * `predicate` returns true to the visitor and descends into the others,
+	 * but not into unexpanded highlighted code unless `codeRuns` is true.
+	 *
+	 * Children are visited in place until the visitor first returns
+	 * replacements.  The remaining children are then moved aside and
+	 * appended as they are visited, as in `visit`, so that replacing many
+	 * children is not quadratic.
+	 */
+	template<typename Predicate>
+	void
+	edit_if(Predicate &&predicate, bool codeRuns, const EditVisitor &visitor)
+	{
+		if (!codeRuns && has_code_spans())
+		{
+			return;
+		}
+		materialize();
+		for (size_t i = 0; i < childStorage.size(); i++)
 		{
-			std::visit(
-			  [&result](auto &&arg) {
-				  if constexpr (std::is_same_v<std::decay_t<decltype(arg)>,
-				                               std::string>)
+			auto *slot = std::get_if<TextTreePointer>(&childStorage[i]);
+			if ((slot == nullptr) || (*slot == nullptr))
+			{
+				continue;
+			}
+			TextTreePointer child = *slot;
+			if (!predicate(*child))
+			{
+				if (child->may_contain_match(predicate, codeRuns))
+				{
+					child->edit_if(predicate, codeRuns, visitor);
+				}
+				continue;
+			}
+			child->indexHint = i;
+			if (Edit edit = visitor(child))
+			{
+				splice_edits(predicate, codeRuns, visitor, child, i, *edit);
+				return;
+			}
+			// The visitor may have changed the children.  Carry on after the
+			// child if it is still here.  If it is not, and its slot has been
+			// dropped, the next child is now in its slot.
+			if (auto index = index_of(child.get()))
+			{
+				i = *index;
+			}
+			else if (i < childStorage.size())
+			{
+				auto *next = std::get_if<TextTreePointer>(&childStorage[i]);
+				if ((next == nullptr) || (*next != nullptr))
+				{
+					i--;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Helper for `edit_if`.  Returns false if no node below this one can be
+	 * passed to the visitor, so that `edit_if` need not descend into it.
+	 * Only lazy clones are checked, by looking at the nodes that they share,
+	 * so that descending does not copy subtrees that contain no matches.
+	 * A match below a lazy clone is found again from each lazy clone on the
+	 * path to it, which is quadratic only in the depth of the path.
+	 */
+	template<typename Predicate>
+	bool may_contain_match(Predicate &predicate, bool codeRuns) const
+	{
+		if (!isLazy)
+		{
+			return true;
+		}
+		TextTreePointer source;
+		{
+			std::lock_guard lock(cowLock);
+			if (!isLazy)
+			{
+				return true;
+			}
+			source = rare()->cowSource;
+		}
+		std::function<bool(const TextTree &)> search =
+		  [&](const TextTree &node) {
+			  if (node.hasCodeSpans)
+			  {
+				  return codeRuns;
+			  }
+			  for (auto &child : node.childStorage)
+			  {
+				  auto *slot = std::get_if<TextTreePointer>(&child);
+				  if ((slot == nullptr) || (*slot == nullptr))
 				  {
-					  result += arg;
+					  continue;
 				  }
-				  else
+				  auto &childNode = **slot;
+				  if (predicate(childNode) ||
+				      (childNode.isLazy
+				         ? childNode.may_contain_match(predicate, codeRuns)
+				         : search(childNode)))
 				  {
-					  result += arg->text();
+					  return true;
 				  }
-			  },
-			  child);
+			  }
+			  return false;
+		  };
+		return search(*source);
+	}
+
+	/**
+	 * Helper for `edit_if`, called when the visitor first returns
+	 * replacements, for `child`, which was visited at `index`.  Replaces the
+	 * child and visits the children after it.
+	 */
+	template<typename Predicate>
+	void splice_edits(Predicate             &predicate,
+	                  bool                   codeRuns,
+	                  const EditVisitor     &visitor,
+	                  const TextTreePointer &child,
+	                  size_t                 index,
+	                  std::vector<Child>    &replacements)
+	{
+		will_mutate();
+		auto self     = shared_from_this();
+		auto position = index_of(child.get());
+		auto split    = childStorage.begin() +
+		             position.value_or(std::min(index, childStorage.size()));
+		std::vector<Child> pending(std::make_move_iterator(split),
+		                           std::make_move_iterator(childStorage.end()));
+		childStorage.erase(split, childStorage.end());
+		auto replace = [&](const TextTreePointer &node,
+		                   std::vector<Child>    &newChildren) {
+			if (node->parent() == self)
+			{
+				node->parent(nullptr);
+			}
+			for (auto &newChild : newChildren)
+			{
+				if (std::holds_alternative<TextTreePointer>(newChild))
+				{
+					auto &newNode = std::get<TextTreePointer>(newChild);
+					newNode->parent(self);
+					newNode->indexHint = childStorage.size();
+				}
+				childStorage.push_back(std::move(newChild));
+			}
+		};
+		replace(child, replacements);
+		// If the child was still here, it is the first pending child.
+		for (size_t i = position ? 1 : 0; i < pending.size(); i++)
+		{
+			if (!std::holds_alternative<TextTreePointer>(pending[i]))
+			{
+				childStorage.push_back(std::move(pending[i]));
+				continue;
+			}
+			auto node = std::get<TextTreePointer>(pending[i]);
+			// Skip children that an earlier visitor moved elsewhere.
+			if ((node == nullptr) || (node->parent() != self))
+			{
+				continue;
+			}
+			if (!predicate(*node))
+			{
+				if (node->may_contain_match(predicate, codeRuns))
+				{
+					node->edit_if(predicate, codeRuns, visitor);
+				}
+			}
+			else if (Edit edit = visitor(node))
+			{
+				replace(node, *edit);
+				continue;
+			}
+			if (node->parent() == self)
+			{
+				node->indexHint = childStorage.size();
+				childStorage.push_back(std::move(node));
+			}
+		}
+		// The visitor may have cached text or hashes for this subtree while
+		// children were detached.
+		if (caches_active())
+		{
+			invalidate_caches();
 		}
-		return result;
 	}
 
-	void dump();
+	/**
+	 * Helper for the parallel match functions.  Collects every node for
+	 * which `predicate` returns true, without descending into matches or,
+	 * unless `codeRuns` is true, into unexpanded highlighted code, runs
+	 * the visitor on them in parallel, and then splices the results into the
+	 * tree.
+	 */
+	template<typename Predicate>
+	void parallel_match_if(Predicate      &&predicate,
+	                       bool             codeRuns,
+	                       const Visitor   &visitor,
+	                       size_t           threshold)
+	{
+		std::vector<std::pair<TextTree *, size_t>> matches;
+		std::function<void(TextTree &)>            collect =
+		  [&](TextTree &node) {
+			  if (!codeRuns && node.has_code_spans())
+			  {
+				  return;
+			  }
+			  node.will_mutate();
+			  for (size_t i = 0; i < node.childStorage.size(); i++)
+			  {
+				  auto &child = node.childStorage[i];
+				  if (!std::holds_alternative<TextTreePointer>(child))
+				  {
+					  continue;
+				  }
+				  auto &childNode = std::get<TextTreePointer>(child);
+				  if (predicate(*childNode))
+				  {
+					  matches.emplace_back(&node, i);
+				  }
+				  else
+				  {
+					  collect(*childNode);
+				  }
+			  }
+		  };
+		collect(*this);
+		// Move the matched nodes out of the tree so that a visitor that
+		// reparents its node (for example, with `append_child`) does not
+		// modify a parent that other visitors may be reading.  The slots are
+		// left holding null pointers until the results are spliced in.
+		std::vector<Child>   pending;
+		std::vector<Child *> work;
+		pending.reserve(matches.size());
+		work.reserve(matches.size());
+		for (auto &[node, index] : matches)
+		{
+			pending.push_back(std::move(node->childStorage[index]));
+			node->childStorage[index] = TextTreePointer{};
+		}
+		for (auto &child : pending)
+		{
+			work.push_back(&child);
+		}
+		std::vector<std::vector<Child>> results;
+		try
+		{
+			results = parallel_apply(work, visitor, threshold);
+		}
+		catch (...)
+		{
+			// Put the matched nodes back, so that a caller that handles the
+			// error (for example, with `pcall` in Lua) has a valid tree.
+			for (size_t i = 0; i < matches.size(); i++)
+			{
+				auto [node, index]        = matches[i];
+				node->childStorage[index] = std::move(pending[i]);
+			}
+			throw;
+		}
+		// Rebuild the children of each parent once, rather than erasing and
+		// inserting for each match, which would be quadratic in a parent
+		// with many matches.  Matches in the same parent are in order.
+		std::vector<size_t> order(matches.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::ranges::stable_sort(
+		  order, {}, [&](size_t i) { return matches[i].first; });
+		for (size_t start = 0, end = 0; start < order.size(); start = end)
+		{
+			auto *node = matches[order[start]].first;
+			auto  self = node->shared_from_this();
+			auto &old  = node->childStorage;
 
-	private:
-	TextTree() = default;
+			std::vector<Child> children;
+			children.reserve(old.size());
+			size_t copied = 0;
+			// Move the unmatched children before `until` across.
+			auto keepUntil = [&](size_t until) {
+				for (; copied < until; copied++)
+				{
+					if (auto *kept = std::get_if<TextTreePointer>(&old[copied]))
+					{
+						(*kept)->indexHint = children.size();
+					}
+					children.push_back(std::move(old[copied]));
+				}
+			};
+			for (end = start;
+			     (end < order.size()) && (matches[order[end]].first == node);
+			     end++)
+			{
+				size_t i = order[end];
+				keepUntil(matches[i].second);
+				copied++;
+				auto &oldChild = std::get<TextTreePointer>(pending[i]);
+				if (oldChild->parent() == self)
+				{
+					oldChild->parent(nullptr);
+				}
+				for (auto &result : results[i])
+				{
+					if (auto *newNode = std::get_if<TextTreePointer>(&result))
+					{
+						(*newNode)->parent(self);
+						(*newNode)->indexHint = children.size();
+					}
+					children.push_back(std::move(result));
+				}
+			}
+			keepUntil(old.size());
+			old = std::move(children);
+			if (caches_active())
+			{
+				node->invalidate_caches();
+			}
+		}
+	}
 };
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <ostream>
+#include <string_view>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+/**
+ * Write `string` as a JSON string literal, for the reports that igk writes
+ * as JSON.
+ */
+inline void write_json_string(std::ostream &out, std::string_view string)
+{
+	out << '"';
+	for (char c : string)
+	{
+		switch (c)
+		{
+			case '"':
+				out << "\\\"";
+				break;
+			case '\\':
+				out << "\\\\";
+				break;
+			case '\n':
+				out << "\\n";
+				break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+				{
+					fmt::print(out, "\\u{:04x}", int(c));
+				}
+				else
+				{
+					out << c;
+				}
+		}
+	}
+	out << '"';
+}
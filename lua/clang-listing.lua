@@ -181,7 +181,7 @@ function cleanMarkdown(textTree)
 		if textTree.kind == "p" then
 			textTree:visit(cleanMarkdown)
 			-- Discard empty paragraphs.
-			if #textTree:text() == 0 then
+			if not textTree:has_text() then
 				textTree = nil
 			end
 		end
@@ -25,7 +25,7 @@ function visit(textTree)
 			innerDiv:attribute_set("class", "code-documentation-inner")
 			local heading = innerDiv:new_child()
 			heading.kind = "span"
-			heading:append_text("Documentation for the " .. textTree:attribute("code-declaration-entity") .. " " .. textTree:attribute("code-declaration-kind"))
+			heading:append_text("Documentation for the " .. (textTree:attribute("code-declaration-entity") or "") .. " " .. (textTree:attribute("code-declaration-kind") or ""))
 			heading:attribute_set("class", "code-documentation-heading")
 			innerDiv:take_children(textTree)
 			textTree:attribute_erase("code-declaration-entity")
@@ -59,7 +59,7 @@ function visit(textTree)
 				class = class .. " listing-code-numbered"
 				local firstLine = textTree:attribute("first-line")
 				textTree:attribute_erase("first-line")
-				textTree:attribute_set("style", "counter-reset: listing-line " .. tostring(tonumber(firstLine) - 1))
+				textTree:attribute_set("style", "counter-reset: listing-line " .. (firstLine - 1))
 			end
 			textTree:attribute_set("class", class)
 			local label = div:new_child("p")
@@ -68,10 +68,10 @@ function visit(textTree)
 			end
 			if textTree:has_attribute("number") then
 				label:attribute_set("number", textTree:attribute("number"))
-				label:append_text("Listing " .. textTree:attribute("number") .. ". ")
+				label:append_text("Listing " .. (textTree:attribute("number") or "") .. ". ")
 			end
 			label:attribute_set("class", "listing-caption")
-			label:append_text(textTree:attribute("caption"))
+			label:append_text(textTree:attribute("caption") or "")
 			local exampleOrigin = label:new_child()
 			exampleOrigin.kind = "span"
 			if textTree:has_attribute("filename") then
@@ -51,57 +51,63 @@ function visitCodeRuns(textTree)
 	return { textTree }
 end
 
-function visitClangDoc(textTree)
-	local center = TextTree.create({
-		kind = "center",
-		children = {
-			{
-				kind = "skip",
-				attributes = { height = "0.3em" },
-			},
-			{
-				kind = "framebox",
-				attributes = { shadow = true },
-				children = {
-					{
-						kind = "parbox",
-						attributes = {
-							valign = "middle",
-							width = "90%fw",
-							padding = "1em",
+-- The heading and frame around clang documentation, compiled once and then
+-- instantiated for each declaration.
+local clangDocFrame = TextTree.template({
+	kind = "center",
+	children = {
+		{
+			kind = "skip",
+			attributes = { height = "0.3em" },
+		},
+		{
+			kind = "framebox",
+			attributes = { shadow = true },
+			children = {
+				{
+					kind = "parbox",
+					attributes = {
+						valign = "middle",
+						width = "90%fw",
+						padding = "1em",
+					},
+					children = {
+						{
+							kind = "noindent",
 						},
-						children = {
-							{
-								kind = "noindent",
-							},
-							{
-								kind = "font",
-								attributes = { weight = 900 },
-								children = {
-									"Documentation for the ",
-									{
-										kind = "font",
-										attributes = { family = "Hack", size = "0.8em" },
-										children = {
-											textTree:attribute("code-declaration-entity"),
-										},
-									},
-									" " .. textTree:attribute("code-declaration-kind"),
+						{
+							kind = "font",
+							attributes = { weight = 900 },
+							children = {
+								"Documentation for the ",
+								{
+									kind = "font",
+									attributes = { family = "Hack", size = "0.8em" },
+									children = { { hole = "entity" } },
 								},
-							},
-							{
-								kind = "skip",
-								attributes = { height = "0.3em" },
+								{ hole = "kind" },
 							},
 						},
+						{
+							kind = "skip",
+							attributes = { height = "0.3em" },
+						},
 					},
 				},
 			},
-			{
-				kind = "skip",
-				attributes = { height = "0.3em" },
-			},
 		},
+		{
+			kind = "skip",
+			attributes = { height = "0.3em" },
+		},
+	},
+})
+
+function visitClangDoc(textTree)
+	local center = clangDocFrame({
+		entity = textTree:attribute("code-declaration-entity") or "",
+		-- Includes the space, so that the heading ends in one text run.
+		kind = " " .. (textTree:attribute("code-declaration-kind") or ""),
 	})
 	-- Add a noindent at the start and some vertical spacing at the end of each
 	-- paragraph or code block.
@@ -174,7 +180,7 @@ function visitCode(textTree)
 		if textTree:has_attribute("label") then
 			caption:attribute_set("marker", textTree:attribute("label"))
 		end
-		caption:append_text(textTree:attribute("caption"))
+		caption:append_text(textTree:attribute("caption") or "")
 		if textTree:has_attribute("filename") then
 			caption:append_text(" ")
 			local from = caption:new_child("hbox"):new_child("font")
@@ -0,0 +1,336 @@
+#pragma once
+
+#include "allocation_profiler.hh"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * The allocator for a Lua state.
+ *
+ * Lua passes allocate large numbers of small tables, strings and closures.
+ * Blocks up to `LargestPooled` bytes are taken from free lists, one for each
+ * size class, which are refilled from large chunks.  Larger blocks come from
+ * `malloc`.  Lua tells the allocator the size of each block that it frees,
+ * so blocks need no headers.
+ *
+ * When the state is closed, the pooled blocks are not freed one at a time.
+ * Instead, all of the chunks are returned at once to a cache shared by all
+ * states, so the next pass's state starts with memory that is already
+ * mapped.
+ *
+ * The allocator can limit the memory that the state uses.  Lua passes are
+ * trusted code, so exceeding the limit is fatal: the allocator reports the
+ * pass that it belongs to and exits.
+ *
+ * Each allocator is used by one thread at a time.  The chunk cache is shared
+ * and is protected by a lock.
+ */
+class LuaAllocator
+{
+	/// The size classes are multiples of this.
+	static constexpr size_t Granularity = 16;
+
+	/// The largest block that is allocated from a pool.
+	static constexpr size_t LargestPooled = 512;
+
+	/// The number of size classes.
+	static constexpr size_t ClassCount = LargestPooled / Granularity;
+
+	/// The size of the chunks that pools are refilled from.
+	static constexpr size_t ChunkSize = 64 * 1024;
+
+	/// The number of free chunks kept in the shared cache.
+	static constexpr size_t CachedChunks = 256;
+
+	/**
+	 * A block in a free list.
+	 */
+	struct FreeBlock
+	{
+		FreeBlock *next;
+	};
+
+	/// Lock protecting `chunkCache`.
+	inline static std::mutex chunkCacheLock;
+
+	/// Chunks returned by closed states, for reuse.
+	inline static std::vector<void *> chunkCache;
+
+	/// The free blocks in each size class.
+	std::array<FreeBlock *, ClassCount> freeLists{};
+
+	/// The chunks that this allocator has taken.
+	std::vector<void *> chunks;
+
+	/// The unused space at the end of the newest chunk.
+	char *chunkNext = nullptr;
+
+	/// The end of the newest chunk.
+	char *chunkEnd = nullptr;
+
+	/// The number of bytes that the state is using.
+	size_t bytesInUse = 0;
+
+	/// The most bytes that the state has used at once.
+	size_t peakBytes = 0;
+
+	/// The most bytes that the state may use, or zero for no limit.
+	size_t limitBytes = 0;
+
+	/// The name of the pass that the state belongs to, for diagnostics.
+	std::string ownerName;
+
+	/// True once the state is being closed.
+	bool closing = false;
+
+	/**
+	 * Returns the size class for a block of `size` bytes, which must be
+	 * between 1 and `LargestPooled`.
+	 */
+	static size_t size_class(size_t size)
+	{
+		return (size - 1) / Granularity;
+	}
+
+	/**
+	 * Returns true if a block of `size` bytes comes from a pool.
+	 */
+	static bool is_pooled(size_t size)
+	{
+		return size <= LargestPooled;
+	}
+
+	/**
+	 * Take a chunk from the cache, or allocate one, and start carving blocks
+	 * from it.  Returns false if no memory is available.
+	 */
+	bool refill()
+	{
+		void *chunk = nullptr;
+		{
+			std::lock_guard lock(chunkCacheLock);
+			if (!chunkCache.empty())
+			{
+				chunk = chunkCache.back();
+				chunkCache.pop_back();
+			}
+		}
+		if (chunk == nullptr)
+		{
+			chunk = malloc(ChunkSize);
+			if (chunk == nullptr)
+			{
+				return false;
+			}
+		}
+		chunks.push_back(chunk);
+		chunkNext = static_cast<char *>(chunk);
+		chunkEnd  = chunkNext + ChunkSize;
+		return true;
+	}
+
+	/**
+	 * Allocate a block of `size` bytes.
+	 */
+	void *allocate_block(size_t size)
+	{
+		if (!is_pooled(size))
+		{
+			return malloc(size);
+		}
+		size_t sizeClass = size_class(size);
+		if (FreeBlock *block = freeLists[sizeClass])
+		{
+			freeLists[sizeClass] = block->next;
+			return block;
+		}
+		size_t blockSize = (sizeClass + 1) * Granularity;
+		// The tail of the old chunk, if any, is too small for this block and
+		// is abandoned.
+		if ((size_t(chunkEnd - chunkNext) < blockSize) && !refill())
+		{
+			return nullptr;
+		}
+		void *block = chunkNext;
+		chunkNext += blockSize;
+		return block;
+	}
+
+	/**
+	 * Free a block of `size` bytes.
+	 */
+	void free_block(void *pointer, size_t size)
+	{
+		if (!is_pooled(size))
+		{
+			free(pointer);
+			return;
+		}
+		// The chunks are released together when the allocator is destroyed.
+		if (closing)
+		{
+			return;
+		}
+		auto  *block         = static_cast<FreeBlock *>(pointer);
+		size_t sizeClass     = size_class(size);
+		block->next          = freeLists[sizeClass];
+		freeLists[sizeClass] = block;
+	}
+
+	/**
+	 * Report that the state has exceeded its limit and exit.  This may be
+	 * called on a worker thread while other threads are running, so it
+	 * does not run static destructors, which could free state that they
+	 * are using.  Output is flushed first.
+	 */
+	[[noreturn]] void limit_exceeded(size_t size)
+	{
+		std::cerr << "Lua pass " << ownerName
+		          << " exceeded its memory limit of " << limitBytes
+		          << " bytes (" << bytesInUse << " bytes in use, allocating "
+		          << size << ")" << std::endl;
+		std::cout.flush();
+		fflush(nullptr);
+		_Exit(EXIT_FAILURE);
+	}
+
+	public:
+	LuaAllocator() = default;
+
+	LuaAllocator(const LuaAllocator &) = delete;
+
+	LuaAllocator &operator=(const LuaAllocator &) = delete;
+
+	/**
+	 * Release the chunks.  Chunks are kept in the shared cache, up to a
+	 * limit, for the next state.
+	 */
+	~LuaAllocator()
+	{
+		std::lock_guard lock(chunkCacheLock);
+		for (void *chunk : chunks)
+		{
+			if (chunkCache.size() < CachedChunks)
+			{
+				chunkCache.push_back(chunk);
+			}
+			else
+			{
+				free(chunk);
+			}
+		}
+	}
+
+	/**
+	 * Called before the state is closed.  Blocks that the state frees after
+	 * this are not returned to the free lists.
+	 */
+	void close()
+	{
+		closing = true;
+	}
+
+	/**
+	 * Set the name of the pass that the state belongs to.
+	 */
+	void owner(std::string name)
+	{
+		ownerName = std::move(name);
+	}
+
+	/**
+	 * Set the most bytes that the state may use.  Zero means no limit.
+	 */
+	void limit(size_t bytes)
+	{
+		limitBytes = bytes;
+	}
+
+	/**
+	 * Returns the number of bytes that the state is using.
+	 */
+	size_t bytes_in_use() const
+	{
+		return bytesInUse;
+	}
+
+	/**
+	 * Returns the most bytes that the state has used at once.
+	 */
+	size_t peak_bytes() const
+	{
+		return peakBytes;
+	}
+
+	/**
+	 * Allocation function with the interface of `lua_Alloc`.  `data` is the
+	 * allocator.
+	 */
+	static void *
+	allocate(void *data, void *pointer, size_t oldSize, size_t newSize)
+	{
+		auto &self = *static_cast<LuaAllocator *>(data);
+		AllocationProfiler::record_lua(pointer, oldSize, newSize);
+		// When `pointer` is null, `oldSize` is the type of the object.
+		if (pointer == nullptr)
+		{
+			oldSize = 0;
+		}
+		if (newSize == 0)
+		{
+			if (pointer != nullptr)
+			{
+				self.free_block(pointer, oldSize);
+				self.bytesInUse -= oldSize;
+			}
+			return nullptr;
+		}
+		if ((newSize > oldSize) && (self.limitBytes != 0) &&
+		    (self.bytesInUse - oldSize + newSize > self.limitBytes))
+		{
+			self.limit_exceeded(newSize);
+		}
+		void *result;
+		if ((pointer != nullptr) && is_pooled(oldSize) && is_pooled(newSize) &&
+		    (size_class(oldSize) == size_class(newSize)))
+		{
+			result = pointer;
+		}
+		else if ((pointer != nullptr) && !is_pooled(oldSize) &&
+		         !is_pooled(newSize))
+		{
+			result = realloc(pointer, newSize);
+		}
+		else
+		{
+			result = self.allocate_block(newSize);
+			if ((result != nullptr) && (pointer != nullptr))
+			{
+				memcpy(result, pointer, std::min(oldSize, newSize));
+				self.free_block(pointer, oldSize);
+			}
+		}
+		// Lua does not allow shrinking a block to fail.  If there was no
+		// memory to move it to a smaller size class, keep it where it is: it
+		// is big enough, and a block in a free list may be bigger than its
+		// class.
+		if ((result == nullptr) && (pointer != nullptr) && (newSize <= oldSize))
+		{
+			return pointer;
+		}
+		if (result != nullptr)
+		{
+			self.bytesInUse += newSize - oldSize;
+			self.peakBytes = std::max(self.peakBytes, self.bytesInUse);
+		}
+		return result;
+	}
+};
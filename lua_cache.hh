@@ -0,0 +1,235 @@
+#pragma once
+
+#include "sol.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+/**
+ * A cache of compiled Lua chunks, so that pass scripts are not lexed and
+ * compiled every time that igk runs.
+ *
+ * Each cache entry holds a header and then the output of `lua_dump`.  The
+ * header records the Lua release and the sizes that the bytecode format
+ * depends on, the chunk name, and a complete copy of the source.  An entry is
+ * used only if its header matches exactly, so an entry is never used for a
+ * different source or a different Lua, even if the hashes that name the
+ * entries collide.  Entries are written to a temporary file and renamed into
+ * place, so concurrent runs never see partial entries.  Entries that fail to
+ * load are replaced.
+ *
+ * Caching is disabled until a directory is set.
+ */
+class LuaChunkCache
+{
+	/// Identifies cache entries, and the version of their format.
+	static constexpr std::string_view Magic = "IGKLUAC1";
+
+	/// The directory that holds the cache, or empty if caching is disabled.
+	inline static std::filesystem::path directoryStorage;
+
+	/// A counter to make the names of temporary files unique.
+	inline static std::atomic<uint64_t> temporaryFiles = 0;
+
+	/**
+	 * Returns the contents of a file, or nothing if it cannot be read.
+	 */
+	static std::optional<std::string>
+	read_contents(const std::filesystem::path &path)
+	{
+		std::ifstream file{path, std::ios::binary};
+		if (!file)
+		{
+			return std::nullopt;
+		}
+		std::string contents{std::istreambuf_iterator<char>(file),
+		                     std::istreambuf_iterator<char>()};
+		if (file.bad())
+		{
+			return std::nullopt;
+		}
+		return contents;
+	}
+
+	/**
+	 * Append a length-prefixed string.
+	 */
+	static void append_field(std::string &out, std::string_view field)
+	{
+		uint64_t length = field.size();
+		out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+		out += field;
+	}
+
+	/**
+	 * Returns the header of the cache entry for a chunk.
+	 */
+	static std::string header(std::string_view chunkName,
+	                          std::string_view source)
+	{
+		std::string out{Magic};
+		append_field(out,
+		             fmt::format("{} {} {} {}",
+		                         LUA_RELEASE,
+		                         sizeof(void *),
+		                         sizeof(lua_Integer),
+		                         sizeof(lua_Number)));
+		append_field(out, chunkName);
+		append_field(out, source);
+		return out;
+	}
+
+	/**
+	 * 64-bit FNV-1a hash, used to name cache entries.
+	 */
+	static uint64_t hash(std::string_view data)
+	{
+		uint64_t hash = 0xcbf29ce484222325;
+		for (unsigned char c : data)
+		{
+			hash = (hash ^ c) * 0x100000001b3;
+		}
+		return hash;
+	}
+
+	/**
+	 * `lua_Writer` that appends to a string.
+	 */
+	static int
+	append_chunk(lua_State *, const void *data, size_t size, void *out)
+	{
+		static_cast<std::string *>(out)->append(
+		  static_cast<const char *>(data), size);
+		return 0;
+	}
+
+	/**
+	 * Write a cache entry.  Failures are ignored: the chunk will be compiled
+	 * again next time.
+	 */
+	static void store(const std::filesystem::path &path,
+	                  const std::string           &contents)
+	{
+		auto temporary = path;
+		temporary += fmt::format(".{}.{}.tmp", getpid(), temporaryFiles++);
+		std::error_code error;
+		{
+			std::ofstream file{temporary, std::ios::binary};
+			file.write(contents.data(), contents.size());
+			file.close();
+			if (!file)
+			{
+				std::filesystem::remove(temporary, error);
+				return;
+			}
+		}
+		std::filesystem::rename(temporary, path, error);
+		if (error)
+		{
+			std::filesystem::remove(temporary, error);
+		}
+	}
+
+	public:
+	/**
+	 * Set the directory that holds the cache, creating it if necessary.  An
+	 * empty path disables caching.  Returns false, and disables caching, if
+	 * the directory cannot be created.
+	 */
+	static bool directory(const std::filesystem::path &path)
+	{
+		directoryStorage.clear();
+		if (path.empty())
+		{
+			return true;
+		}
+		std::error_code error;
+		std::filesystem::create_directories(path, error);
+		if (error)
+		{
+			return false;
+		}
+		directoryStorage = path;
+		return true;
+	}
+
+	/**
+	 * Returns the directory that holds the cache, or an empty path if caching
+	 * is disabled.
+	 */
+	static const std::filesystem::path &directory()
+	{
+		return directoryStorage;
+	}
+
+	/**
+	 * Load a Lua source file as a chunk, using a cached compilation if there
+	 * is a valid one.  Behaves like `luaL_loadfile`: on success, pushes the
+	 * chunk and returns `LUA_OK`; on failure, pushes an error message and
+	 * returns an error code.
+	 */
+	static int load(lua_State *L, const std::filesystem::path &path)
+	{
+		auto source = read_contents(path);
+		if (!source)
+		{
+			lua_pushfstring(L, "cannot open %s", path.c_str());
+			return LUA_ERRFILE;
+		}
+		// As with `luaL_loadfile`, skip a `#!` line, but keep its newline so
+		// that line numbers are unchanged.
+		if (source->starts_with('#'))
+		{
+			source->erase(0, source->find('\n'));
+		}
+		std::string chunkName = "@" + path.string();
+		if (directoryStorage.empty())
+		{
+			return luaL_loadbufferx(
+			  L, source->data(), source->size(), chunkName.c_str(), "t");
+		}
+		std::string prefix = header(chunkName, *source);
+		auto        entry =
+		  directoryStorage / fmt::format("{:016x}.luac", hash(prefix));
+		if (auto cached = read_contents(entry);
+		    cached && cached->starts_with(prefix))
+		{
+			if (luaL_loadbufferx(L,
+			                     cached->data() + prefix.size(),
+			                     cached->size() - prefix.size(),
+			                     chunkName.c_str(),
+			                     "b") == LUA_OK)
+			{
+				return LUA_OK;
+			}
+			// A damaged entry.  Compile the source and replace it.
+			lua_pop(L, 1);
+		}
+		int status = luaL_loadbufferx(
+		  L, source->data(), source->size(), chunkName.c_str(), "t");
+		if (status != LUA_OK)
+		{
+			return status;
+		}
+		std::string contents = std::move(prefix);
+#if LUA_VERSION_NUM >= 503
+		int dumpStatus = lua_dump(L, append_chunk, &contents, 0);
+#else
+		int dumpStatus = lua_dump(L, append_chunk, &contents);
+#endif
+		if (dumpStatus == 0)
+		{
+			store(entry, contents);
+		}
+		return LUA_OK;
+	}
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "sol.hh"
+
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+/**
+ * Options for the Lua state that a Lua pass runs in, set with
+ * `--lua-options`.
+ *
+ * Options are written as comma-separated `key=value` pairs, optionally
+ * preceded by the name of a pass and a colon.  Options without a pass name
+ * apply to every Lua pass, and options for a named pass override them.  The
+ * keys are:
+ *
+ *  - `memory-limit`: the most memory that the pass's Lua state may use, in
+ *    bytes, with an optional `K`, `M` or `G` suffix.  Exceeding it is fatal.
+ *    Each `parallel_map` worker has a state of its own with the same limit,
+ *    so the total that a pass may use grows with the number of threads.
+ *  - `gc`: the garbage collector mode, `incremental` or `generational`.
+ *  - `pause`, `step-multiplier`, `step-size`: parameters of the incremental
+ *    collector.
+ *  - `minor-multiplier`, `major-multiplier`: parameters of the generational
+ *    collector.
+ *
+ * Options that are not set leave the state's settings unchanged.  The
+ * collector parameters have the meanings given in the Lua manual.
+ */
+struct LuaPassOptions
+{
+	/// The most memory that the state may use, in bytes.
+	std::optional<size_t> memoryLimit;
+
+	/// True for the generational collector, false for the incremental one.
+	std::optional<bool> generational;
+
+	/// Parameters of the incremental collector.
+	std::optional<int> pause;
+	std::optional<int> stepMultiplier;
+	std::optional<int> stepSize;
+
+	/// Parameters of the generational collector.
+	std::optional<int> minorMultiplier;
+	std::optional<int> majorMultiplier;
+
+	/**
+	 * Parse a non-negative integer, throwing `std::invalid_argument` on
+	 * failure.
+	 */
+	static uint64_t parse_number(std::string_view key, std::string_view value)
+	{
+		uint64_t number = 0;
+		auto [end, error] =
+		  std::from_chars(value.data(), value.data() + value.size(), number);
+		if ((error != std::errc()) || (end != value.data() + value.size()))
+		{
+			throw std::invalid_argument("invalid value for Lua option " +
+			                            std::string(key) + ": " +
+			                            std::string(value));
+		}
+		return number;
+	}
+
+	/**
+	 * Parse a size in bytes, with an optional `K`, `M` or `G` suffix.
+	 */
+	static size_t parse_size(std::string_view key, std::string_view value)
+	{
+		size_t scale = 1;
+		if (!value.empty())
+		{
+			switch (value.back())
+			{
+				case 'K':
+				case 'k':
+					scale = size_t(1) << 10;
+					break;
+				case 'M':
+				case 'm':
+					scale = size_t(1) << 20;
+					break;
+				case 'G':
+				case 'g':
+					scale = size_t(1) << 30;
+					break;
+			}
+		}
+		if (scale != 1)
+		{
+			value.remove_suffix(1);
+		}
+		return parse_number(key, value) * scale;
+	}
+
+	/**
+	 * Set one option.  Throws `std::invalid_argument` if the key or the
+	 * value is not valid.
+	 */
+	void set(std::string_view key, std::string_view value)
+	{
+		auto integer = [&]() { return int(parse_number(key, value)); };
+		if (key == "memory-limit")
+		{
+			memoryLimit = parse_size(key, value);
+		}
+		else if (key == "gc")
+		{
+			if ((value != "incremental") && (value != "generational"))
+			{
+				throw std::invalid_argument(
+				  "gc must be incremental or generational");
+			}
+			generational = (value == "generational");
+		}
+		else if (key == "pause")
+		{
+			pause = integer();
+		}
+		else if (key == "step-multiplier")
+		{
+			stepMultiplier = integer();
+		}
+		else if (key == "step-size")
+		{
+			stepSize = integer();
+		}
+		else if (key == "minor-multiplier")
+		{
+			minorMultiplier = integer();
+		}
+		else if (key == "major-multiplier")
+		{
+			majorMultiplier = integer();
+		}
+		else
+		{
+			throw std::invalid_argument("unknown Lua option: " +
+			                            std::string(key));
+		}
+	}
+
+	/**
+	 * Set options from a comma-separated list of `key=value` pairs.
+	 */
+	void parse(std::string_view options)
+	{
+		while (!options.empty())
+		{
+			auto comma  = options.find(',');
+			auto option = options.substr(0, comma);
+			options     = (comma == std::string_view::npos)
+			                ? std::string_view{}
+			                : options.substr(comma + 1);
+			auto eq     = option.find('=');
+			if ((eq == std::string_view::npos) || (eq == 0))
+			{
+				throw std::invalid_argument(
+				  "Lua options must be key=value pairs");
+			}
+			set(option.substr(0, eq), option.substr(eq + 1));
+		}
+	}
+
+	/**
+	 * Returns these options with any that are set in `overrides` replaced.
+	 */
+	LuaPassOptions merged(const LuaPassOptions &overrides) const
+	{
+		LuaPassOptions result = *this;
+		auto           merge  = [](auto &option, const auto &override) {
+			if (override)
+			{
+				option = override;
+			}
+		};
+		merge(result.memoryLimit, overrides.memoryLimit);
+		merge(result.generational, overrides.generational);
+		merge(result.pause, overrides.pause);
+		merge(result.stepMultiplier, overrides.stepMultiplier);
+		merge(result.stepSize, overrides.stepSize);
+		merge(result.minorMultiplier, overrides.minorMultiplier);
+		merge(result.majorMultiplier, overrides.majorMultiplier);
+		return result;
+	}
+
+	/**
+	 * Apply the collector options to a Lua state.
+	 */
+	void apply_gc(lua_State *L) const
+	{
+#if LUA_VERSION_NUM >= 504
+		// Zero leaves a parameter unchanged.
+		if (generational.value_or(false))
+		{
+			lua_gc(L,
+			       LUA_GCGEN,
+			       minorMultiplier.value_or(0),
+			       majorMultiplier.value_or(0));
+		}
+		else if (generational || pause || stepMultiplier || stepSize)
+		{
+			lua_gc(L,
+			       LUA_GCINC,
+			       pause.value_or(0),
+			       stepMultiplier.value_or(0),
+			       stepSize.value_or(0));
+		}
+#else
+		// Older versions have only the incremental collector.
+		if (pause)
+		{
+			lua_gc(L, LUA_GCSETPAUSE, *pause);
+		}
+		if (stepMultiplier)
+		{
+			lua_gc(L, LUA_GCSETSTEPMUL, *stepMultiplier);
+		}
+#endif
+	}
+};
@@ -0,0 +1,367 @@
+#pragma once
+
+#include "sol.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <ostream>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/format.h>
+
+#ifdef __linux__
+#	include <ctime>
+#	include <unistd.h>
+#endif
+
+/**
+ * Sampling profiler for Lua passes, for `--profile-lua`.
+ *
+ * A timer sends a signal to the thread that runs the passes once per
+ * interval.  The signal handler sets a count hook on the Lua state that is
+ * running, which fires at the next Lua instruction, records the stack, and
+ * removes itself.  Between samples, Lua runs without a count hook, which
+ * would otherwise slow down every instruction.  Each sample is charged with
+ * the time since the last one.
+ *
+ * The hook runs only when Lua code runs.  Native functions that call back
+ * into Lua, such as `TextTree::visit`, appear in the stacks, marked as native.
+ * Time in a native function that does not call back into Lua is charged to
+ * the Lua function that called it, when the next sample is taken.
+ *
+ * The stacks are written in the folded format that flame graph tools accept:
+ * one line per stack, with the pass and then the frames from outermost to
+ * innermost, separated by semicolons, followed by the time in microseconds.
+ *
+ * Lua allows one hook for each state, so the profiler does not install its
+ * own.  Passes say which state is running, and which hook it uses, with
+ * `Scope`, and the hook calls `sample` for count events.
+ *
+ * This is a singleton, like the other profilers.  It needs per-thread timers
+ * and so is available only on Linux.
+ */
+class LuaProfiler
+{
+	using Clock = std::chrono::steady_clock;
+
+	/// True if profiling was requested.
+	bool enabled = false;
+
+	/// The time between samples.
+	Clock::duration interval = std::chrono::milliseconds(1);
+
+#ifdef __linux__
+	/// The timer that requests samples.
+	timer_t timer;
+#endif
+
+	/// The Lua state that is running, if any.
+	std::atomic<lua_State *> activeState = nullptr;
+
+	/// The hook that `activeState` uses.
+	std::atomic<lua_Hook> activeHook = nullptr;
+
+	/// When the last sample was taken, or the current pass started.
+	Clock::time_point lastSample;
+
+	/// The pass being profiled, or empty between passes.
+	std::string pass;
+
+	/// The time charged to each folded stack, in microseconds.
+	std::unordered_map<std::string, uint64_t> stacks;
+
+	/// The frames of the stack being sampled, innermost first.
+	std::vector<std::string> frames;
+
+	/// A description of why profiling could not be enabled.
+	std::string errorMessage;
+
+	/**
+	 * Signal handler for the timer.  Asks the running state for a sample.
+	 * `lua_sethook` may be called from a signal handler.
+	 */
+	static void request_sample(int)
+	{
+		auto &profiler = shared_instance();
+		if (lua_State *L = profiler.activeState.load())
+		{
+			lua_sethook(L,
+			            profiler.activeHook.load(),
+			            lua_gethookmask(L) | LUA_MASKCOUNT,
+			            1);
+		}
+	}
+
+	/**
+	 * Returns the name of a native type from the `__name` field of its
+	 * metatable, without the decoration that sol adds.
+	 */
+	static std::string_view type_name(std::string_view name)
+	{
+		if (name.starts_with("sol."))
+		{
+			name.remove_prefix(4);
+		}
+		// Types held by shared pointers.
+		if (name.starts_with("sol::d::u<") && name.ends_with(">"))
+		{
+			name.remove_prefix(10);
+			name.remove_suffix(1);
+		}
+		return name;
+	}
+
+	/**
+	 * Returns the name of a native function in a frame.  Methods are
+	 * qualified with the type of their receiver, if it is a native object.
+	 */
+	static std::string native_frame_name(lua_State *L, lua_Debug &ar)
+	{
+		std::string name = ar.name ? ar.name : "?";
+#if LUA_VERSION_NUM >= 503
+		if ((ar.namewhat != nullptr) && (strcmp(ar.namewhat, "method") == 0))
+		{
+			// The receiver is the first argument.
+			if (lua_getlocal(L, &ar, 1) != nullptr)
+			{
+				if ((lua_type(L, -1) == LUA_TUSERDATA) &&
+				    (luaL_getmetafield(L, -1, "__name") == LUA_TSTRING))
+				{
+					name = fmt::format(
+					  "{}::{}", type_name(lua_tostring(L, -1)), name);
+					lua_pop(L, 1);
+				}
+				lua_pop(L, 1);
+			}
+		}
+#endif
+		return name + " [native]";
+	}
+
+	/**
+	 * Returns the name of the function in a frame.
+	 */
+	static std::string frame_name(lua_State *L, lua_Debug &ar)
+	{
+		lua_getinfo(L, "Sn", &ar);
+		std::string name;
+		if (ar.what[0] == 'C')
+		{
+			name = native_frame_name(L, ar);
+		}
+		else if (ar.what[0] == 'm')
+		{
+			name = fmt::format("main chunk ({})", ar.short_src);
+		}
+		else
+		{
+			name = fmt::format("{} ({}:{})",
+			                   ar.name ? ar.name : "?",
+			                   ar.short_src,
+			                   ar.linedefined);
+		}
+		// Semicolons separate frames in the output.
+		std::ranges::replace(name, ';', ',');
+		return name;
+	}
+
+	public:
+	/**
+	 * RAII helper that marks a Lua state as running while it is in scope.
+	 * `hook` is the state's debug hook, which must call `sample` for count
+	 * events.  Scopes may nest, for passes that run other passes.
+	 */
+	class Scope
+	{
+		lua_State *previousState = nullptr;
+		lua_Hook   previousHook  = nullptr;
+
+		public:
+		Scope(lua_State *L, lua_Hook hook)
+		{
+			auto &profiler = shared_instance();
+			if (profiler.enabled)
+			{
+				previousState = profiler.activeState.exchange(nullptr);
+				previousHook  = profiler.activeHook.exchange(hook);
+				profiler.activeState.store(L);
+			}
+		}
+
+		~Scope()
+		{
+			auto &profiler = shared_instance();
+			if (profiler.enabled)
+			{
+				profiler.activeState.store(nullptr);
+				profiler.activeHook.store(previousHook);
+				profiler.activeState.store(previousState);
+			}
+		}
+	};
+
+	~LuaProfiler()
+	{
+#ifdef __linux__
+		if (enabled)
+		{
+			timer_delete(timer);
+		}
+#endif
+	}
+
+	/**
+	 * Enable profiling, sampling every `sampleInterval`.  Must be called on
+	 * the thread that runs the passes.  Returns false if profiling is not
+	 * available, in which case `error` describes why.
+	 */
+	bool enable(std::chrono::microseconds sampleInterval)
+	{
+#ifdef __linux__
+		interval = sampleInterval;
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = request_sample;
+		action.sa_flags   = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		if (sigaction(SIGPROF, &action, nullptr) != 0)
+		{
+			errorMessage = strerror(errno);
+			return false;
+		}
+		// Deliver the signal to this thread, not to any worker thread.
+		struct sigevent event;
+		memset(&event, 0, sizeof(event));
+		event.sigev_notify   = SIGEV_THREAD_ID;
+		event.sigev_signo    = SIGPROF;
+		event._sigev_un._tid = gettid();
+		if (timer_create(CLOCK_MONOTONIC, &event, &timer) != 0)
+		{
+			errorMessage = strerror(errno);
+			return false;
+		}
+		auto seconds = std::chrono::floor<std::chrono::seconds>(interval);
+		struct itimerspec period;
+		period.it_interval.tv_sec  = seconds.count();
+		period.it_interval.tv_nsec =
+		  std::chrono::nanoseconds(interval - seconds).count();
+		period.it_value = period.it_interval;
+		if (timer_settime(timer, 0, &period, nullptr) != 0)
+		{
+			errorMessage = strerror(errno);
+			timer_delete(timer);
+			return false;
+		}
+		enabled = true;
+		return true;
+#else
+		errorMessage = "not supported on this platform";
+		return false;
+#endif
+	}
+
+	/**
+	 * Returns a description of why `enable` failed.
+	 */
+	const std::string &error() const
+	{
+		return errorMessage;
+	}
+
+	/**
+	 * Returns true if profiling is enabled.
+	 */
+	bool is_enabled() const
+	{
+		return enabled;
+	}
+
+	/**
+	 * Start charging samples to the named pass.
+	 */
+	void begin(std::string name)
+	{
+		if (!enabled)
+		{
+			return;
+		}
+		pass       = std::move(name);
+		lastSample = Clock::now();
+	}
+
+	/**
+	 * Stop charging samples to the current pass.
+	 */
+	void end()
+	{
+		pass.clear();
+	}
+
+	/**
+	 * Called from the hook of a Lua state for count events.  Records the
+	 * stack and removes the count hook until the next sample is requested.
+	 */
+	void sample(lua_State *L)
+	{
+		lua_sethook(
+		  L, lua_gethook(L), lua_gethookmask(L) & ~LUA_MASKCOUNT, 0);
+		if (!enabled || pass.empty() || (L != activeState.load()))
+		{
+			return;
+		}
+		auto now     = Clock::now();
+		auto elapsed = now - lastSample;
+		lastSample   = now;
+		frames.clear();
+		lua_Debug ar;
+		for (int level = 0; lua_getstack(L, level, &ar); level++)
+		{
+			frames.push_back(frame_name(L, ar));
+		}
+		std::string stack = pass;
+		for (auto &frame : frames | std::views::reverse)
+		{
+			stack += ';';
+			stack += frame;
+		}
+		stacks[stack] +=
+		  std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+		    .count();
+	}
+
+	/**
+	 * Write the samples as folded stacks.
+	 */
+	void write_folded(std::ostream &out) const
+	{
+		std::vector<const std::pair<const std::string, uint64_t> *> sorted;
+		for (auto &stack : stacks)
+		{
+			sorted.push_back(&stack);
+		}
+		std::ranges::sort(sorted,
+		                  [](auto *a, auto *b) { return a->first < b->first; });
+		for (auto *stack : sorted)
+		{
+			out << stack->first << ' ' << stack->second << '\n';
+		}
+		out << std::flush;
+	}
+
+	/**
+	 * Returns a singleton instance of this class.
+	 */
+	static LuaProfiler &shared_instance()
+	{
+		static LuaProfiler instance;
+		return instance;
+	}
+};
@@ -0,0 +1,339 @@
+#pragma once
+
+#include "json.hh"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+/**
+ * Records where the time goes in each pass, for `--time-passes`.
+ *
+ * Time is attributed to a stack of categories.  Each pass starts in native
+ * code.  Lua passes push the Lua category while Lua code runs and the native
+ * category while Lua calls into native functions.  Plugin entry points push
+ * their own categories.  Only the time at the top of the stack is charged, so
+ * the categories of a pass add up to its wall time.
+ *
+ * Only the thread that started the pass is tracked.  Time on worker threads
+ * is included in the CPU time of the pass but is not categorised.
+ *
+ * This is a singleton so that plugins, which are loaded into the same
+ * process, record into the same timer.  When timing is not enabled, scopes
+ * cost a single test.
+ */
+class PassTimer
+{
+	public:
+	/**
+	 * The categories of time within a pass.
+	 */
+	enum class Category
+	{
+		Native,
+		Lua,
+		Output,
+		Clang,
+		TreeSitter,
+		ReadFile,
+		Count
+	};
+
+	/**
+	 * Names of the categories, as used in reports.
+	 */
+	static constexpr std::array<std::string_view, size_t(Category::Count)>
+	  CategoryNames = {
+	    "native", "lua", "output", "clang", "tree-sitter", "read-file"};
+
+	/**
+	 * The times recorded for one pass, in seconds.
+	 */
+	struct Record
+	{
+		std::string                                 pass;
+		double                                      wall = 0;
+		double                                      cpu  = 0;
+		std::array<double, size_t(Category::Count)> categories{};
+	};
+
+	/**
+	 * RAII helper that charges time to a category while it is in scope.
+	 * Anything pushed inside the scope and not popped (for example, because
+	 * a Lua error unwound past it) is popped with it.
+	 */
+	class Scope
+	{
+		size_t depth = 0;
+
+		public:
+		Scope(Category category)
+		{
+			auto &timer = shared_instance();
+			if (timer.is_active())
+			{
+				depth = timer.stack.size();
+				timer.push(category);
+			}
+		}
+
+		~Scope()
+		{
+			auto &timer = shared_instance();
+			if ((depth > 0) && timer.is_active())
+			{
+				timer.pop_to(depth);
+			}
+		}
+	};
+
+	private:
+	using Clock = std::chrono::steady_clock;
+
+	/// True if timing was requested.
+	bool enabled = false;
+
+	/// The thread that runs the passes.
+	std::thread::id owner;
+
+	/// The categories active in the current pass, innermost last.
+	std::vector<Category> stack;
+
+	/// The record for the current pass.
+	Record current;
+
+	/// When the time at the top of the stack was last charged.
+	Clock::time_point lastCharge;
+
+	/// When the current pass started.
+	Clock::time_point wallStart;
+
+	/// The process CPU time when the current pass started.
+	double cpuStart = 0;
+
+	/// The records of the completed passes, in the order that they ran.
+	std::vector<Record> records;
+
+	/**
+	 * Returns the CPU time used by all threads in this process, in seconds.
+	 */
+	static double cpu_time()
+	{
+		struct timespec time;
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+		return time.tv_sec + time.tv_nsec * 1e-9;
+	}
+
+	/**
+	 * Charge the time since the last charge to the top of the stack.
+	 */
+	void charge()
+	{
+		auto now = Clock::now();
+		current.categories[size_t(stack.back())] +=
+		  std::chrono::duration<double>(now - lastCharge).count();
+		lastCharge = now;
+	}
+
+	/**
+	 * Returns the records sorted by decreasing wall time.
+	 */
+	std::vector<const Record *> sorted_records() const
+	{
+		std::vector<const Record *> sorted;
+		for (auto &record : records)
+		{
+			sorted.push_back(&record);
+		}
+		std::ranges::stable_sort(
+		  sorted, [](auto *a, auto *b) { return a->wall > b->wall; });
+		return sorted;
+	}
+
+	public:
+	/**
+	 * Enable timing.  Must be called on the thread that runs the passes.
+	 */
+	void enable()
+	{
+		enabled = true;
+		owner   = std::this_thread::get_id();
+	}
+
+	/**
+	 * Returns true if timing is enabled.
+	 */
+	bool is_enabled() const
+	{
+		return enabled;
+	}
+
+	/**
+	 * Returns true if a pass is being timed and this is the thread that runs
+	 * it.
+	 */
+	bool is_active() const
+	{
+		return enabled && !stack.empty() &&
+		       (std::this_thread::get_id() == owner);
+	}
+
+	/**
+	 * Start timing a pass.  `name` is the name of the pass, or a
+	 * description of another phase such as scanning the input.
+	 */
+	void begin(std::string name)
+	{
+		if (!enabled)
+		{
+			return;
+		}
+		current    = Record{std::move(name)};
+		cpuStart   = cpu_time();
+		wallStart  = Clock::now();
+		lastCharge = wallStart;
+		stack.assign(1, Category::Native);
+	}
+
+	/**
+	 * Finish timing the current pass.
+	 */
+	void end()
+	{
+		if (!enabled || stack.empty())
+		{
+			return;
+		}
+		charge();
+		current.wall =
+		  std::chrono::duration<double>(Clock::now() - wallStart).count();
+		current.cpu = cpu_time() - cpuStart;
+		stack.clear();
+		records.push_back(std::move(current));
+	}
+
+	/**
+	 * Start charging time to `category`.
+	 */
+	void push(Category category)
+	{
+		if (!is_active())
+		{
+			return;
+		}
+		charge();
+		stack.push_back(category);
+	}
+
+	/**
+	 * Stop charging time to the category on the top of the stack.  The
+	 * category that the pass started in is never popped.
+	 */
+	void pop()
+	{
+		if (!is_active() || (stack.size() < 2))
+		{
+			return;
+		}
+		charge();
+		stack.pop_back();
+	}
+
+	/**
+	 * Pop categories until there are `depth` left.
+	 */
+	void pop_to(size_t depth)
+	{
+		if (!is_active() || (stack.size() <= depth))
+		{
+			return;
+		}
+		charge();
+		stack.resize(std::max<size_t>(depth, 1));
+	}
+
+	/**
+	 * Print the recorded times as a table, most expensive first.
+	 */
+	void print_report(std::ostream &out) const
+	{
+		fmt::print(
+		  out, "{:<28} {:>10} {:>10}", "Pass", "Wall (ms)", "CPU (ms)");
+		for (auto name : CategoryNames)
+		{
+			fmt::print(out, " {:>11}", name);
+		}
+		out << '\n';
+		Record total{"Total"};
+		auto   row = [&](const Record &record) {
+			fmt::print(out,
+			           "{:<28} {:>10.2f} {:>10.2f}",
+			           record.pass,
+			           record.wall * 1e3,
+			           record.cpu * 1e3);
+			for (auto time : record.categories)
+			{
+				fmt::print(out, " {:>11.2f}", time * 1e3);
+			}
+			out << '\n';
+		};
+		for (auto *record : sorted_records())
+		{
+			row(*record);
+			total.wall += record->wall;
+			total.cpu += record->cpu;
+			for (size_t i = 0; i < total.categories.size(); i++)
+			{
+				total.categories[i] += record->categories[i];
+			}
+		}
+		row(total);
+		out << std::flush;
+	}
+
+	/**
+	 * Write the recorded times as a JSON array of objects, most expensive
+	 * first.  Times are in seconds.
+	 */
+	void write_json(std::ostream &out) const
+	{
+		out << "[";
+		bool first = true;
+		for (auto *record : sorted_records())
+		{
+			out << (first ? "\n" : ",\n");
+			first = false;
+			out << "{\"pass\": ";
+			write_json_string(out, record->pass);
+			fmt::print(
+			  out, ", \"wall\": {}, \"cpu\": {}", record->wall, record->cpu);
+			for (size_t i = 0; i < CategoryNames.size(); i++)
+			{
+				fmt::print(out,
+				           ", \"{}\": {}",
+				           CategoryNames[i],
+				           record->categories[i]);
+			}
+			out << "}";
+		}
+		out << "\n]\n";
+	}
+
+	/**
+	 * Returns a singleton instance of this class.
+	 */
+	static PassTimer &shared_instance()
+	{
+		static PassTimer instance;
+		return instance;
+	}
+};
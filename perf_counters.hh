@@ -0,0 +1,319 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+#ifdef __linux__
+#	include <linux/perf_event.h>
+#	include <sys/ioctl.h>
+#	include <sys/syscall.h>
+#endif
+
+/**
+ * Hardware performance counters for each pass, for `--perf-counters`.
+ *
+ * The counters are opened as a single `perf_event_open` group, so that they
+ * all count over the same interval, and count only user-space events on the
+ * thread that opened them.  Work done on worker threads is not counted.
+ *
+ * Counters are often unavailable, for example in containers, in virtual
+ * machines, or when `perf_event_paranoid` forbids them.  Any counter that
+ * cannot be opened is left out and reported as unavailable.  If none can be
+ * opened, `open` returns false and the report is empty.
+ */
+class PerfCounters
+{
+	public:
+	/**
+	 * The counters that are recorded.
+	 */
+	enum class Counter
+	{
+		Cycles,
+		Instructions,
+		CacheReferences,
+		CacheMisses,
+		Branches,
+		BranchMisses,
+		Count
+	};
+
+	/**
+	 * The counts for one stage of the run.  Counts that were not available
+	 * are missing from `valid`.
+	 */
+	struct Record
+	{
+		std::string                                  stage;
+		std::array<uint64_t, size_t(Counter::Count)> values{};
+		std::array<bool, size_t(Counter::Count)>     valid{};
+
+		/**
+		 * Returns the value of a counter, or zero if it was not available.
+		 */
+		uint64_t operator[](Counter counter) const
+		{
+			return valid[size_t(counter)] ? values[size_t(counter)] : 0;
+		}
+
+		/**
+		 * Returns true if the counter was available.
+		 */
+		bool has(Counter counter) const
+		{
+			return valid[size_t(counter)];
+		}
+	};
+
+	private:
+	/// The file descriptors of the counters that were opened, leader first.
+	std::vector<int> descriptors;
+
+	/// The counter that each descriptor counts.
+	std::vector<Counter> counters;
+
+	/// The record for the current stage.
+	Record current;
+
+	/// The records of the completed stages, in the order that they ran.
+	std::vector<Record> records;
+
+	/// Why the counters could not be opened.
+	std::string errorMessage;
+
+#ifdef __linux__
+	/**
+	 * Returns the `perf_event_attr` configuration for a counter.
+	 */
+	static uint64_t event_config(Counter counter)
+	{
+		switch (counter)
+		{
+			case Counter::Cycles:
+				return PERF_COUNT_HW_CPU_CYCLES;
+			case Counter::Instructions:
+				return PERF_COUNT_HW_INSTRUCTIONS;
+			case Counter::CacheReferences:
+				return PERF_COUNT_HW_CACHE_REFERENCES;
+			case Counter::CacheMisses:
+				return PERF_COUNT_HW_CACHE_MISSES;
+			case Counter::Branches:
+				return PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+			case Counter::BranchMisses:
+			case Counter::Count:
+				break;
+		}
+		return PERF_COUNT_HW_BRANCH_MISSES;
+	}
+
+	/**
+	 * Apply `request` to the whole group.
+	 */
+	void group_ioctl(unsigned long request)
+	{
+		ioctl(descriptors.front(), request, PERF_IOC_FLAG_GROUP);
+	}
+#endif
+
+	public:
+	PerfCounters() = default;
+
+	PerfCounters(const PerfCounters &) = delete;
+
+	PerfCounters &operator=(const PerfCounters &) = delete;
+
+	~PerfCounters()
+	{
+		for (int fd : descriptors)
+		{
+			close(fd);
+		}
+	}
+
+	/**
+	 * Open the counters.  Returns false if none are available, in which case
+	 * `error` describes why.
+	 */
+	bool open()
+	{
+#ifdef __linux__
+		for (size_t i = 0; i < size_t(Counter::Count); i++)
+		{
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size   = sizeof(attr);
+			attr.type   = PERF_TYPE_HARDWARE;
+			attr.config = event_config(Counter(i));
+			// The group is enabled and disabled through the leader.
+			attr.disabled       = descriptors.empty();
+			attr.exclude_kernel = 1;
+			attr.exclude_hv     = 1;
+			attr.read_format    = PERF_FORMAT_GROUP |
+			                   PERF_FORMAT_TOTAL_TIME_ENABLED |
+			                   PERF_FORMAT_TOTAL_TIME_RUNNING;
+			int fd = syscall(__NR_perf_event_open,
+			                 &attr,
+			                 0,
+			                 -1,
+			                 descriptors.empty() ? -1 : descriptors.front(),
+			                 0);
+			if (fd < 0)
+			{
+				// Without cycles there is no group to add the rest to.
+				if (descriptors.empty())
+				{
+					errorMessage = strerror(errno);
+					return false;
+				}
+				continue;
+			}
+			descriptors.push_back(fd);
+			counters.push_back(Counter(i));
+		}
+		return true;
+#else
+		errorMessage = "not supported on this platform";
+		return false;
+#endif
+	}
+
+	/**
+	 * Returns true if the counters are open.
+	 */
+	bool is_open() const
+	{
+		return !descriptors.empty();
+	}
+
+	/**
+	 * Returns why the counters could not be opened.
+	 */
+	const std::string &error() const
+	{
+		return errorMessage;
+	}
+
+	/**
+	 * Start counting a stage.  `name` is the name of the pass, or a
+	 * description of another stage such as scanning the input.
+	 */
+	void begin(std::string name)
+	{
+		if (!is_open())
+		{
+			return;
+		}
+		current = Record{std::move(name)};
+#ifdef __linux__
+		group_ioctl(PERF_EVENT_IOC_RESET);
+		group_ioctl(PERF_EVENT_IOC_ENABLE);
+#endif
+	}
+
+	/**
+	 * Finish counting the current stage.
+	 */
+	void end()
+	{
+		if (!is_open())
+		{
+			return;
+		}
+#ifdef __linux__
+		group_ioctl(PERF_EVENT_IOC_DISABLE);
+		// The number of counters, the time enabled, the time running, and
+		// then the values in the order in which the counters were opened.
+		std::vector<uint64_t> buffer(3 + descriptors.size());
+		ssize_t size = read(descriptors.front(),
+		                    buffer.data(),
+		                    buffer.size() * sizeof(uint64_t));
+		uint64_t enabled = buffer[1];
+		uint64_t running = buffer[2];
+		// If the group was never scheduled onto the hardware there are no
+		// counts.  If it was multiplexed with other events then it ran for
+		// part of the time, so scale the counts up to estimate the total.
+		if ((size == ssize_t(buffer.size() * sizeof(uint64_t))) &&
+		    (running > 0))
+		{
+			double scale = double(enabled) / double(running);
+			for (size_t i = 0; i < counters.size(); i++)
+			{
+				auto counter = size_t(counters[i]);
+				current.values[counter] = uint64_t(buffer[3 + i] * scale);
+				current.valid[counter]  = true;
+			}
+		}
+#endif
+		records.push_back(std::move(current));
+	}
+
+	/**
+	 * Returns the records of the completed stages.
+	 */
+	const std::vector<Record> &results() const
+	{
+		return records;
+	}
+
+	/**
+	 * Print the counts as a table, in the order that the stages ran, with
+	 * instructions per cycle and cache and branch miss rates.  Counts that
+	 * were not available are shown as `-`.
+	 */
+	void print_report(std::ostream &out) const
+	{
+		fmt::print(out,
+		           "{:<28} {:>14} {:>14} {:>6} {:>12} {:>7} {:>12} {:>7}\n",
+		           "Stage",
+		           "Cycles",
+		           "Instructions",
+		           "IPC",
+		           "Cache miss",
+		           "Miss %",
+		           "Branch miss",
+		           "Miss %");
+		auto count = [](const Record &record, Counter counter) {
+			return record.has(counter) ? fmt::format("{}", record[counter])
+			                           : std::string("-");
+		};
+		auto ratio = [](const Record &record,
+		                Counter       numerator,
+		                Counter       denominator,
+		                double        scale) {
+			if (!record.has(numerator) || !record.has(denominator) ||
+			    (record[denominator] == 0))
+			{
+				return std::string("-");
+			}
+			return fmt::format(
+			  "{:.2f}",
+			  scale * double(record[numerator]) / double(record[denominator]));
+		};
+		for (auto &record : records)
+		{
+			fmt::print(
+			  out,
+			  "{:<28} {:>14} {:>14} {:>6} {:>12} {:>7} {:>12} {:>7}\n",
+			  record.stage,
+			  count(record, Counter::Cycles),
+			  count(record, Counter::Instructions),
+			  ratio(record, Counter::Instructions, Counter::Cycles, 1),
+			  count(record, Counter::CacheMisses),
+			  ratio(
+			    record, Counter::CacheMisses, Counter::CacheReferences, 100),
+			  count(record, Counter::BranchMisses),
+			  ratio(record, Counter::BranchMisses, Counter::Branches, 100));
+		}
+		out << std::flush;
+	}
+};
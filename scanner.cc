@@ -2,6 +2,7 @@
 
 #include <CLI/CLI.hpp>
 
+#include <algorithm>
 #include <bit>
 #include <cassert>
 #include <filesystem>
@@ -13,16 +14,31 @@
 // package.
 #include <dlfcn.h>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <variant>
 
+#include "allocation_profiler.hh"
+#include "checkpoint.hh"
 #include "document.hh"
+#include "lua_allocator.hh"
+#include "lua_cache.hh"
+#include "lua_pass_options.hh"
+#include "lua_profiler.hh"
+#include "pass_timer.hh"
+#include "perf_counters.hh"
 #include "passes.hh"
+#include "selector.hh"
 #include "sol.hh"
 #include "sol.hpp"
 #include "source_manager.hh"
+#include "trace.hh"
+#include "tree_stats.hh"
+#include "tree_template.hh"
+#include "tree_walker.hh"
 
 struct TokenHandler
 {
@@ -43,7 +59,7 @@ class TextTreeBuilder : public TokenHandler
 		current = current->new_child();
 		assert(current);
 		current->sourceRange = range;
-		current->kind        = command;
+		current->kind(command);
 	}
 
 	virtual void command_end(SourceRange range)
@@ -64,7 +80,7 @@ class TextTreeBuilder : public TokenHandler
 	virtual void
 	command_argument(SourceRange, std::string argument, std::string value)
 	{
-		current->attribute(argument) = value;
+		current->attribute_set(argument, value);
 	}
 	virtual void text(SourceRange, std::string text)
 	{
@@ -542,7 +558,9 @@ class TeXStyleScanner
 
 TextTreePointer read_file(const std::filesystem::path &inputPath)
 {
-	std::ifstream file{inputPath, std::ios::binary};
+	PassTimer::Scope     timer(PassTimer::Category::ReadFile);
+	TraceRecorder::Span span("read_file", "input", inputPath.string());
+	std::ifstream        file{inputPath, std::ios::binary};
 	std::string   text;
 	auto          size = std::filesystem::file_size(inputPath);
 	text.resize(size);
@@ -554,6 +572,7 @@ TextTreePointer read_file(const std::filesystem::path &inputPath)
 	  sourceManager.add_file(inputPath, std::move(text));
 	try
 	{
+		TraceRecorder::Span span("scan", "input");
 		TeXStyleScanner(sourceManager, fileID, contents, treeBuilder);
 		return treeBuilder.complete();
 	}
@@ -585,6 +604,54 @@ static std::unordered_map<std::string, std::variant<double, bool, std::string>>
 
 class TeXOutputPass : public OutputPass
 {
+	/**
+	 * Write a text run, escaping the characters that end or start a node.
+	 */
+	void write_text(std::string_view text)
+	{
+		if (text.contains('\\') || text.contains('}'))
+		{
+			std::string escaped{text};
+			for (size_t pos = 0; pos < escaped.size(); pos++)
+			{
+				if ((escaped[pos] == '\\') || (escaped[pos] == '}'))
+				{
+					escaped.insert(pos, 1, '\\');
+					pos++;
+				}
+			}
+			out() << escaped;
+		}
+		else
+		{
+			out() << text;
+		}
+	}
+
+	/**
+	 * Write a named attribute, quoting the value if it contains a comma.
+	 */
+	void write_attribute(const std::string &name, const std::string &value)
+	{
+		if (value.contains(','))
+		{
+			std::string escaped = value;
+			for (size_t pos = 0; pos < escaped.size(); pos++)
+			{
+				if (escaped[pos] == '"')
+				{
+					escaped.insert(pos, 1, '\\');
+					pos++;
+				}
+			}
+			out() << name << "=\"" << escaped << '"';
+		}
+		else
+		{
+			out() << name << '=' << value;
+		}
+	}
+
 	void visitor(const TextTree::Child &node)
 	{
 		std::visit(
@@ -593,9 +660,9 @@ class TeXOutputPass : public OutputPass
 			                  TextTreePointer,
 			                  std::remove_cvref_t<decltype(child)>>)
 			  {
-				  if (!child->kind.empty())
+				  if (!child->kind().empty())
 				  {
-					  out() << '\\' << child->kind;
+					  out() << '\\' << child->kind();
 				  }
 				  if (!child->attributes().empty())
 				  {
@@ -607,69 +674,55 @@ class TeXOutputPass : public OutputPass
 						  {
 							  out() << ',';
 						  }
+						  auto value = TextTree::to_string(attr.second);
 						  if (attr.first.empty())
 						  {
-							  out() << attr.second;
+							  out() << value;
 						  }
 						  else
 						  {
-							  // If the string contains a comma, quote it and
-							  // escape quotes.
-							  if (attr.second.contains(','))
-							  {
-								  std::string escaped = attr.second;
-								  for (size_t pos = 0; pos < escaped.size();
-								       pos++)
-								  {
-									  if (escaped[pos] == '"')
-									  {
-										  escaped.insert(pos, 1, '\\');
-										  pos++;
-									  }
-								  }
-								  out()
-								    << attr.first << "=\"" << escaped << '"';
-							  }
-							  else
-							  {
-								  out() << attr.first << '=' << attr.second;
-							  }
+							  write_attribute(attr.first, value);
 						  }
 						  first = false;
 					  }
 					  out() << ']';
 				  }
-				  if (!(child->kind.empty() && child->attributes().empty()))
+				  if (!(child->kind().empty() && child->attributes().empty()))
 				  {
 					  out() << '{';
 				  }
-				  child->const_visit(
-				    [this](auto node) { return visitor(node); });
-				  if (!(child->kind.empty() && child->attributes().empty()))
+				  // Write highlighted code directly, as it would be written
+				  // after expansion.
+				  if (auto spans = child->code_spans())
 				  {
-					  out() << '}';
+					  spans->for_each(
+					    [this](std::string_view text, const std::string *kind) {
+						    if (kind == nullptr)
+						    {
+							    write_text(text);
+							    return;
+						    }
+						    out() << "\\code-run[";
+						    write_attribute("token-kind", *kind);
+						    out() << "]{";
+						    write_text(text);
+						    out() << '}';
+					    });
 				  }
-			  }
-			  else
-			  {
-				  if (child.contains('\\') || child.contains('}'))
+				  else
 				  {
-					  std::string escaped = child;
-					  for (size_t pos = 0; pos < escaped.size(); pos++)
-					  {
-						  if ((escaped[pos] == '\\') || (escaped[pos] == '}'))
-						  {
-							  escaped.insert(pos, 1, '\\');
-							  pos++;
-						  }
-					  }
-					  out() << escaped;
+					  child->const_visit(
+					    [this](auto node) { return visitor(node); });
 				  }
-				  else
+				  if (!(child->kind().empty() && child->attributes().empty()))
 				  {
-					  out() << child;
+					  out() << '}';
 				  }
 			  }
+			  else
+			  {
+				  write_text(child);
+			  }
 		  },
 		  node);
 	}
@@ -677,6 +730,8 @@ class TeXOutputPass : public OutputPass
 	public:
 	TextTreePointer process(TextTreePointer tree) override
 	{
+		PassTimer::Scope    timer(PassTimer::Category::Output);
+		TraceRecorder::Span span("TeX output", "output");
 		if (!tree)
 		{
 			return nullptr;
@@ -685,6 +740,14 @@ class TeXOutputPass : public OutputPass
 		return tree;
 	}
 
+	/**
+	 * Write a single child, which may be a text run.
+	 */
+	void output(const TextTree::Child &child)
+	{
+		visitor(child);
+	}
+
 	static std::string name()
 	{
 		return "TeXOutputPass";
@@ -698,6 +761,270 @@ void TextTree::dump()
 	out.process(shared_from_this());
 }
 
+/**
+ * Prints the parts of a tree that differ from an earlier version of it, for
+ * `--print-changes`.  Subtrees are compared by their structural hashes,
+ * which are computed at most once for each printer, so unchanged subtrees
+ * are skipped without being compared node by node.  Each change is printed
+ * with the source location of the nearest node that has one.
+ *
+ * If a set of kinds is given, only changes inside nodes of those kinds are
+ * printed.
+ */
+class TreeChangePrinter
+{
+	/// Kinds to restrict output to, or empty to print everything.
+	const std::unordered_set<std::string> &kinds;
+
+	/// Printer for subtrees.
+	TeXOutputPass out;
+
+	/// Hashes of the subtrees compared so far.
+	TextTree::HashCache hashes;
+
+	/**
+	 * Returns the structural hash of `child`, hashing each subtree at most
+	 * once.
+	 */
+	size_t hash(const TextTree::Child &child)
+	{
+		return TextTree::structural_hash(child, &hashes);
+	}
+
+	/**
+	 * Returns a printable location for `node`, searching up the tree if the
+	 * node does not have one.
+	 */
+	static std::string location(TextTreePointer node)
+	{
+		auto &sourceManager = SourceManager::shared_instance();
+		for (; node != nullptr; node = node->parent())
+		{
+			auto start = node->sourceRange.first;
+			if (start.is_valid())
+			{
+				auto expanded = sourceManager.expand(start);
+				return fmt::format("{}:{}",
+				                   sourceManager.file_for_id(expanded.fileID),
+				                   expanded.line);
+			}
+		}
+		return "<unknown>";
+	}
+
+	/**
+	 * Print the text runs at `indexes` in `parent` that have changed, and the
+	 * number of children that were removed from it.
+	 */
+	void print(const TextTreePointer     &parent,
+	           const std::vector<size_t> &indexes,
+	           size_t                     removed)
+	{
+		std::cerr << "Changed in \\" << parent->kind() << " at "
+		          << location(parent);
+		if (removed > 0)
+		{
+			std::cerr << " (" << removed << " removed)";
+		}
+		std::cerr << ":\n";
+		auto &children = parent->children();
+		for (size_t i : indexes)
+		{
+			out.output(children[i]);
+			std::cerr << '\n';
+		}
+		std::cerr << std::flush;
+	}
+
+	/**
+	 * Print `node`, a subtree that has no counterpart in the earlier tree.
+	 * If the output is restricted to some kinds and this is not inside one,
+	 * print only the matching nodes within it.
+	 */
+	void print_new(const TextTreePointer &node, bool inScope)
+	{
+		if (inScope || kinds.contains(node->kind()))
+		{
+			std::cerr << "Changed \\" << node->kind() << " at "
+			          << location(node) << ":\n";
+			out.process(node);
+			std::cerr << std::endl;
+			return;
+		}
+		for (auto &child : node->children())
+		{
+			if (std::holds_alternative<TextTreePointer>(child))
+			{
+				print_new(std::get<TextTreePointer>(child), false);
+			}
+		}
+	}
+
+	void compare(const TextTreePointer &before,
+	             const TextTreePointer &after,
+	             bool                   inScope)
+	{
+		if (before->structural_hash(&hashes) == after->structural_hash(&hashes))
+		{
+			return;
+		}
+		inScope = inScope || kinds.contains(after->kind());
+		if ((before->kind() != after->kind()) ||
+		    (before->attributes() != after->attributes()))
+		{
+			print_new(after, inScope);
+			return;
+		}
+		// Skip the unchanged children at each end and then look at what
+		// is left in the middle.
+		auto  &oldChildren = before->children();
+		auto  &newChildren = after->children();
+		size_t prefix      = 0;
+		size_t limit = std::min(oldChildren.size(), newChildren.size());
+		while ((prefix < limit) &&
+		       (hash(oldChildren[prefix]) == hash(newChildren[prefix])))
+		{
+			prefix++;
+		}
+		size_t suffix = 0;
+		while ((suffix < limit - prefix) &&
+		       (hash(oldChildren[oldChildren.size() - suffix - 1]) ==
+		        hash(newChildren[newChildren.size() - suffix - 1])))
+		{
+			suffix++;
+		}
+		size_t oldEnd = oldChildren.size() - suffix;
+		size_t newEnd = newChildren.size() - suffix;
+		// Children in the middle that also appear in the old version are
+		// unchanged, they have just moved.  Find the ones that do not.
+		std::unordered_map<size_t, size_t> oldCounts;
+		std::unordered_map<size_t, size_t> newCounts;
+		for (size_t i = prefix; i < oldEnd; i++)
+		{
+			oldCounts[hash(oldChildren[i])]++;
+		}
+		for (size_t i = prefix; i < newEnd; i++)
+		{
+			newCounts[hash(newChildren[i])]++;
+		}
+		auto unmatched =
+		  [&](auto &children, size_t start, size_t end, auto &counts) {
+			  std::vector<size_t> result;
+			  for (size_t i = start; i < end; i++)
+			  {
+				  auto found = counts.find(hash(children[i]));
+				  if ((found != counts.end()) && (found->second > 0))
+				  {
+					  found->second--;
+					  continue;
+				  }
+				  result.push_back(i);
+			  }
+			  return result;
+		  };
+		auto added   = unmatched(newChildren, prefix, newEnd, oldCounts);
+		auto removed = unmatched(oldChildren, prefix, oldEnd, newCounts);
+		// Pair each changed node with the next removed node of the same kind,
+		// in order, and look inside them for the changes.  Anything else is
+		// new.  Removed children that are not paired are reported as a count.
+		std::vector<size_t> changedText;
+		size_t              removedCount = removed.size();
+		auto                nextRemoved  = removed.begin();
+		for (size_t i : added)
+		{
+			if (!std::holds_alternative<TextTreePointer>(newChildren[i]))
+			{
+				// Treat this as replacing the next removed text run, if
+				// there is one.
+				changedText.push_back(i);
+				auto match =
+				  std::find_if(nextRemoved, removed.end(), [&](size_t j) {
+					  return std::holds_alternative<std::string>(oldChildren[j]);
+				  });
+				if (match != removed.end())
+				{
+					nextRemoved = match + 1;
+					removedCount--;
+				}
+				continue;
+			}
+			auto &node  = std::get<TextTreePointer>(newChildren[i]);
+			auto  match =
+			  std::find_if(nextRemoved, removed.end(), [&](size_t j) {
+				  return std::holds_alternative<TextTreePointer>(
+				           oldChildren[j]) &&
+				         (std::get<TextTreePointer>(oldChildren[j])->kind() ==
+				          node->kind());
+			  });
+			if (match == removed.end())
+			{
+				print_new(node, inScope);
+				continue;
+			}
+			compare(
+			  std::get<TextTreePointer>(oldChildren[*match]), node, inScope);
+			nextRemoved = match + 1;
+			removedCount--;
+		}
+		if (inScope && (!changedText.empty() || (removedCount > 0)))
+		{
+			print(after, changedText, removedCount);
+		}
+	}
+
+	public:
+	TreeChangePrinter(const std::unordered_set<std::string> &kinds)
+	  : kinds(kinds)
+	{
+		out.output_stderr();
+	}
+
+	/**
+	 * Print the differences between `before` and `after`.  Either may be
+	 * null.
+	 */
+	void print_changes(const TextTreePointer &before,
+	                   const TextTreePointer &after)
+	{
+		if (!after)
+		{
+			if (before)
+			{
+				std::cerr << "Tree removed" << std::endl;
+			}
+			return;
+		}
+		if (!before)
+		{
+			print_new(after, kinds.empty());
+			return;
+		}
+		compare(before, after, kinds.empty());
+	}
+};
+
+/**
+ * Print every node in `tree` whose kind is in `kinds`, without descending
+ * into matches.  Used by `--print-kind` without `--print-changes`.
+ */
+void dump_kinds(const TextTreePointer                 &tree,
+                const std::unordered_set<std::string> &kinds)
+{
+	if (kinds.contains(tree->kind()))
+	{
+		tree->dump();
+		std::cerr << std::endl;
+		return;
+	}
+	for (auto &child : tree->children())
+	{
+		if (std::holds_alternative<TextTreePointer>(child))
+		{
+			dump_kinds(std::get<TextTreePointer>(child), kinds);
+		}
+	}
+}
+
 template<bool XMLTags>
 class XHTMLOutputPass : public OutputPass
 {
@@ -721,6 +1048,19 @@ class XHTMLOutputPass : public OutputPass
 	                                                          "track",
 	                                                          "wbr"};
 
+	/**
+	 * Write a text run, escaping characters that are special in XML.
+	 */
+	void write_text(std::string_view text)
+	{
+		// FIXME: Escape more XML entities
+		std::string escaped = replace_all(std::string(text), "&", "&amp;");
+		escaped             = replace_all(escaped, "\"", "&quot;");
+		escaped             = replace_all(escaped, "<", "&lt;");
+		escaped             = replace_all(escaped, ">", "&gt;");
+		out() << escaped;
+	}
+
 	void visitor(const TextTree::Child &node)
 	{
 		std::visit(
@@ -729,57 +1069,76 @@ class XHTMLOutputPass : public OutputPass
 			                  TextTreePointer,
 			                  std::remove_cvref_t<decltype(child)>>)
 			  {
-				  if (!child->kind.empty())
+				  // Highlighted code is written directly, as it would be
+				  // written after expansion.
+				  auto spans = child->code_spans();
+				  if (!child->kind().empty())
 				  {
-					  out() << "<" << child->kind;
+					  out() << "<" << child->kind();
 				  }
 				  if (!child->attributes().empty())
 				  {
 					  for (auto &attr : child->attributes())
 					  {
 						  out() << ' ';
+						  auto value = TextTree::to_string(attr.second);
 						  if (attr.first.empty())
 						  {
-							  out() << attr.second;
+							  out() << value;
 						  }
 						  else
 						  {
 							  std::string escaped =
-							    replace_all(attr.second, "\"", "&quot;");
+							    replace_all(value, "\"", "&quot;");
 							  out() << attr.first << "=\"" << escaped << "\"";
 						  }
 					  }
 				  }
-				  if (XMLTags && child->children.empty())
+				  if (XMLTags && (spans ? spans->text().empty()
+				                        : child->children().empty()))
 				  {
-					  if (!child->kind.empty())
+					  if (!child->kind().empty())
 					  {
 						  out() << " />";
 					  }
 				  }
 				  else
 				  {
-					  if (!child->kind.empty())
+					  if (!child->kind().empty())
 					  {
 						  out() << ">";
 					  }
-					  child->const_visit(
-					    [this](auto node) { return visitor(node); });
-					  if (!child->kind.empty() &&
-					      (XMLTags || !VoidTags.contains(child->kind)))
+					  if (spans)
+					  {
+						  spans->for_each([this](std::string_view   text,
+						                         const std::string *kind) {
+							  if (kind == nullptr)
+							  {
+								  write_text(text);
+								  return;
+							  }
+							  out() << "<code-run token-kind=\""
+							        << replace_all(*kind, "\"", "&quot;")
+							        << "\">";
+							  write_text(text);
+							  out() << "</code-run>";
+						  });
+					  }
+					  else
+					  {
+						  child->const_visit(
+						    [this](auto node) { return visitor(node); });
+					  }
+					  if (!child->kind().empty() &&
+					      (XMLTags || !VoidTags.contains(child->kind())))
 					  {
-						  out() << "</" << child->kind << '>';
+						  out() << "</" << child->kind() << '>';
 					  }
 				  }
 			  }
 			  else
 			  {
-				  // FIXME: Escape more XML entities
-				  std::string escaped = replace_all(child, "&", "&amp;");
-				  escaped             = replace_all(escaped, "\"", "&quot;");
-				  escaped             = replace_all(escaped, "<", "&lt;");
-				  escaped             = replace_all(escaped, ">", "&gt;");
-				  out() << escaped;
+				  write_text(child);
 			  }
 		  },
 		  node);
@@ -787,6 +1146,8 @@ class XHTMLOutputPass : public OutputPass
 
 	TextTreePointer process(TextTreePointer tree) override
 	{
+		PassTimer::Scope    timer(PassTimer::Category::Output);
+		TraceRecorder::Span span("XHTML output", "output");
 		if (config.contains("DTD"))
 		{
 			std::visit([&](auto &entry) { out() << entry; }, config["DTD"]);
@@ -846,9 +1207,420 @@ class LuaPass : public TextPass
 
 	private:
 	inline static std::vector<std::function<void(sol::state &)>> plugins;
-	sol::state                                                   lua;
+
+	/// True if Lua passes share one Lua state.
+	inline static bool shareStates = false;
+
+	/// The Lua state shared by passes when `shareStates` is set.
+	inline static std::shared_ptr<sol::state> sharedState;
+
+	/// The options for every Lua pass.
+	inline static LuaPassOptions defaultOptions;
+
+	/// The options for individual Lua passes, which override the defaults.
+	inline static std::unordered_map<std::string, LuaPassOptions> passOptions;
+
+	/**
+	 * A Lua state and its allocator, which must outlive it.  The allocator
+	 * is told when the state is being closed, so that it can release the
+	 * state's memory in one go.
+	 */
+	struct OwnedState
+	{
+		LuaAllocator allocator;
+		sol::state   state{sol::default_at_panic,
+		                   &LuaAllocator::allocate,
+		                   &allocator};
+
+		~OwnedState()
+		{
+			allocator.close();
+		}
+	};
+
+	/**
+	 * The Lua state that this pass runs in.  This must outlive any Lua
+	 * objects that the pass holds, so it is declared first.
+	 */
+	std::shared_ptr<sol::state> lua;
+
+	/**
+	 * The environment that the pass's script runs in.  Globals that the
+	 * script defines go here, so passes that share a state do not see each
+	 * other's `process` functions.  Anything not defined by the script is
+	 * looked up in the state's globals.
+	 */
+	sol::environment environment;
+
 	std::function<TextTreePointer(TextTreePointer)> processFunction;
 
+	/// The name of the pass, for diagnostics.
+	std::string name;
+
+	/// The options for this pass's Lua state.
+	LuaPassOptions options;
+
+	/// The path of the pass's script, which workers load again.
+	std::string path;
+
+	/**
+	 * A copy of the pass, loaded into a Lua state of its own, that runs the
+	 * functions named in `parallel_map` on a pool thread.
+	 */
+	struct Worker
+	{
+		std::shared_ptr<sol::state> lua;
+		sol::environment            environment;
+	};
+
+	/// Lock protecting `workers` and `idleWorkers`.
+	std::mutex workerLock;
+
+	/// The workers, which are created when they are first needed.
+	std::vector<std::unique_ptr<Worker>> workers;
+
+	/// The workers that are not running a function.
+	std::vector<Worker *> idleWorkers;
+
+	/// The pass whose Lua code is running on this thread, if any.
+	inline static thread_local LuaPass *runningPass = nullptr;
+
+	/**
+	 * RAII helper that records which pass's Lua code is running on this
+	 * thread while it is in scope.
+	 */
+	class RunningScope
+	{
+		LuaPass *outer;
+
+		public:
+		RunningScope(LuaPass *pass) : outer(std::exchange(runningPass, pass))
+		{
+		}
+
+		~RunningScope()
+		{
+			runningPass = outer;
+		}
+	};
+
+	/**
+	 * The value of a node's `children` property in Lua: a view that reads
+	 * the node's children in place, rather than a table holding a copy of
+	 * them.  Indexing it, taking its length, and iterating over it with
+	 * `ipairs` or `pairs` do not copy the children.  It reflects later
+	 * changes to the node.
+	 */
+	struct ChildrenView
+	{
+		TextTreePointer node;
+	};
+
+	/**
+	 * Returns a child as a Lua value.
+	 */
+	static sol::object child_to_lua(lua_State *L, const TextTree::Child &child)
+	{
+		return std::visit(
+		  [&](auto &value) { return sol::make_object(L, value); }, child);
+	}
+
+	/**
+	 * Returns the child at a one-based Lua index, or nil if there is none.
+	 */
+	static sol::object children_index(const ChildrenView &view,
+	                                  sol::stack_object   key,
+	                                  sol::this_state     state)
+	{
+		auto &children = view.node->children();
+		if (key.get_type() == sol::type::number)
+		{
+			auto index = key.as<lua_Integer>();
+			if ((index >= 1) && (size_t(index) <= children.size()))
+			{
+				return child_to_lua(state, children[index - 1]);
+			}
+		}
+		return sol::make_object(state, sol::lua_nil);
+	}
+
+	/**
+	 * The iterator function returned by `pairs` on a `ChildrenView`.
+	 */
+	static std::tuple<sol::object, sol::object>
+	children_next(const ChildrenView &view,
+	              sol::stack_object   key,
+	              sol::this_state     state)
+	{
+		auto  &children = view.node->children();
+		size_t index    = (key.get_type() == sol::type::number)
+		                    ? size_t(key.as<lua_Integer>())
+		                    : 0;
+		if (index >= children.size())
+		{
+			return {sol::make_object(state, sol::lua_nil),
+			        sol::make_object(state, sol::lua_nil)};
+		}
+		return {sol::make_object(state, index + 1),
+		        child_to_lua(state, children[index])};
+	}
+
+	/**
+	 * Wrap a Lua function as a visitor for the `edit_` functions.  The
+	 * function returns nil or true to keep the node, false to remove it, or
+	 * a node, a string, or a table of them to replace it.  Keeping a node
+	 * allocates nothing on the C++ side.
+	 */
+	static TextTree::EditVisitor edit_visitor(sol::function fn)
+	{
+		return [fn = std::move(fn)](const TextTreePointer &node) {
+			auto result = fn(node);
+			if (!result.valid())
+			{
+				sol::error error = result;
+				throw error;
+			}
+			if (result.return_count() == 0)
+			{
+				return TextTree::Edit{};
+			}
+			switch (result.get_type())
+			{
+				case sol::type::lua_nil:
+				case sol::type::none:
+					return TextTree::Edit{};
+				case sol::type::boolean:
+					if (result.get<bool>())
+					{
+						return TextTree::Edit{};
+					}
+					return TextTree::Edit{std::in_place};
+				case sol::type::string:
+					return TextTree::Edit{
+					  std::in_place,
+					  {TextTree::Child{result.get<std::string>()}}};
+				case sol::type::table:
+					return TextTree::Edit{
+					  result.get<std::vector<TextTree::Child>>()};
+				default:
+					return TextTree::Edit{
+					  std::in_place,
+					  {TextTree::Child{result.get<TextTreePointer>()}}};
+			}
+		};
+	}
+
+	/**
+	 * Append the children that a Lua value stands for: nothing for nil, a
+	 * node, a string, an array of strings and nodes, or the children of a
+	 * node.  Other values are appended as their string representation.
+	 */
+	static void append_children_from_lua(std::vector<TextTree::Child> &children,
+	                                     const sol::object            &value)
+	{
+		switch (value.get_type())
+		{
+			case sol::type::lua_nil:
+			case sol::type::none:
+				return;
+			case sol::type::string:
+				children.emplace_back(value.as<std::string>());
+				return;
+			case sol::type::table:
+				std::ranges::move(value.as<std::vector<TextTree::Child>>(),
+				                  std::back_inserter(children));
+				return;
+			default:
+				if (value.is<ChildrenView>())
+				{
+					auto &view = value.as<ChildrenView &>();
+					std::ranges::copy(view.node->children(),
+					                  std::back_inserter(children));
+					return;
+				}
+				// The result of `extract_children`.
+				if (value.is<std::vector<TextTree::Child>>())
+				{
+					std::ranges::copy(
+					  value.as<const std::vector<TextTree::Child> &>(),
+					  std::back_inserter(children));
+					return;
+				}
+				if (value.is<TextTree>())
+				{
+					children.emplace_back(value.as<TextTreePointer>());
+					return;
+				}
+				children.emplace_back(sol::utility::to_string(value));
+		}
+	}
+
+	/**
+	 * Returns the name of the hole that a value in a template descriptor
+	 * stands for, or nothing if it is not a hole.  Holes are written as
+	 * `{ hole = "name" }`.
+	 */
+	static std::optional<std::string> template_hole(const sol::object &value)
+	{
+		if (value.get_type() != sol::type::table)
+		{
+			return std::nullopt;
+		}
+		sol::object name = value.as<sol::table>()["hole"];
+		if (name.get_type() != sol::type::string)
+		{
+			return std::nullopt;
+		}
+		return name.as<std::string>();
+	}
+
+	/**
+	 * Add the attributes and children of a descriptor, in the form that
+	 * `create_from_lua` takes, to a node of a template.
+	 */
+	static void compile_template(TreeTemplate         &compiled,
+	                             TreeTemplate::NodeRef node,
+	                             sol::table            descriptor)
+	{
+		auto attributes = descriptor["attributes"];
+		if (attributes.is<sol::table>())
+		{
+			// Lua iterates tables in an order that changes between runs, so
+			// add the attributes in name order to make the output of each
+			// instance the same in every run.
+			std::vector<std::pair<std::string, sol::object>> sorted;
+			for (auto &[key, value] : descriptor.get<sol::table>("attributes"))
+			{
+				sorted.emplace_back(key.as<std::string>(), value);
+			}
+			std::ranges::sort(sorted, {}, [](auto &entry) {
+				return std::string_view(entry.first);
+			});
+			for (auto &[name, value] : sorted)
+			{
+				if (auto hole = template_hole(value))
+				{
+					compiled.add_attribute(node, name, compiled.hole(*hole));
+					continue;
+				}
+				compiled.add_attribute(node, name, attribute_from_lua(value));
+			}
+		}
+		auto children = descriptor["children"];
+		if (children.is<sol::table>())
+		{
+			for (auto &[key, value] : descriptor.get<sol::table>("children"))
+			{
+				if (value.get_type() == sol::type::string)
+				{
+					compiled.add_child(node, value.as<std::string>());
+				}
+				else if (auto hole = template_hole(value))
+				{
+					compiled.add_child(node, compiled.hole(*hole));
+				}
+				else if (value.get_type() == sol::type::table)
+				{
+					sol::table child = value;
+					auto       kind  = child["kind"];
+					if (kind.get_type() != sol::type::string)
+					{
+						throw sol::error(
+						  "template children must be strings, holes, or "
+						  "tables with a kind");
+					}
+					auto childNode = compiled.add_node(kind.get<std::string>());
+					compiled.add_child(node, childNode);
+					compile_template(compiled, childNode, child);
+				}
+				else
+				{
+					throw sol::error("template children must be strings, "
+					                 "holes, or tables with a kind");
+				}
+			}
+		}
+	}
+
+	/**
+	 * Create a template from a descriptor, in the form that
+	 * `create_from_lua` takes, that may contain holes.
+	 */
+	static TreeTemplate template_from_lua(sol::table descriptor)
+	{
+		auto kind = descriptor["kind"];
+		if (kind.get_type() != sol::type::string)
+		{
+			throw sol::error("template must have a kind");
+		}
+		TreeTemplate compiled{kind.get<std::string>()};
+		compile_template(compiled, compiled.root(), descriptor);
+		return compiled;
+	}
+
+	/**
+	 * Instantiate a template, filling its holes from the fields of a table
+	 * with the same names.  Missing holes are left empty.
+	 */
+	static TextTreePointer
+	instantiate_template(const TreeTemplate       &compiled,
+	                     std::optional<sol::table> arguments)
+	{
+		std::vector<TreeTemplate::Value> values(compiled.hole_count());
+		if (arguments)
+		{
+			for (size_t i = 0; i < values.size(); i++)
+			{
+				sol::object value = (*arguments)[compiled.hole_name(i)];
+				if (!value.valid() || (value.get_type() == sol::type::lua_nil))
+				{
+					continue;
+				}
+				if (compiled.hole_used_as_attribute(i))
+				{
+					values[i].attribute = attribute_from_lua(value);
+				}
+				if (compiled.hole_used_as_children(i))
+				{
+					append_children_from_lua(values[i].children, value);
+				}
+			}
+		}
+		return compiled.instantiate(values);
+	}
+
+	/**
+	 * Convert a Lua value to an attribute value, keeping numbers and
+	 * booleans typed.  Lua integers and floats stay distinct.  Anything else
+	 * is stored as its string representation.
+	 */
+	static TextTree::AttributeValue attribute_from_lua(const sol::object &value)
+	{
+		switch (value.get_type())
+		{
+			case sol::type::boolean:
+				return value.as<bool>();
+			case sol::type::number:
+			{
+#if LUA_VERSION_NUM >= 503
+				auto *L = value.lua_state();
+				value.push();
+				bool isInteger = lua_isinteger(L, -1);
+				lua_pop(L, 1);
+				if (isInteger)
+				{
+					return static_cast<int64_t>(value.as<lua_Integer>());
+				}
+#endif
+				return value.as<double>();
+			}
+			case sol::type::string:
+				return value.as<std::string>();
+			default:
+				return sol::utility::to_string(value);
+		}
+	}
+
 	static TextTreePointer create_from_lua(sol::table object)
 	{
 		auto tree = TextTree::create();
@@ -857,50 +1629,132 @@ class LuaPass : public TextPass
 		{
 			return nullptr;
 		}
-		tree->kind      = kind;
+		tree->kind(kind.get<std::string>());
 		auto attributes = object["attributes"];
 		if (attributes.is<sol::table>())
 		{
 			for (auto &[key, value] : object.get<sol::table>("attributes"))
 			{
 				tree->attribute_set(key.as<std::string>(),
-				                    sol::utility::to_string(value));
+				                    attribute_from_lua(value));
 			}
 		}
 		auto children = object["children"];
 		if (children.is<sol::table>())
 		{
-			for (auto &[key, value] : object.get<sol::table>("children"))
+			for (auto &[key, value] : object.get<sol::table>("children"))
+			{
+				if (value.is<TextTree>())
+				{
+					tree->append_child(value.as<TextTreePointer>());
+				}
+				else if (value.get_type() == sol::type::string)
+				{
+					tree->append_text(value.as<std::string>());
+				}
+				else
+				{
+					auto child = create_from_lua(value);
+					if (child)
+					{
+						tree->append_child(child);
+					}
+				}
+			}
+		}
+		return tree;
+	}
+
+	TextTreePointer process(TextTreePointer tree) override
+	{
+		if (shareStates)
+		{
+			configure_state(lua->lua_state());
+		}
+		// The hook switches between Lua and native time as the script runs.
+		PassTimer::Scope   timer(PassTimer::Category::Native);
+		LuaProfiler::Scope profile(lua->lua_state(), profiling_hook);
+		RunningScope       running(this);
+		return processFunction(tree);
+	}
+
+	/**
+	 * Debug hook installed for `--time-passes`, `--profile-allocations` and
+	 * `--profile-lua`.  Lua allows only one hook for each state, so this
+	 * dispatches to each of them.
+	 *
+	 * The timer charges time to Lua while a Lua function runs and to native
+	 * code while a C function runs.  A tail call replaces its caller's frame
+	 * and returns only once, so it does not push a new category.  The
+	 * allocation profiler charges allocations to the running Lua function,
+	 * so a tail call replaces the caller.
+	 */
+	static void profiling_hook(lua_State *L, lua_Debug *ar)
+	{
+		if (ar->event == LUA_HOOKCOUNT)
+		{
+			LuaProfiler::shared_instance().sample(L);
+			return;
+		}
+		auto &timer     = PassTimer::shared_instance();
+		bool  timing    = timer.is_active();
+		bool  profiling = AllocationProfiler::is_enabled();
+		if (!timing && !profiling)
+		{
+			return;
+		}
+		if (ar->event == LUA_HOOKRET)
+		{
+			if (timing)
+			{
+				timer.pop();
+			}
+			if (profiling)
+			{
+				AllocationProfiler::shared_instance().leave_function();
+			}
+			return;
+		}
+		lua_getinfo(L, "Sn", ar);
+		bool native = (ar->what[0] == 'C');
+		if (timing && (ar->event == LUA_HOOKCALL))
+		{
+			timer.push(native ? PassTimer::Category::Native
+			                  : PassTimer::Category::Lua);
+		}
+		if (profiling)
+		{
+			auto &profiler = AllocationProfiler::shared_instance();
+			if (ar->event != LUA_HOOKCALL)
 			{
-				if (value.is<TextTree>())
-				{
-					tree->append_child(value.as<TextTreePointer>());
-				}
-				else if (value.get_type() == sol::type::string)
-				{
-					tree->append_text(value.as<std::string>());
-				}
-				else
-				{
-					auto child = create_from_lua(value);
-					if (child)
-					{
-						tree->append_child(child);
-					}
-				}
+				profiler.leave_function();
+			}
+			if (native)
+			{
+				profiler.enter_native_function();
+			}
+			else
+			{
+				profiler.enter_lua_function(
+				  ar->source, ar->linedefined, [&]() {
+					  return fmt::format("{} ({}:{})",
+					                     ar->name ? ar->name : "?",
+					                     ar->short_src,
+					                     ar->linedefined);
+				  });
 			}
 		}
-		return tree;
-	}
-
-	TextTreePointer process(TextTreePointer tree) override
-	{
-		return processFunction(tree);
 	}
 
-	public:
-	LuaPass(std::string filename)
+	/**
+	 * Create a Lua state with the standard libraries, the bindings for text
+	 * trees and passes, and the plugins' helpers.
+	 */
+	static std::shared_ptr<sol::state> new_state()
 	{
+		auto owner = std::make_shared<OwnedState>();
+		std::shared_ptr<sol::state> state(owner, &owner->state);
+		sol::state                 &lua = *state;
 		lua.open_libraries(sol::lib::base,
 		                   sol::lib::package,
 		                   sol::lib::io,
@@ -931,14 +1785,20 @@ class LuaPass : public TextPass
 			  auto tree = TextTree::create();
 			  if (kind)
 			  {
-				  tree->kind = *kind;
+				  tree->kind(*kind);
 			  }
 			  return tree;
 		  }),
 		  "create",
 		  &create_from_lua,
+		  "template",
+		  &template_from_lua,
 		  "kind",
-		  &TextTree::kind,
+		  sol::property(
+		    [](TextTree &textTree) { return textTree.kind(); },
+		    [](TextTree &textTree, std::string kind) {
+			    textTree.kind(std::move(kind));
+		    }),
 		  "visit",
 		  &TextTree::visit,
 		  "match",
@@ -952,17 +1812,62 @@ class LuaPass : public TextPass
 		     TextTree::Visitor             &&visitor) {
 			  return textTree.match_any(kinds, visitor);
 		  },
+		  "parallel_map",
+		  [](TextTree          &textTree,
+		     const std::string &kind,
+		     const std::string &function) {
+			  if (runningPass == nullptr)
+			  {
+				  throw sol::error("parallel_map can be called only by a "
+				                   "Lua pass, not by its workers");
+			  }
+			  runningPass->parallel_map(textTree, kind, function);
+		  },
+		  "edit_children",
+		  [](TextTree &textTree, sol::function visitor) {
+			  textTree.edit_children(edit_visitor(std::move(visitor)));
+		  },
+		  "edit_matches",
+		  [](TextTree          &textTree,
+		     const std::string &kind,
+		     sol::function      visitor) {
+			  textTree.edit_matches(kind, edit_visitor(std::move(visitor)));
+		  },
+		  "edit_matches_any",
+		  // sol converts a table to a set only when it is passed by value.
+		  [](TextTree                       &textTree,
+		     std::unordered_set<std::string> kinds,
+		     sol::function                   visitor) {
+			  textTree.edit_matches_any(kinds,
+			                            edit_visitor(std::move(visitor)));
+		  },
+		  "select",
+		  [](TextTree &textTree, const std::string &selector, sol::function fn) {
+			  // The callback gets the matching node and the (one-based) index
+			  // of the selector in the comma-separated list that it matched.
+			  TreeSelector::compiled(selector)->select(
+			    textTree.shared_from_this(),
+			    [&](size_t index, const TextTreePointer &node) {
+				    fn(node, index + 1);
+			    });
+		  },
+		  "walker",
+		  [](TextTree &textTree) {
+			  return TreeWalker(textTree.shared_from_this());
+		  },
 		  "is_empty",
 		  &TextTree::is_empty,
 		  "children",
-		  &TextTree::children,
+		  sol::property([](TextTree &textTree) {
+			  return ChildrenView{textTree.shared_from_this()};
+		  }),
 		  "new_child",
 		  sol::factories(
 		    [](TextTree &textTree, std::optional<std::string> kind) {
 			    auto tree = textTree.new_child();
 			    if (kind)
 			    {
-				    tree->kind = *kind;
+				    tree->kind(*kind);
 			    }
 			    return tree;
 		    }),
@@ -1011,6 +1916,24 @@ class LuaPass : public TextPass
 		  &TextTree::shallow_clone,
 		  "find_string",
 		  &TextTree::find_string,
+		  "find_all",
+		  // sol converts a table to a vector only when it is passed by value.
+		  [](TextTree                &textTree,
+		     std::vector<std::string> patterns,
+		     sol::this_state          state) {
+			  // Each match is a table with the (one-based) index of the
+			  // pattern and the (zero-based) byte offset of its start, as
+			  // used by `split_at_byte_index`.
+			  sol::state_view lua(state);
+			  sol::table      result = lua.create_table();
+			  for (auto &match :
+			       textTree.find_all(*TextSearcher::compiled(patterns)))
+			  {
+				  result.add(lua.create_table_with(
+				    "pattern", match.pattern + 1, "offset", match.offset));
+			  }
+			  return result;
+		  },
 		  "take_children",
 		  &TextTree::take_children,
 		  "error",
@@ -1033,6 +1956,16 @@ class LuaPass : public TextPass
 		  &TextTree::clear,
 		  "text",
 		  &TextTree::text,
+		  "text_length",
+		  &TextTree::text_length,
+		  "has_text",
+		  &TextTree::has_text,
+		  "cache_text",
+		  &TextTree::cache_text,
+		  "has_code_spans",
+		  &TextTree::has_code_spans,
+		  "structural_hash",
+		  [](const TextTree &textTree) { return textTree.structural_hash(); },
 		  "parent",
 		  static_cast<TextTreePointer (TextTree::*)() const>(&TextTree::parent),
 		  "has_attribute",
@@ -1042,9 +1975,82 @@ class LuaPass : public TextPass
 		  "attribute_erase",
 		  &TextTree::attribute_erase,
 		  "attribute_set",
-		  &TextTree::attribute_set,
+		  [](TextTree &textTree, const std::string &name, sol::object value) {
+			  textTree.attribute_set(name, attribute_from_lua(value));
+		  },
 		  "attribute",
-		  &TextTree::attribute);
+		  // Reads must not modify the node, so a missing attribute is nil.
+		  [](TextTree &textTree, const std::string &name)
+		    -> std::optional<TextTree::AttributeValue> {
+			  if (auto *value = textTree.find_attribute(name))
+			  {
+				  return *value;
+			  }
+			  return std::nullopt;
+		  });
+		// `next` returns whether there is a node, rather than the node, so
+		// that loops that only look at `kind` and `text` do not create a
+		// userdata for every node.
+		lua.new_usertype<TreeWalker>(
+		  "TreeWalker",
+		  sol::no_constructor,
+		  "next",
+		  [](TreeWalker &walker) { return walker.next() != nullptr; },
+		  "skip_children",
+		  &TreeWalker::skip_children,
+		  "replace",
+		  [](TreeWalker &walker, sol::variadic_args replacements) {
+			  // Each replacement is a string, a node, or an array of them.
+			  std::vector<TextTree::Child> children;
+			  for (auto replacement : replacements)
+			  {
+				  append_children_from_lua(children,
+				                           replacement.as<sol::object>());
+			  }
+			  walker.replace(std::move(children));
+		  },
+		  "remove",
+		  &TreeWalker::remove,
+		  "node",
+		  sol::property(
+		    [](TreeWalker &walker) { return walker.current(); }),
+		  "kind",
+		  sol::property([](TreeWalker &walker) -> std::optional<std::string> {
+			  if (auto &node = walker.current())
+			  {
+				  return node->kind();
+			  }
+			  return std::nullopt;
+		  }),
+		  "text",
+		  sol::property([](TreeWalker &walker) -> std::optional<std::string> {
+			  if (auto &node = walker.current())
+			  {
+				  return node->text();
+			  }
+			  return std::nullopt;
+		  }),
+		  "depth",
+		  sol::property(&TreeWalker::depth));
+		lua.new_usertype<ChildrenView>(
+		  "TextTreeChildren",
+		  sol::no_constructor,
+		  sol::meta_function::index,
+		  &children_index,
+		  sol::meta_function::length,
+		  [](const ChildrenView &view) { return view.node->children().size(); },
+		  sol::meta_function::pairs,
+		  [](const ChildrenView &view, sol::this_state state) {
+			  return std::make_tuple(&children_next,
+			                         view,
+			                         sol::make_object(state, sol::lua_nil));
+		  });
+		lua.new_usertype<TreeTemplate>("TreeTemplate",
+		                               sol::no_constructor,
+		                               "instantiate",
+		                               &instantiate_template,
+		                               sol::meta_function::call,
+		                               &instantiate_template);
 		lua["create_pass"] = &TextPassRegistry::create;
 		lua["config"]      = &config;
 		lua["read_file"]   = [](std::string path) { return read_file(path); };
@@ -1062,8 +2068,275 @@ class LuaPass : public TextPass
 		           "end\n"
 		           "io.stderr:write('\\n')\n"
 		           "end\n");
-		lua.script_file(filename);
-		processFunction = lua["process"];
+		if (PassTimer::shared_instance().is_enabled() ||
+		    AllocationProfiler::is_enabled())
+		{
+			lua_sethook(
+			  lua.lua_state(), profiling_hook, LUA_MASKCALL | LUA_MASKRET, 0);
+		}
+		return state;
+	}
+
+	/**
+	 * Returns the state for a new pass: the shared state, if passes share
+	 * one, or a new state.
+	 */
+	static std::shared_ptr<sol::state> state_for_pass()
+	{
+		if (!shareStates)
+		{
+			return new_state();
+		}
+		if (!sharedState)
+		{
+			sharedState = new_state();
+		}
+		return sharedState;
+	}
+
+	/**
+	 * Returns the allocator of a state created by `new_state`.
+	 */
+	static LuaAllocator &allocator(lua_State *L)
+	{
+		void *allocator = nullptr;
+		lua_getallocf(L, &allocator);
+		return *static_cast<LuaAllocator *>(allocator);
+	}
+
+	/**
+	 * Apply this pass's options to a state: its own or a worker's.  Passes
+	 * that share a state apply them each time that they run.
+	 */
+	void configure_state(lua_State *L)
+	{
+		auto &stateAllocator = allocator(L);
+		stateAllocator.owner(name);
+		stateAllocator.limit(options.memoryLimit.value_or(0));
+		options.apply_gc(L);
+	}
+
+	/**
+	 * Load the script at `path` into `L`, through the cache of compiled
+	 * chunks, and run it in `environment`.
+	 */
+	static void run_script(lua_State                   *L,
+	                       sol::environment            &environment,
+	                       const std::filesystem::path &path)
+	{
+		if (LuaChunkCache::load(L, path) != LUA_OK)
+		{
+			std::string message = lua_tostring(L, -1);
+			lua_pop(L, 1);
+			throw sol::error(message);
+		}
+		auto chunk = sol::stack::pop<sol::protected_function>(L);
+		sol::set_environment(environment, chunk);
+		if (auto result = chunk(); !result.valid())
+		{
+			sol::error error = result;
+			throw error;
+		}
+	}
+
+	/**
+	 * Bind `config` in a worker's state as a read-only view of the shared
+	 * configuration.  Workers run concurrently and in no fixed order, so
+	 * writes from them would race and would not be deterministic.
+	 */
+	static void bind_read_only_config(sol::state &lua)
+	{
+		auto metatable       = lua.create_table();
+		metatable["__index"] = [](sol::this_state   L,
+		                          const sol::table &,
+		                          const sol::object &key) -> sol::object {
+			if (key.get_type() == sol::type::string)
+			{
+				if (auto it = config.find(key.as<std::string>());
+				    it != config.end())
+				{
+					return std::visit(
+					  [&](auto &value) { return sol::make_object(L, value); },
+					  it->second);
+				}
+			}
+			return sol::lua_nil;
+		};
+		metatable["__newindex"] = [](const sol::table &,
+		                             const sol::object &,
+		                             const sol::object &) {
+			throw sol::error(
+			  "config cannot be modified by parallel_map workers");
+		};
+		auto view                = lua.create_table();
+		view[sol::metatable_key] = metatable;
+		lua["config"]            = view;
+	}
+
+	/**
+	 * Create a worker, loading the script into a new state.
+	 */
+	std::unique_ptr<Worker> create_worker()
+	{
+		auto worker  = std::make_unique<Worker>();
+		worker->lua  = new_state();
+		lua_State *L = worker->lua->lua_state();
+		// The profilers follow only the thread that runs the passes.
+		lua_sethook(L, nullptr, 0, 0);
+		configure_state(L);
+		bind_read_only_config(*worker->lua);
+		worker->environment =
+		  sol::environment(*worker->lua, sol::create, worker->lua->globals());
+		RunningScope running(nullptr);
+		run_script(L, worker->environment, path);
+		return worker;
+	}
+
+	/**
+	 * Take an idle worker, creating one if there are none.  A worker runs
+	 * one function at a time.
+	 */
+	Worker &acquire_worker()
+	{
+		{
+			std::lock_guard lock(workerLock);
+			if (!idleWorkers.empty())
+			{
+				Worker *worker = idleWorkers.back();
+				idleWorkers.pop_back();
+				return *worker;
+			}
+		}
+		// Running the script may take a while, so do it without the lock,
+		// and let other threads take workers that become idle meanwhile.
+		auto            worker = create_worker();
+		std::lock_guard lock(workerLock);
+		return *workers.emplace_back(std::move(worker));
+	}
+
+	/**
+	 * Return a worker taken by `acquire_worker`.
+	 */
+	void release_worker(Worker &worker)
+	{
+		std::lock_guard lock(workerLock);
+		idleWorkers.push_back(&worker);
+	}
+
+	/**
+	 * Run the function called `function` in a worker on `node`, which has
+	 * been detached from the tree.  Returns the children to replace the
+	 * node with, following the same rules as `edit_matches`.
+	 */
+	std::vector<TextTree::Child> run_in_worker(const std::string     &function,
+	                                           const TextTreePointer &node)
+	{
+		Worker        &worker = acquire_worker();
+		TextTree::Edit edit;
+		try
+		{
+			// Workers cannot start more workers.
+			RunningScope running(nullptr);
+			sol::object  fn = worker.environment[function];
+			if (fn.get_type() != sol::type::function)
+			{
+				throw sol::error("parallel_map: pass " + name +
+				                 " has no function named " + function);
+			}
+			edit = edit_visitor(fn.as<sol::function>())(node);
+		}
+		catch (...)
+		{
+			release_worker(worker);
+			throw;
+		}
+		release_worker(worker);
+		if (!edit)
+		{
+			return {node};
+		}
+		return std::move(*edit);
+	}
+
+	/**
+	 * Run the function called `function` on each node of kind `kind` in
+	 * `tree`, in parallel, and replace each node with the result.  Each
+	 * node is detached from the tree and given to a worker: a copy of this
+	 * pass, loaded from the same script into a Lua state of its own.
+	 * Workers share nothing with the pass except `config`, which they may
+	 * read but not modify.  The results are grafted back in document order,
+	 * so the tree is the same as if the nodes had been edited one at a time.
+	 */
+	void parallel_map(TextTree          &tree,
+	                  const std::string &kind,
+	                  const std::string &function)
+	{
+		// Each node is its own task: the work per node is expected to be
+		// large, so batching small nodes together would only serialise it.
+		tree.parallel_match(
+		  kind,
+		  [&](TextTree::Child &child) {
+			  return run_in_worker(function, std::get<TextTreePointer>(child));
+		  },
+		  1);
+	}
+
+	public:
+	LuaPass(std::string filename)
+	  : lua(state_for_pass()),
+	    environment(*lua, sol::create, lua->globals()),
+	    name(std::filesystem::path(filename).stem()),
+	    options(options_for(name)),
+	    path(filename)
+	{
+		configure_state(lua->lua_state());
+		LuaProfiler::Scope profile(lua->lua_state(), profiling_hook);
+		RunningScope       running(this);
+		run_script(lua->lua_state(), environment, path);
+		processFunction = environment["process"];
+	}
+
+	/**
+	 * Set whether Lua passes created after this share one Lua state,
+	 * instead of each setting up its own.  Each pass still runs in its own
+	 * environment, but changes that a pass makes to the standard libraries
+	 * or the bindings are seen by later passes.  Changing the mode discards
+	 * the shared state, although passes that use it keep it alive.
+	 */
+	static void share_states(bool share)
+	{
+		shareStates = share;
+		sharedState.reset();
+	}
+
+	/**
+	 * Set options for Lua passes from a `--lua-options` argument: a list of
+	 * options for every pass, or a pass name, a colon, and a list of
+	 * options for that pass.  Throws `std::invalid_argument` if the options
+	 * are not valid.
+	 */
+	static void options_set(std::string_view argument)
+	{
+		auto colon = argument.find(':');
+		if (colon == std::string_view::npos)
+		{
+			defaultOptions.parse(argument);
+			return;
+		}
+		passOptions[std::string(argument.substr(0, colon))].parse(
+		  argument.substr(colon + 1));
+	}
+
+	/**
+	 * Returns the options for the named pass.
+	 */
+	static LuaPassOptions options_for(const std::string &pass)
+	{
+		if (auto it = passOptions.find(pass); it != passOptions.end())
+		{
+			return defaultOptions.merged(it->second);
+		}
+		return defaultOptions;
 	}
 
 	static void add_plugin(PluginHook hook)
@@ -1106,6 +2379,86 @@ class LuaPassFactory : public TextPassFactory
 	}
 };
 
+// The benchmarks include this file for the Lua bindings and provide their
+// own `main`.
+#ifndef IGK_NO_MAIN
+/**
+ * The reports that a run writes when it finishes: the time spent in each
+ * pass, hardware performance counters, allocation sites, the trace, and
+ * sampled Lua stacks.  They are written when this goes out of scope, if they
+ * have not been written already, so a run that stops because of an error
+ * still reports on the passes that it ran.  A Lua pass that exceeds its
+ * memory limit ends the process at once, without them.
+ */
+class RunReports
+{
+	bool written = false;
+
+	public:
+	bool                  timePasses = false;
+	std::filesystem::path timePassesJSONPath;
+	std::filesystem::path tracePath;
+	bool                  profileAllocations   = false;
+	size_t                allocationReportSize = 20;
+	std::filesystem::path luaProfilePath;
+	PerfCounters          counters;
+
+	/**
+	 * Write the reports.  Returns false if a report file could not be
+	 * opened, after writing the others.
+	 */
+	bool write()
+	{
+		written = true;
+		auto &timer = PassTimer::shared_instance();
+		if (timePasses)
+		{
+			timer.print_report(std::cerr);
+		}
+		if (counters.is_open())
+		{
+			counters.print_report(std::cerr);
+		}
+		if (profileAllocations)
+		{
+			AllocationProfiler::shared_instance().print_report(
+			  std::cerr, allocationReportSize);
+		}
+		bool opened    = true;
+		auto writeFile = [&](const std::filesystem::path &path, auto writer) {
+			if (path.empty())
+			{
+				return;
+			}
+			std::ofstream out(path);
+			if (!out)
+			{
+				std::cerr << "Failed to open " << path << std::endl;
+				opened = false;
+				return;
+			}
+			writer(out);
+		};
+		writeFile(timePassesJSONPath,
+		          [&](std::ostream &out) { timer.write_json(out); });
+		writeFile(tracePath, [](std::ostream &out) {
+			TraceRecorder::shared_instance().write_json(out);
+		});
+		writeFile(luaProfilePath, [](std::ostream &out) {
+			LuaProfiler::shared_instance().write_folded(out);
+		});
+		return opened;
+	}
+
+	~RunReports()
+	{
+		if (!written)
+		{
+			write();
+		}
+	}
+};
+
 int main(int argc, char *argv[])
 {
 	std::vector<std::filesystem::path> luaPaths;
@@ -1113,6 +2466,21 @@ int main(int argc, char *argv[])
 	std::filesystem::path              inputPath;
 	std::vector<std::string>           passNames;
 	bool                               printAfterAll = false;
+	bool                               printChanges  = false;
+	std::vector<std::string>           printAfter;
+	std::unordered_set<std::string>    printKinds;
+	size_t                             threads       = 0;
+	std::vector<std::string>           checkpointPasses;
+	std::filesystem::path              checkpointDirectory = ".";
+	std::string                        resumePass;
+	bool                               stats = false;
+	std::filesystem::path              statsJSONPath;
+	bool                               perfCounters = false;
+	size_t                             luaProfileInterval = 1000;
+	bool                               shareLuaState = false;
+	std::filesystem::path              luaCacheDirectory;
+	// Writes the reports on every return from here on.
+	RunReports reports;
 
 	auto registerConfigOption = [&](std::string_view option) {
 		auto eq = option.find('=');
@@ -1136,12 +2504,45 @@ int main(int argc, char *argv[])
 	    luaPaths,
 	    "Directory containing Lua passes (may be specified more than once)")
 	  ->check(CLI::ExistingDirectory);
+	app.add_flag("--share-lua-state",
+	             shareLuaState,
+	             "Run all Lua passes in one Lua state, each in its own "
+	             "environment, instead of setting up a state for each pass");
+	app.add_option("--lua-options",
+	               "Options for the Lua state of each Lua pass, as "
+	               "[pass:]key=value,... (may be specified more than once)")
+	  ->multi_option_policy(CLI::MultiOptionPolicy::TakeAll)
+	  ->each([](std::string_view argument) {
+		  try
+		  {
+			  LuaPass::options_set(argument);
+		  }
+		  catch (std::invalid_argument &e)
+		  {
+			  throw CLI::ValidationError(e.what());
+		  }
+	  });
+	app.add_option("--lua-cache-directory",
+	               luaCacheDirectory,
+	               "Directory in which to cache compiled Lua passes (caching "
+	               "is disabled if this is not set)");
 	app.add_option("--file", inputPath, "Input file to process")
 	  ->required()
 	  ->check(CLI::ExistingFile);
 	app.add_flag("--print-after-all",
 	             printAfterAll,
 	             "Print the tree after each pass runs");
+	app.add_flag("--print-changes",
+	             printChanges,
+	             "Print only the subtrees that each pass changed");
+	app.add_option("--print-after",
+	               printAfter,
+	               "Print the tree only after this pass (may be specified "
+	               "more than once)");
+	app.add_option("--print-kind",
+	               printKinds,
+	               "Print only nodes of this kind, and changes inside them "
+	               "(may be specified more than once)");
 	app
 	  .add_option("--plugin",
 	              pluginPaths,
@@ -1149,9 +2550,99 @@ int main(int argc, char *argv[])
 	  ->check(CLI::ExistingFile);
 	app.add_option(
 	  "--pass", passNames, "Passes to run (may be specified more than once)");
+	app.add_option("--threads",
+	               threads,
+	               "Number of threads for native passes that traverse the "
+	               "tree in parallel (defaults to the number of cores)");
+	app.add_option("--checkpoint-after",
+	               checkpointPasses,
+	               "Save a checkpoint of the tree after this pass runs (may be "
+	               "specified more than once)");
+	app
+	  .add_option("--checkpoint-directory",
+	              checkpointDirectory,
+	              "Directory for checkpoints (defaults to the current "
+	              "directory)")
+	  ->check(CLI::ExistingDirectory);
+	app.add_option("--resume-from-pass",
+	               resumePass,
+	               "Load the checkpoint saved after this pass instead of "
+	               "reading the input file, and run only the passes after it");
+	app.add_flag("--stats",
+	             stats,
+	             "Print the size of the tree, by node kind, after each pass");
+	app.add_option("--stats-json",
+	               statsJSONPath,
+	               "Write the size of the tree after each pass to this file as "
+	               "JSON");
+	app.add_flag("--time-passes",
+	             reports.timePasses,
+	             "Print the time spent in each pass, most expensive first");
+	app.add_option("--time-passes-json",
+	               reports.timePassesJSONPath,
+	               "Write the time spent in each pass to this file as JSON");
+	app.add_option("--trace",
+	               reports.tracePath,
+	               "Write a timeline of the run to this file in the Chrome "
+	               "trace event format");
+	app.add_flag("--perf-counters",
+	             perfCounters,
+	             "Print hardware performance counters for each pass (Linux "
+	             "only)");
+	app.add_flag("--profile-allocations",
+	             reports.profileAllocations,
+	             "Count heap allocations in each pass and Lua function and "
+	             "print the sites that allocate the most at exit");
+	app.add_option("--profile-allocations-top",
+	               reports.allocationReportSize,
+	               "Number of allocation sites to print (defaults to 20)");
+	app.add_option("--profile-lua",
+	               reports.luaProfilePath,
+	               "Sample the stacks of Lua passes and write them to this "
+	               "file as folded stacks, for flame graph tools");
+	app.add_option("--profile-lua-interval",
+	               luaProfileInterval,
+	               "Microseconds between samples for --profile-lua (defaults "
+	               "to 1000)");
 
 	CLI11_PARSE(app, argc, argv);
 
+	WorkStealingPool::set_thread_count(threads);
+	LuaPass::share_states(shareLuaState);
+	if (!LuaChunkCache::directory(luaCacheDirectory))
+	{
+		std::cerr << "Cannot create Lua cache directory " << luaCacheDirectory
+		          << ", compiled passes will not be cached" << std::endl;
+	}
+	auto &timer = PassTimer::shared_instance();
+	if (reports.timePasses || !reports.timePassesJSONPath.empty())
+	{
+		timer.enable();
+	}
+	auto &trace = TraceRecorder::shared_instance();
+	if (!reports.tracePath.empty())
+	{
+		trace.enable();
+	}
+	auto &allocations = AllocationProfiler::shared_instance();
+	if (reports.profileAllocations)
+	{
+		allocations.enable();
+	}
+	auto &luaProfiler = LuaProfiler::shared_instance();
+	if (!reports.luaProfilePath.empty() &&
+	    !luaProfiler.enable(std::chrono::microseconds(luaProfileInterval)))
+	{
+		std::cerr << "Lua profiling is not available: "
+		          << luaProfiler.error() << std::endl;
+	}
+	auto &counters = reports.counters;
+	if (perfCounters && !counters.open())
+	{
+		std::cerr << "Hardware performance counters are not available: "
+		          << counters.error() << std::endl;
+	}
+
 	// Open plugins
 	for (auto &path : pluginPaths)
 	{
@@ -1184,24 +2675,149 @@ int main(int argc, char *argv[])
 	{
 		LuaPassFactory::register_lua_directory(dir);
 	}
-	auto tree = read_file(inputPath);
-	for (auto &name : passNames)
+	auto checkpointPath = [&](const std::string &pass) {
+		return checkpointDirectory / (pass + ".igkckpt");
+	};
+	TextTreePointer tree;
+	auto            firstPass = passNames.begin();
+	if (resumePass.empty())
+	{
+		timer.begin("(scan)");
+		counters.begin("(scan)");
+		allocations.begin("(scan)");
+		tree = read_file(inputPath);
+		allocations.end();
+		counters.end();
+		timer.end();
+	}
+	else
+	{
+		firstPass = std::find(passNames.begin(), passNames.end(), resumePass);
+		if (firstPass == passNames.end())
+		{
+			std::cerr << "Cannot resume from pass " << resumePass
+			          << ", it is not in the pass list" << std::endl;
+			return EXIT_FAILURE;
+		}
+		++firstPass;
+		auto path = checkpointPath(resumePass);
+		try
+		{
+			std::string savedPass;
+			tree = TreeCheckpoint::load(path, config, savedPass);
+			if (savedPass != resumePass)
+			{
+				std::cerr << path << " was saved after pass " << savedPass
+				          << ", not " << resumePass << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "Failed to load checkpoint: " << e.what()
+			          << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (std::filesystem::last_write_time(inputPath) >
+		    std::filesystem::last_write_time(path))
+		{
+			std::cerr << "Warning: " << inputPath
+			          << " has been modified since checkpoint " << path
+			          << " was saved" << std::endl;
+		}
+		std::cerr << "Resuming after pass: " << resumePass << std::endl;
+	}
+	std::optional<TreeStatisticsJSON> statsJSON;
+	if (!statsJSONPath.empty())
+	{
+		statsJSON.emplace(statsJSONPath);
+		if (!statsJSON->is_open())
+		{
+			std::cerr << "Failed to open " << statsJSONPath << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	for (auto &name : std::ranges::subrange(firstPass, passNames.end()))
 	{
+		// Creating a Lua pass loads its script, so charge that to the pass.
+		allocations.begin(name);
+		luaProfiler.begin(name);
 		auto pass = TextPassRegistry().create(name);
 		if (pass)
 		{
+			bool print =
+			  (printAfterAll || printChanges || !printAfter.empty()) &&
+			  (printAfter.empty() ||
+			   (std::ranges::find(printAfter, name) != printAfter.end()));
+			// Deep clones are copy-on-write, so keeping the old tree to
+			// compare against costs only the nodes that the pass changes.
+			TextTreePointer before;
+			if (print && printChanges && tree)
+			{
+				before = tree->deep_clone();
+			}
 			std::cerr << "Running pass: " << name << std::endl;
-			tree = pass->process(tree);
-			if (printAfterAll)
+			timer.begin(name);
+			counters.begin(name);
+			{
+				TraceRecorder::Span span(name, "pass");
+				tree = pass->process(tree);
+			}
+			counters.end();
+			timer.end();
+			luaProfiler.end();
+			allocations.end();
+			if (print)
 			{
 				std::cerr << "After pass: " << name << std::endl;
-				tree->dump();
+				if (printChanges)
+				{
+					TreeChangePrinter(printKinds).print_changes(before, tree);
+				}
+				else if (tree && !printKinds.empty())
+				{
+					dump_kinds(tree, printKinds);
+				}
+				else if (tree)
+				{
+					tree->dump();
+				}
+			}
+			if (stats || statsJSON)
+			{
+				TreeStatistics statistics(tree);
+				if (stats)
+				{
+					statistics.print_table(std::cerr, name);
+				}
+				if (statsJSON)
+				{
+					statsJSON->write(statistics, name);
+				}
+			}
+			if (tree && (std::ranges::find(checkpointPasses, name) !=
+			             checkpointPasses.end()))
+			{
+				try
+				{
+					TreeCheckpoint::save(
+					  checkpointPath(name), *tree, config, name);
+				}
+				catch (std::exception &e)
+				{
+					std::cerr << "Failed to save checkpoint: " << e.what()
+					          << std::endl;
+					return EXIT_FAILURE;
+				}
 			}
 		}
 		else
 		{
+			luaProfiler.end();
+			allocations.end();
 			std::cerr << "Unknown pass: " << name << std::endl;
 		}
 	}
-	return 0;
+	return reports.write() ? EXIT_SUCCESS : EXIT_FAILURE;
 }
+#endif
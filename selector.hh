@@ -0,0 +1,593 @@
+#pragma once
+
+#include "document.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * A compiled list of CSS-like selectors over text trees.
+ *
+ * Each selector is a sequence of compound selectors separated by combinators.
+ * A compound selector is a kind (or `*` for any kind) followed by any number
+ * of attribute tests, `[name]` for presence or `[name=value]` for an exact
+ * value (the value may be quoted).  A space between two compound selectors
+ * matches a descendant, `>` matches a direct child.  Selectors in a list are
+ * separated by commas, for example:
+ *
+ *     chapter > heading, code[lang=c] code-run[token-kind=Keyword]
+ *
+ * The list is compiled into a single automaton whose states are the
+ * positions between the compound selectors of every selector.  Matching
+ * walks the tree once, carrying the set of live states from each node to its
+ * children, so the cost is proportional to the size of the tree and the
+ * number of live states, not the number of selectors times the size of the
+ * tree.  Matching does not change the tree, except to copy lazy clones and
+ * expand highlighted code that may contain a match.
+ */
+class TreeSelector
+{
+	public:
+	/**
+	 * Callback invoked for each match, with the index of the selector in the
+	 * list that matched and the matching node.
+	 */
+	using Callback = std::function<void(size_t, const TextTreePointer &)>;
+
+	private:
+	/**
+	 * A test of an attribute.  If `value` is not set, the attribute must
+	 * simply exist.
+	 */
+	struct AttributeTest
+	{
+		std::string                name;
+		std::optional<std::string> value;
+	};
+
+	/**
+	 * A compound selector.  Each is a state in the automaton: the state is
+	 * live at a node if this step may match one of the node's children (or,
+	 * for a descendant step, anything below the node).
+	 */
+	struct Step
+	{
+		/// The kind to match, or empty for any kind.
+		std::string kind;
+		/// Attribute tests, all of which must pass.
+		std::vector<AttributeTest> attributes;
+		/// True if this step must match a direct child of the previous one.
+		bool childOnly = false;
+		/// True if this is the last step of its selector.
+		bool last = false;
+		/// The index of the selector that this step belongs to.
+		size_t selector = 0;
+	};
+
+	/// The steps of every selector, stored contiguously in order.
+	std::vector<Step> steps;
+
+	/// First steps of selectors whose first compound names a kind.
+	std::unordered_map<std::string, std::vector<uint32_t>> startsByKind;
+
+	/// First steps of selectors whose first compound matches any kind.
+	std::vector<uint32_t> anyKindStarts;
+
+	/// The number of selectors in the list.
+	size_t selectorCount = 0;
+
+	/// True if the first step of some selector may match a `code-run` node.
+	bool codeRunStarts = false;
+
+	/**
+	 * Recursive-descent parser for selector lists.
+	 */
+	class Parser
+	{
+		std::string_view source;
+		size_t           position = 0;
+
+		[[noreturn]] void error(std::string_view message)
+		{
+			throw std::invalid_argument("Invalid selector '" +
+			                            std::string(source) + "' at offset " +
+			                            std::to_string(position) + ": " +
+			                            std::string(message));
+		}
+
+		bool at_end()
+		{
+			return position >= source.size();
+		}
+
+		char peek()
+		{
+			return at_end() ? '\0' : source[position];
+		}
+
+		/// Skip whitespace, returning true if there was any.
+		bool skip_space()
+		{
+			size_t start = position;
+			while (!at_end() && isspace(static_cast<unsigned char>(peek())))
+			{
+				position++;
+			}
+			return position != start;
+		}
+
+		static bool is_name_character(char c)
+		{
+			return isalnum(static_cast<unsigned char>(c)) || (c == '-') ||
+			       (c == '_') || (c == ':') || (c == '.') ||
+			       (static_cast<unsigned char>(c) >= 0x80);
+		}
+
+		std::string name()
+		{
+			size_t start = position;
+			while (!at_end() && is_name_character(peek()))
+			{
+				position++;
+			}
+			if (start == position)
+			{
+				error("expected a name");
+			}
+			return std::string(source.substr(start, position - start));
+		}
+
+		std::string value()
+		{
+			char quote = peek();
+			if ((quote != '"') && (quote != '\''))
+			{
+				return name();
+			}
+			position++;
+			std::string result;
+			while (peek() != quote)
+			{
+				if (at_end())
+				{
+					error("unterminated string");
+				}
+				if (peek() == '\\')
+				{
+					position++;
+					if (at_end())
+					{
+						error("unterminated string");
+					}
+				}
+				result += source[position++];
+			}
+			position++;
+			return result;
+		}
+
+		Step compound()
+		{
+			Step step;
+			if (peek() == '*')
+			{
+				position++;
+			}
+			else if (is_name_character(peek()))
+			{
+				step.kind = name();
+			}
+			else if (peek() != '[')
+			{
+				error("expected a kind, '*', or '['");
+			}
+			while (peek() == '[')
+			{
+				position++;
+				skip_space();
+				AttributeTest test;
+				test.name = name();
+				skip_space();
+				if (peek() == '=')
+				{
+					position++;
+					skip_space();
+					test.value = value();
+					skip_space();
+				}
+				if (peek() != ']')
+				{
+					error("expected ']'");
+				}
+				position++;
+				step.attributes.push_back(std::move(test));
+			}
+			return step;
+		}
+
+		public:
+		Parser(std::string_view source) : source(source) {}
+
+		/**
+		 * Parse the whole list, appending the steps of each selector to
+		 * `steps`.  Returns the number of selectors.
+		 */
+		size_t parse(std::vector<Step> &steps)
+		{
+			size_t selector = 0;
+			skip_space();
+			while (true)
+			{
+				bool childOnly = false;
+				while (true)
+				{
+					Step step      = compound();
+					step.childOnly = childOnly;
+					step.selector  = selector;
+					steps.push_back(std::move(step));
+					bool space = skip_space();
+					if (at_end() || (peek() == ','))
+					{
+						break;
+					}
+					childOnly = (peek() == '>');
+					if (childOnly)
+					{
+						position++;
+						skip_space();
+					}
+					else if (!space)
+					{
+						error("expected a combinator");
+					}
+				}
+				steps.back().last = true;
+				selector++;
+				if (at_end())
+				{
+					return selector;
+				}
+				position++;
+				skip_space();
+			}
+		}
+	};
+
+	/**
+	 * Returns true if `node` passes the tests of `step`.
+	 */
+	static bool step_matches(const Step &step, const TextTree &node)
+	{
+		if (!step.kind.empty() && (step.kind != node.kind()))
+		{
+			return false;
+		}
+		for (auto &test : step.attributes)
+		{
+			auto *found = node.find_attribute(test.name);
+			if (found == nullptr)
+			{
+				return false;
+			}
+			// Typed values are compared by their formatted text.
+			if (test.value)
+			{
+				auto *string = std::get_if<std::string>(found);
+				if (string ? (*string != *test.value)
+				           : (TextTree::to_string(*found) != *test.value))
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Returns true if `step` may report a `code-run` node expanded from
+	 * highlighted code.  Code runs have no child nodes, so only last steps
+	 * can match them.
+	 */
+	static bool may_match_code_run(const Step &step)
+	{
+		if (!step.last || (!step.kind.empty() && (step.kind != "code-run")))
+		{
+			return false;
+		}
+		return std::ranges::all_of(step.attributes, [](auto &test) {
+			return test.name == "token-kind";
+		});
+	}
+
+	/**
+	 * Returns true if a selector may match a `code-run` child of a node whose
+	 * children have the `live` states.
+	 */
+	bool may_match_code_runs(const std::vector<uint32_t> &live) const
+	{
+		if (codeRunStarts)
+		{
+			return true;
+		}
+		return std::ranges::any_of(live, [&](uint32_t state) {
+			return may_match_code_run(steps[state]);
+		});
+	}
+
+	/**
+	 * State for a single walk of a tree.
+	 */
+	struct Walk
+	{
+		const TreeSelector                            &selector;
+		std::vector<std::pair<size_t, TextTreePointer>> matches;
+		/**
+		 * For each step, the last node (by preorder number) for which it was
+		 * added to the live set, used to avoid adding states twice.
+		 */
+		std::vector<size_t> seen;
+		/// Preorder number of the current node.
+		size_t nodeNumber = 0;
+		/// Set when a selector matches a node that is not reported.
+		bool unreportedMatch = false;
+
+		Walk(const TreeSelector &selector)
+		  : selector(selector), seen(selector.steps.size(), 0)
+		{
+		}
+
+		/**
+		 * Step the automaton for `node`, given the states that were live in
+		 * its parent.  Returns the states that are live for its children.
+		 * Matches are reported as `report` if it is not null.
+		 */
+		std::vector<uint32_t> transition(const TextTree              &node,
+		                                 const std::vector<uint32_t> &live,
+		                                 const TextTreePointer       *report)
+		{
+			nodeNumber++;
+			std::vector<uint32_t> next;
+			auto                  add = [&](uint32_t state) {
+				if (seen[state] != nodeNumber)
+				{
+					seen[state] = nodeNumber;
+					next.push_back(state);
+				}
+			};
+			auto advance = [&](uint32_t state) {
+				auto &step = selector.steps[state];
+				// A descendant step that is live here is also live for
+				// everything below this node.
+				if (!step.childOnly)
+				{
+					add(state);
+				}
+				if (!step_matches(step, node))
+				{
+					return;
+				}
+				if (step.last)
+				{
+					matched(step.selector, report);
+				}
+				else
+				{
+					add(state + 1);
+				}
+			};
+			for (uint32_t state : live)
+			{
+				advance(state);
+			}
+			// The first step of every selector is live everywhere.  These
+			// are not carried in the live sets, only tested.
+			auto tryStart = [&](uint32_t state) {
+				auto &start = selector.steps[state];
+				if (!step_matches(start, node))
+				{
+					return;
+				}
+				if (start.last)
+				{
+					matched(start.selector, report);
+				}
+				else
+				{
+					add(state + 1);
+				}
+			};
+			if (auto found = selector.startsByKind.find(node.kind());
+			    found != selector.startsByKind.end())
+			{
+				for (uint32_t state : found->second)
+				{
+					tryStart(state);
+				}
+			}
+			for (uint32_t state : selector.anyKindStarts)
+			{
+				tryStart(state);
+			}
+			return next;
+		}
+
+		/**
+		 * Record that the selector at index `selector` matched `node`.
+		 */
+		void matched(size_t selector, const TextTreePointer *node)
+		{
+			if (node != nullptr)
+			{
+				matches.emplace_back(selector, *node);
+			}
+			else
+			{
+				unreportedMatch = true;
+			}
+		}
+
+		/**
+		 * Returns true if a selector may match a node below `node`, whose
+		 * children have the `live` states.  This reads the stored children,
+		 * so it does not copy lazy clones or expand highlighted code.
+		 */
+		bool may_match_below(const TextTree              &node,
+		                     const std::vector<uint32_t> &live)
+		{
+			if (node.stored_code_spans() && selector.may_match_code_runs(live))
+			{
+				return true;
+			}
+			for (auto &child : node.stored_children())
+			{
+				auto *childNode = std::get_if<TextTreePointer>(&child);
+				if ((childNode == nullptr) || (*childNode == nullptr))
+				{
+					continue;
+				}
+				unreportedMatch = false;
+				auto next       = transition(**childNode, live, nullptr);
+				if (unreportedMatch || may_match_below(**childNode, next))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void walk(const TextTreePointer      &node,
+		          const std::vector<uint32_t> &live,
+		          bool                         report)
+		{
+			size_t firstMatch = matches.size();
+			auto   next = transition(*node, live, report ? &node : nullptr);
+			// Report the selectors matching a single node in list order.
+			std::sort(matches.begin() + firstMatch,
+			          matches.end(),
+			          [](auto &a, auto &b) { return a.first < b.first; });
+			// Matches must be nodes in the tree, so a lazy clone is copied
+			// if something below it may match, and highlighted code is
+			// expanded if a code run may match.  A match below a lazy clone
+			// is looked for again from each lazy clone on the path to it,
+			// which is quadratic only in the depth of the path.
+			if (node->is_lazy())
+			{
+				if (!may_match_below(*node, next))
+				{
+					return;
+				}
+				node->children();
+			}
+			else if (node->stored_code_spans() &&
+			         selector.may_match_code_runs(next))
+			{
+				node->children();
+			}
+			for (auto &child : node->stored_children())
+			{
+				auto *childNode = std::get_if<TextTreePointer>(&child);
+				if ((childNode != nullptr) && (*childNode != nullptr))
+				{
+					walk(*childNode, next, true);
+				}
+			}
+		}
+	};
+
+	public:
+	/**
+	 * Compile a selector list.  Throws `std::invalid_argument` if it is not
+	 * valid.
+	 */
+	TreeSelector(std::string_view source)
+	{
+		selectorCount = Parser(source).parse(steps);
+		bool first    = true;
+		for (uint32_t i = 0; i < steps.size(); i++)
+		{
+			if (first)
+			{
+				codeRunStarts |= may_match_code_run(steps[i]);
+				if (steps[i].kind.empty())
+				{
+					anyKindStarts.push_back(i);
+				}
+				else
+				{
+					startsByKind[steps[i].kind].push_back(i);
+				}
+			}
+			first = steps[i].last;
+		}
+	}
+
+	/**
+	 * Returns the number of selectors in the list.
+	 */
+	size_t size() const
+	{
+		return selectorCount;
+	}
+
+	/**
+	 * Returns every node below `root` that matches any selector, in document
+	 * order, with the index of the selector that matched.  A node that
+	 * matches more than one selector appears once for each, in list order.
+	 * The root is never matched, but its kind and attributes take part in
+	 * matching its descendants.
+	 */
+	std::vector<std::pair<size_t, TextTreePointer>>
+	matches(const TextTreePointer &root) const
+	{
+		Walk walk(*this);
+		walk.walk(root, {}, false);
+		return std::move(walk.matches);
+	}
+
+	/**
+	 * Invoke `callback` for each match in `root`, as returned by `matches`.
+	 * All matches are found before the callback is first invoked, so the
+	 * callback may modify the tree.
+	 */
+	void select(const TextTreePointer &root, const Callback &callback) const
+	{
+		for (auto &[selector, node] : matches(root))
+		{
+			callback(selector, node);
+		}
+	}
+
+	/**
+	 * Returns a compiled selector for `source`, reusing an earlier
+	 * compilation on this thread if there is one.
+	 */
+	static std::shared_ptr<const TreeSelector>
+	compiled(const std::string &source)
+	{
+		thread_local std::unordered_map<std::string,
+		                                std::shared_ptr<const TreeSelector>>
+		  cache;
+		if (auto found = cache.find(source); found != cache.end())
+		{
+			return found->second;
+		}
+		// Selectors are normally string literals in passes, so this only
+		// grows without bound if a pass builds them dynamically.
+		if (cache.size() > 256)
+		{
+			cache.clear();
+		}
+		auto selector = std::make_shared<const TreeSelector>(source);
+		cache.emplace(source, selector);
+		return selector;
+	}
+};
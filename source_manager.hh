@@ -212,6 +212,14 @@ class SourceManager
 		return fileNames.at(id).first;
 	}
 
+	/**
+	 * Returns the contents of the file with the given ID.
+	 */
+	const std::string &contents_for_id(size_t id)
+	{
+		return fileNames.at(id).second;
+	}
+
 	SourceLocation expand(CompressedSourceLocation &loc)
 	{
 		return loc.expand(*this);
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A compiled set of strings to search for, using the Aho-Corasick algorithm.
+ *
+ * The patterns are compiled into a single automaton with a transition for
+ * every state and byte, so searching reads each byte of the text once,
+ * whatever the number of patterns, and reports every occurrence of every
+ * pattern, including overlapping ones.  The text can be fed in pieces (for
+ * example, the text runs of a tree) through a `Cursor`, which finds matches
+ * that span the pieces.
+ */
+class TextSearcher
+{
+	public:
+	/**
+	 * An occurrence of a pattern: the index of the pattern and the byte
+	 * offset of its start in the text.
+	 */
+	struct Match
+	{
+		size_t pattern;
+		size_t offset;
+	};
+
+	private:
+	/// The number of possible input bytes.
+	static constexpr size_t Alphabet = 256;
+
+	/// The length of each pattern.
+	std::vector<size_t> lengths;
+
+	/**
+	 * The transition table, `Alphabet` entries for each state.  State 0 is
+	 * the start state.
+	 */
+	std::vector<uint32_t> transitions;
+
+	/**
+	 * For each state, the patterns that end there: those that spell out the
+	 * path to the state and those that are suffixes of it.
+	 */
+	std::vector<std::vector<uint32_t>> outputs;
+
+	public:
+	/**
+	 * Incremental search state.  Each call to `feed` continues from where
+	 * the last one stopped, so matches may span calls.
+	 */
+	class Cursor
+	{
+		const TextSearcher &searcher;
+		uint32_t            state  = 0;
+		size_t              offset = 0;
+
+		public:
+		Cursor(const TextSearcher &searcher) : searcher(searcher) {}
+
+		/**
+		 * Feed the next piece of text.  Calls `callback(pattern, offset)`
+		 * for each match ending in this piece, in the order in which they
+		 * end.  If the callback returns false, stops and returns false.
+		 */
+		template<typename Callback>
+		bool feed(std::string_view text, Callback &&callback)
+		{
+			for (unsigned char c : text)
+			{
+				state = searcher.transitions[state * Alphabet + c];
+				offset++;
+				for (uint32_t pattern : searcher.outputs[state])
+				{
+					if (!callback(size_t(pattern),
+					              offset - searcher.lengths[pattern]))
+					{
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+	};
+
+	/**
+	 * Compile a set of patterns.  Throws `std::invalid_argument` if any
+	 * pattern is empty.
+	 */
+	TextSearcher(const std::vector<std::string> &patterns)
+	{
+		transitions.resize(Alphabet, 0);
+		outputs.emplace_back();
+		std::vector<uint32_t> depth{0};
+		// Build the trie.
+		for (uint32_t i = 0; i < patterns.size(); i++)
+		{
+			if (patterns[i].empty())
+			{
+				throw std::invalid_argument("Search patterns must not be empty");
+			}
+			uint32_t state = 0;
+			for (unsigned char c : patterns[i])
+			{
+				if (transitions[state * Alphabet + c] == 0)
+				{
+					uint32_t next = outputs.size();
+					transitions[state * Alphabet + c] = next;
+					transitions.resize(transitions.size() + Alphabet, 0);
+					outputs.emplace_back();
+					depth.push_back(depth[state] + 1);
+				}
+				state = transitions[state * Alphabet + c];
+			}
+			outputs[state].push_back(i);
+			lengths.push_back(patterns[i].size());
+		}
+		// Compute the failure links breadth first, replacing each missing
+		// transition with the one from the failure state, which has already
+		// been completed because it is shallower.  The transitions from the
+		// start state that are missing stay at the start state.
+		std::vector<uint32_t> failure(outputs.size(), 0);
+		std::vector<uint32_t> queue;
+		for (size_t c = 0; c < Alphabet; c++)
+		{
+			if (transitions[c] != 0)
+			{
+				queue.push_back(transitions[c]);
+			}
+		}
+		for (size_t next = 0; next < queue.size(); next++)
+		{
+			uint32_t state = queue[next];
+			for (size_t c = 0; c < Alphabet; c++)
+			{
+				uint32_t &target   = transitions[state * Alphabet + c];
+				uint32_t  fallback = transitions[failure[state] * Alphabet + c];
+				// A transition to a deeper state is an edge of the trie,
+				// anything else was filled in from a failure state.
+				if ((target != 0) && (depth[target] == depth[state] + 1))
+				{
+					failure[target] = fallback;
+					outputs[target].insert(outputs[target].end(),
+					                       outputs[fallback].begin(),
+					                       outputs[fallback].end());
+					queue.push_back(target);
+				}
+				else
+				{
+					target = fallback;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Returns the number of patterns.
+	 */
+	size_t size() const
+	{
+		return lengths.size();
+	}
+
+	/**
+	 * Returns a compiled searcher for `patterns`, reusing an earlier
+	 * compilation on this thread if there is one.
+	 */
+	static std::shared_ptr<const TextSearcher>
+	compiled(const std::vector<std::string> &patterns)
+	{
+		thread_local std::unordered_map<std::string,
+		                                std::shared_ptr<const TextSearcher>>
+		  cache;
+		std::string key;
+		for (auto &pattern : patterns)
+		{
+			key += std::to_string(pattern.size());
+			key += ':';
+			key += pattern;
+		}
+		if (auto found = cache.find(key); found != cache.end())
+		{
+			return found->second;
+		}
+		// As with selectors, this only grows without bound if a pass builds
+		// pattern lists dynamically.
+		if (cache.size() > 256)
+		{
+			cache.clear();
+		}
+		auto searcher = std::make_shared<const TextSearcher>(patterns);
+		cache.emplace(std::move(key), searcher);
+		return searcher;
+	}
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include "trace.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * A work-stealing thread pool.  Each worker owns a queue of tasks.  Workers
+ * push and pop work at the back of their own queue and steal from the front
+ * of other workers' queues when they run out.  Threads that are not part of
+ * the pool submit work to a shared injection queue.
+ *
+ * Waiting for a group of tasks never blocks: the waiting thread runs queued
+ * tasks until the group has finished, so tasks may submit and wait for nested
+ * tasks without deadlocking the pool.
+ */
+class WorkStealingPool
+{
+	public:
+	using Task = std::function<void()>;
+
+	/**
+	 * A set of tasks that are waited for together.
+	 */
+	class TaskGroup
+	{
+		/// The pool that runs the tasks.
+		WorkStealingPool &pool;
+		/// The number of tasks that have been submitted but not finished.
+		std::atomic<size_t> pending = 0;
+		/// Lock protecting `exception`.
+		std::mutex exceptionLock;
+		/// The first exception thrown by a task in this group.
+		std::exception_ptr exception;
+
+		public:
+		/**
+		 * Create a task group that submits work to `pool`.
+		 */
+		TaskGroup(WorkStealingPool &pool) : pool(pool) {}
+
+		/**
+		 * Groups must not be destroyed while tasks are in flight.
+		 */
+		~TaskGroup()
+		{
+			while (pending.load() != 0)
+			{
+				if (!pool.run_one())
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
+
+		/**
+		 * Submit a task.
+		 */
+		void run(Task &&task)
+		{
+			pending++;
+			pool.submit([this, task = std::move(task)]() {
+				try
+				{
+					TraceRecorder::Span span("task", "thread-pool");
+					task();
+				}
+				catch (...)
+				{
+					std::lock_guard lock(exceptionLock);
+					if (!exception)
+					{
+						exception = std::current_exception();
+					}
+				}
+				pending--;
+			});
+		}
+
+		/**
+		 * Wait for every task in the group, running queued work on this
+		 * thread in the meantime.  If any task threw an exception, the first
+		 * one is rethrown here.
+		 */
+		void wait()
+		{
+			while (pending.load() != 0)
+			{
+				if (!pool.run_one())
+				{
+					std::this_thread::yield();
+				}
+			}
+			std::lock_guard lock(exceptionLock);
+			if (exception)
+			{
+				std::rethrow_exception(std::exchange(exception, nullptr));
+			}
+		}
+	};
+
+	private:
+	/**
+	 * A queue of tasks, owned by one worker (or the injection queue).
+	 */
+	struct Queue
+	{
+		std::mutex       lock;
+		std::deque<Task> tasks;
+	};
+
+	/**
+	 * One queue per worker, followed by the injection queue used by threads
+	 * outside the pool.
+	 */
+	std::vector<std::unique_ptr<Queue>> queues;
+	/// The worker threads.
+	std::vector<std::thread> workers;
+	/// The number of tasks currently sitting in any queue.
+	std::atomic<size_t> queued = 0;
+	/// Set when the pool is shutting down.
+	std::atomic<bool> stopping = false;
+	/// Lock and condition variable used to park idle workers.
+	std::mutex              sleepLock;
+	std::condition_variable wakeup;
+
+	/**
+	 * The index of the queue owned by the current thread, if it is a worker
+	 * in this pool.
+	 */
+	inline static thread_local const WorkStealingPool *currentPool = nullptr;
+	inline static thread_local size_t                  currentQueue = 0;
+
+	/**
+	 * Returns the index of the injection queue.
+	 */
+	size_t injection_queue() const
+	{
+		return queues.size() - 1;
+	}
+
+	/**
+	 * Returns the queue that the current thread should push work to.
+	 */
+	size_t local_queue() const
+	{
+		return (currentPool == this) ? currentQueue : injection_queue();
+	}
+
+	void submit(Task &&task)
+	{
+		{
+			auto           &queue = *queues[local_queue()];
+			std::lock_guard lock(queue.lock);
+			queue.tasks.push_back(std::move(task));
+		}
+		queued++;
+		wakeup.notify_one();
+	}
+
+	/**
+	 * Try to take a task: first from the back of our own queue, then from the
+	 * front of every other queue.
+	 */
+	std::optional<Task> take()
+	{
+		if (queued.load() == 0)
+		{
+			return std::nullopt;
+		}
+		size_t self = local_queue();
+		{
+			auto           &queue = *queues[self];
+			std::lock_guard lock(queue.lock);
+			if (!queue.tasks.empty())
+			{
+				Task task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+				queued--;
+				return task;
+			}
+		}
+		for (size_t i = 1; i < queues.size(); i++)
+		{
+			auto           &queue = *queues[(self + i) % queues.size()];
+			std::lock_guard lock(queue.lock);
+			if (!queue.tasks.empty())
+			{
+				Task task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+				queued--;
+				return task;
+			}
+		}
+		return std::nullopt;
+	}
+
+	/**
+	 * Run one queued task on the current thread.  Returns false if there was
+	 * no work to do.
+	 */
+	bool run_one()
+	{
+		auto task = take();
+		if (!task)
+		{
+			return false;
+		}
+		(*task)();
+		return true;
+	}
+
+	void worker(size_t index)
+	{
+		currentPool  = this;
+		currentQueue = index;
+		while (!stopping.load())
+		{
+			if (run_one())
+			{
+				continue;
+			}
+			std::unique_lock lock(sleepLock);
+			wakeup.wait_for(lock, std::chrono::milliseconds(10), [this]() {
+				return stopping.load() || (queued.load() != 0);
+			});
+		}
+	}
+
+	/**
+	 * The number of threads that the shared instance will use, or zero to
+	 * pick one based on the hardware.
+	 */
+	inline static size_t requestedThreads = 0;
+
+	public:
+	/**
+	 * Create a pool with `threads` threads in total.  The thread that waits
+	 * for a task group also runs tasks, so this creates one fewer worker.
+	 */
+	WorkStealingPool(size_t threads)
+	{
+		size_t workerCount = threads > 0 ? threads - 1 : 0;
+		for (size_t i = 0; i < workerCount + 1; i++)
+		{
+			queues.push_back(std::make_unique<Queue>());
+		}
+		for (size_t i = 0; i < workerCount; i++)
+		{
+			workers.emplace_back([this, i]() { worker(i); });
+		}
+	}
+
+	~WorkStealingPool()
+	{
+		stopping = true;
+		wakeup.notify_all();
+		for (auto &thread : workers)
+		{
+			thread.join();
+		}
+	}
+
+	/**
+	 * The total number of threads that run tasks, including the waiting
+	 * thread.
+	 */
+	size_t thread_count() const
+	{
+		return workers.size() + 1;
+	}
+
+	/**
+	 * Set the number of threads used by the shared instance.  This has an
+	 * effect only if called before the first call to `shared_instance`.
+	 */
+	static void set_thread_count(size_t threads)
+	{
+		requestedThreads = threads;
+	}
+
+	/**
+	 * Returns a singleton instance of this class.
+	 */
+	static WorkStealingPool &shared_instance()
+	{
+		static WorkStealingPool instance(
+		  requestedThreads > 0
+		    ? requestedThreads
+		    : std::max<size_t>(1, std::thread::hardware_concurrency()));
+		return instance;
+	}
+};
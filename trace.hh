@@ -0,0 +1,209 @@
+#pragma once
+
+#include "json.hh"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+/**
+ * Records a timeline of a run, for `--trace`, in the Chrome trace event
+ * format that `chrome://tracing` and Perfetto read.
+ *
+ * Each span records the thread that it ran on, so work that runs in parallel
+ * shows up on separate tracks.  Threads are numbered in the order that they
+ * first record a span, starting from the thread that enabled tracing.
+ *
+ * This is a singleton so that plugins, which are loaded into the same
+ * process, record into the same trace.  When tracing is not enabled, spans
+ * cost a single test.
+ */
+class TraceRecorder
+{
+	using Clock = std::chrono::steady_clock;
+
+	/**
+	 * A completed span.  Times are in microseconds since tracing was
+	 * enabled.
+	 */
+	struct Event
+	{
+		std::string name;
+		std::string category;
+		std::string detail;
+		uint32_t    thread;
+		double      start;
+		double      duration;
+	};
+
+	/// True if tracing was requested.
+	std::atomic<bool> enabled = false;
+
+	/// When tracing was enabled.
+	Clock::time_point origin;
+
+	/// Lock protecting `events`.
+	std::mutex eventsLock;
+
+	/// The completed spans, in the order that they finished.
+	std::vector<Event> events;
+
+	/// The number of threads that have recorded spans.
+	std::atomic<uint32_t> threads = 0;
+
+	/**
+	 * Returns the number of the current thread in the trace.
+	 */
+	uint32_t thread_number()
+	{
+		thread_local uint32_t number = threads++;
+		return number;
+	}
+
+	/**
+	 * Returns the time since tracing was enabled, in microseconds.
+	 */
+	double now() const
+	{
+		return std::chrono::duration<double, std::micro>(Clock::now() -
+		                                                 origin)
+		  .count();
+	}
+
+	public:
+	/**
+	 * RAII helper that records a span from its construction to its
+	 * destruction.  `detail`, if not empty, is shown with the span, for
+	 * example the file that was parsed.
+	 */
+	class Span
+	{
+		std::string name;
+		std::string category;
+		std::string detail;
+		double      start  = 0;
+		bool        active = false;
+
+		public:
+		Span(std::string_view name,
+		     std::string_view category,
+		     std::string_view detail = {})
+		{
+			auto &recorder = shared_instance();
+			if (recorder.is_enabled())
+			{
+				this->name     = name;
+				this->category = category;
+				this->detail   = detail;
+				active         = true;
+				start          = recorder.now();
+			}
+		}
+
+		~Span()
+		{
+			if (active)
+			{
+				auto &recorder = shared_instance();
+				recorder.record({std::move(name),
+				                 std::move(category),
+				                 std::move(detail),
+				                 recorder.thread_number(),
+				                 start,
+				                 recorder.now() - start});
+			}
+		}
+	};
+
+	/**
+	 * Enable tracing.  The thread that calls this is the first in the trace.
+	 */
+	void enable()
+	{
+		origin = Clock::now();
+		thread_number();
+		enabled = true;
+	}
+
+	/**
+	 * Returns true if tracing is enabled.
+	 */
+	bool is_enabled() const
+	{
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Record a completed span.
+	 */
+	void record(Event &&event)
+	{
+		std::lock_guard lock(eventsLock);
+		events.push_back(std::move(event));
+	}
+
+	/**
+	 * Write the trace as a JSON object in the Chrome trace event format.
+	 */
+	void write_json(std::ostream &out)
+	{
+		std::lock_guard lock(eventsLock);
+		auto            pid = getpid();
+		fmt::print(out,
+		           "{{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+		           "{{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": {}, "
+		           "\"tid\": 0, \"args\": {{\"name\": \"igk\"}}}}",
+		           pid);
+		for (uint32_t thread = 0; thread < threads; thread++)
+		{
+			fmt::print(out,
+			           ",\n{{\"name\": \"thread_name\", \"ph\": \"M\", "
+			           "\"pid\": {}, \"tid\": {}, \"args\": {{\"name\": "
+			           "\"{}\"}}}}",
+			           pid,
+			           thread,
+			           thread == 0 ? std::string("main")
+			                       : fmt::format("thread {}", thread));
+		}
+		for (auto &event : events)
+		{
+			out << ",\n{\"name\": ";
+			write_json_string(out, event.name);
+			out << ", \"cat\": ";
+			write_json_string(out, event.category);
+			fmt::print(out,
+			           ", \"ph\": \"X\", \"pid\": {}, \"tid\": {}, "
+			           "\"ts\": {:.3f}, \"dur\": {:.3f}",
+			           pid,
+			           event.thread,
+			           event.start,
+			           event.duration);
+			if (!event.detail.empty())
+			{
+				out << ", \"args\": {\"detail\": ";
+				write_json_string(out, event.detail);
+				out << "}";
+			}
+			out << "}";
+		}
+		out << "\n]}\n";
+	}
+
+	/**
+	 * Returns a singleton instance of this class.
+	 */
+	static TraceRecorder &shared_instance()
+	{
+		static TraceRecorder instance;
+		return instance;
+	}
+};
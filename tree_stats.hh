@@ -0,0 +1,340 @@
+#pragma once
+
+#include "document.hh"
+#include "json.hh"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+/**
+ * Size statistics for a text tree, broken down by node kind, for `--stats`.
+ *
+ * Heap use is an estimate: it counts the nodes, their out-of-line state,
+ * child vectors, and attribute maps, and any strings too long to be stored
+ * inline, but not allocator overhead or memory shared between copy-on-write
+ * clones.
+ */
+class TreeStatistics
+{
+	public:
+	/**
+	 * Counts for a set of nodes.  Text and attribute bytes are attributed to
+	 * the node that directly holds them.
+	 */
+	struct Counts
+	{
+		size_t nodes          = 0;
+		size_t textBytes      = 0;
+		size_t attributeBytes = 0;
+		size_t heapBytes      = 0;
+
+		void add(const Counts &other)
+		{
+			nodes += other.nodes;
+			textBytes += other.textBytes;
+			attributeBytes += other.attributeBytes;
+			heapBytes += other.heapBytes;
+		}
+	};
+
+	private:
+	/// Counts for each kind of node.
+	std::unordered_map<std::string, Counts> kinds;
+
+	/// Counts for the whole tree.
+	Counts total;
+
+	/// Resident set size of the process when the statistics were collected.
+	size_t residentBytes;
+
+	/**
+	 * Returns the heap memory used by a string, which is zero if it is
+	 * short enough to be stored inline.
+	 */
+	static size_t string_heap(const std::string &string)
+	{
+		static const size_t inlineCapacity = std::string().capacity();
+		return (string.capacity() > inlineCapacity) ? string.capacity() + 1
+		                                            : 0;
+	}
+
+	/**
+	 * Returns the number of bytes used by the value of an attribute.
+	 */
+	static size_t value_bytes(const TextTree::AttributeValue &value)
+	{
+		if (auto *string = std::get_if<std::string>(&value))
+		{
+			return string->size();
+		}
+		return std::visit([](auto &value) { return sizeof(value); }, value);
+	}
+
+	/**
+	 * Add the counts for `node` and the nodes below it.  Nodes are read
+	 * through their stored contents, so that collecting statistics does not
+	 * copy lazy clones, drop removed children, or expand highlighted code.
+	 * The contents of a lazy clone belong to the node that it shares them
+	 * with, so if `shared` is true, or this is a lazy clone, they count
+	 * towards the nodes and text but not towards the heap.
+	 */
+	void collect(const TextTree &node, bool shared = false)
+	{
+		Counts counts;
+		counts.nodes = 1;
+		if (!shared)
+		{
+			// The node and the control block that `make_shared` puts with
+			// it.
+			counts.heapBytes = sizeof(TextTree) + 2 * sizeof(void *) +
+			                   string_heap(node.kind()) +
+			                   node.rare_state_bytes();
+		}
+		shared           = shared || node.is_lazy();
+		auto &attributes = node.stored_attributes();
+		if (!shared)
+		{
+			counts.heapBytes += attributes.bucket_count() * sizeof(void *);
+		}
+		for (auto &[name, value] : attributes)
+		{
+			counts.attributeBytes += name.size() + value_bytes(value);
+			if (shared)
+			{
+				continue;
+			}
+			counts.heapBytes +=
+			  sizeof(std::pair<const std::string, TextTree::AttributeValue>) +
+			  2 * sizeof(void *) + string_heap(name);
+			if (auto *string = std::get_if<std::string>(&value))
+			{
+				counts.heapBytes += string_heap(*string);
+			}
+		}
+		if (auto spans = node.stored_code_spans())
+		{
+			counts.textBytes += spans->text().size();
+			if (!shared)
+			{
+				counts.heapBytes += sizeof(CodeSpans) +
+				                    string_heap(spans->text()) +
+				                    spans->spans().capacity() *
+				                      sizeof(CodeSpans::Span);
+			}
+		}
+		auto &children = node.stored_children();
+		if (!shared)
+		{
+			counts.heapBytes += children.capacity() * sizeof(TextTree::Child);
+		}
+		for (auto &child : children)
+		{
+			if (std::holds_alternative<std::string>(child))
+			{
+				auto &text = std::get<std::string>(child);
+				counts.textBytes += text.size();
+				counts.heapBytes += shared ? 0 : string_heap(text);
+			}
+			else if (auto &childNode = std::get<TextTreePointer>(child))
+			{
+				collect(*childNode, shared);
+			}
+		}
+		kinds[node.kind()].add(counts);
+		total.add(counts);
+	}
+
+	/**
+	 * Returns the kinds sorted by decreasing estimated heap use.
+	 */
+	std::vector<std::pair<std::string_view, const Counts *>>
+	sorted_kinds() const
+	{
+		std::vector<std::pair<std::string_view, const Counts *>> sorted;
+		for (auto &[kind, counts] : kinds)
+		{
+			sorted.emplace_back(kind, &counts);
+		}
+		std::ranges::sort(sorted, [](auto &a, auto &b) {
+			return (a.second->heapBytes > b.second->heapBytes) ||
+			       ((a.second->heapBytes == b.second->heapBytes) &&
+			        (a.first < b.first));
+		});
+		return sorted;
+	}
+
+	static void write_json_counts(std::ostream &out, const Counts &counts)
+	{
+		fmt::print(out,
+		           "{{\"nodes\": {}, \"text_bytes\": {}, "
+		           "\"attribute_bytes\": {}, \"heap_bytes\": {}}}",
+		           counts.nodes,
+		           counts.textBytes,
+		           counts.attributeBytes,
+		           counts.heapBytes);
+	}
+
+	public:
+	/**
+	 * Collect statistics for `tree`, which may be null.
+	 */
+	TreeStatistics(const TextTreePointer &tree)
+	  : residentBytes(resident_set_size())
+	{
+		if (tree)
+		{
+			collect(*tree);
+		}
+	}
+
+	/**
+	 * Returns the resident set size of this process, in bytes.  Where the
+	 * current size is not available, returns the peak.
+	 */
+	static size_t resident_set_size()
+	{
+		std::ifstream statm("/proc/self/statm");
+		size_t        size;
+		size_t        resident;
+		if (statm >> size >> resident)
+		{
+			return resident * sysconf(_SC_PAGESIZE);
+		}
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0)
+		{
+			return 0;
+		}
+#ifdef __APPLE__
+		return usage.ru_maxrss;
+#else
+		return usage.ru_maxrss * 1024;
+#endif
+	}
+
+	/**
+	 * Returns the counts for the whole tree.
+	 */
+	const Counts &totals() const
+	{
+		return total;
+	}
+
+	/**
+	 * Print the statistics as a table, with the kinds that use the most
+	 * memory first.
+	 */
+	void print_table(std::ostream &out, std::string_view pass) const
+	{
+		fmt::print(out,
+		           "Statistics after pass: {} (resident set: {} KiB)\n",
+		           pass,
+		           residentBytes / 1024);
+		auto row = [&](std::string_view kind, const Counts &counts) {
+			fmt::print(out,
+			           "{:<24} {:>10} {:>12} {:>12} {:>12}\n",
+			           kind,
+			           counts.nodes,
+			           counts.textBytes,
+			           counts.attributeBytes,
+			           counts.heapBytes);
+		};
+		fmt::print(out,
+		           "{:<24} {:>10} {:>12} {:>12} {:>12}\n",
+		           "Kind",
+		           "Nodes",
+		           "Text",
+		           "Attributes",
+		           "Heap");
+		for (auto &[kind, counts] : sorted_kinds())
+		{
+			row(kind.empty() ? "(none)" : kind, *counts);
+		}
+		row("Total", total);
+		out << std::flush;
+	}
+
+	/**
+	 * Write the statistics as a JSON object.
+	 */
+	void write_json(std::ostream &out, std::string_view pass) const
+	{
+		out << "{\"pass\": ";
+		write_json_string(out, pass);
+		fmt::print(out, ", \"resident_bytes\": {}, \"total\": ", residentBytes);
+		write_json_counts(out, total);
+		out << ", \"kinds\": {";
+		bool first = true;
+		for (auto &[kind, counts] : sorted_kinds())
+		{
+			if (!first)
+			{
+				out << ", ";
+			}
+			first = false;
+			write_json_string(out, kind);
+			out << ": ";
+			write_json_counts(out, *counts);
+		}
+		out << "}}";
+	}
+};
+
+/**
+ * Writes the statistics after each pass to a file, for `--stats-json`, as a
+ * JSON array.  The array is closed after every entry, and reopened by writing
+ * the next entry over the closing bracket, so the file is valid JSON however
+ * the run ends.
+ */
+class TreeStatisticsJSON
+{
+	/// The text that closes the array.
+	static constexpr std::string_view Close = "\n]\n";
+
+	/// The file being written.
+	std::ofstream out;
+
+	/// True until the first entry has been written.
+	bool first = true;
+
+	public:
+	/**
+	 * Open `path` and write an empty array.
+	 */
+	TreeStatisticsJSON(const std::filesystem::path &path) : out(path)
+	{
+		out << '[' << Close << std::flush;
+	}
+
+	/**
+	 * Returns true if the file was opened successfully.
+	 */
+	bool is_open() const
+	{
+		return out.is_open();
+	}
+
+	/**
+	 * Add the statistics collected after `pass` to the array.
+	 */
+	void write(const TreeStatistics &statistics, std::string_view pass)
+	{
+		out.seekp(-static_cast<std::streamoff>(Close.size()),
+		          std::ios_base::cur);
+		out << (first ? "\n" : ",\n");
+		statistics.write_json(out, pass);
+		out << Close << std::flush;
+		first = false;
+	}
+};
@@ -0,0 +1,263 @@
+#pragma once
+
+#include "document.hh"
+
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+/**
+ * The shape of a subtree, compiled once and then instantiated many times.
+ *
+ * A template is a tree of nodes with fixed kinds, fixed attributes and fixed
+ * text, and named holes.  A hole may stand for children, in which case each
+ * instance fills it with any number of strings and nodes, or for the value of
+ * an attribute.  The same hole may be used in several places.
+ *
+ * Passes that build the same boilerplate around many nodes compile it once
+ * and then build each copy natively from the values of the holes.
+ */
+class TreeTemplate
+{
+	public:
+	/**
+	 * A reference to a node of the template.
+	 */
+	struct NodeRef
+	{
+		size_t index;
+	};
+
+	/**
+	 * A reference to a hole of the template.
+	 */
+	struct HoleRef
+	{
+		size_t index;
+	};
+
+	/**
+	 * The value of an attribute: fixed, or filled from a hole.
+	 */
+	using Attribute = std::variant<TextTree::AttributeValue, HoleRef>;
+
+	/**
+	 * A child: fixed text, a node of the template, or a hole.
+	 */
+	using Item = std::variant<std::string, NodeRef, HoleRef>;
+
+	/**
+	 * The value of a hole in one instance.  `children` is used where the
+	 * hole stands for children and `attribute` where it stands for an
+	 * attribute.  An attribute whose hole has no value is left out.
+	 */
+	struct Value
+	{
+		std::vector<TextTree::Child>            children;
+		std::optional<TextTree::AttributeValue> attribute;
+	};
+
+	private:
+	/**
+	 * A node of the template.
+	 */
+	struct Node
+	{
+		std::string                                    kind;
+		std::vector<std::pair<std::string, Attribute>> attributes;
+		std::vector<Item>                              children;
+
+		Node(std::string kind) : kind(std::move(kind)) {}
+	};
+
+	/**
+	 * A hole, and the ways that it is used.
+	 */
+	struct Hole
+	{
+		std::string name;
+		bool        usedAsChildren  = false;
+		bool        usedAsAttribute = false;
+	};
+
+	/// The nodes of the template.  The first is the root.
+	std::vector<Node> nodes;
+
+	/// The holes, in the order that they were first used.
+	std::vector<Hole> holeStorage;
+
+	/// The indexes of the holes, by name.
+	std::unordered_map<std::string, size_t> holeIndexes;
+
+	/**
+	 * Returns a new node, with the structure of template node `index`,
+	 * filled from `values`.  `used` records which holes have had their
+	 * nodes used already, so that later uses get copies.
+	 */
+	TextTreePointer instantiate(size_t                  index,
+	                            std::span<const Value>  values,
+	                            std::vector<bool>      &used) const
+	{
+		auto &node = nodes[index];
+		auto  tree = TextTree::create();
+		tree->kind(node.kind);
+		for (auto &[name, attribute] : node.attributes)
+		{
+			if (auto *hole = std::get_if<HoleRef>(&attribute))
+			{
+				if (auto &value = values[hole->index].attribute)
+				{
+					tree->attribute_set(name, *value);
+				}
+				continue;
+			}
+			tree->attribute_set(name,
+			                    std::get<TextTree::AttributeValue>(attribute));
+		}
+		for (auto &item : node.children)
+		{
+			if (auto *text = std::get_if<std::string>(&item))
+			{
+				tree->append_text(*text);
+			}
+			else if (auto *child = std::get_if<NodeRef>(&item))
+			{
+				tree->append_child(instantiate(child->index, values, used));
+			}
+			else
+			{
+				auto hole = std::get<HoleRef>(item).index;
+				for (auto &value : values[hole].children)
+				{
+					if (auto *text = std::get_if<std::string>(&value))
+					{
+						tree->append_text(*text);
+					}
+					else if (auto &child = std::get<TextTreePointer>(value))
+					{
+						// A node can have only one parent, so each use of
+						// a hole after the first gets a copy.
+						tree->append_child(used[hole] ? child->deep_clone()
+						                              : child);
+					}
+				}
+				used[hole] = true;
+			}
+		}
+		return tree;
+	}
+
+	public:
+	/**
+	 * Create a template whose root node has the given kind.
+	 */
+	TreeTemplate(std::string kind)
+	{
+		nodes.emplace_back(std::move(kind));
+	}
+
+	/**
+	 * Returns the root node.
+	 */
+	NodeRef root() const
+	{
+		return {0};
+	}
+
+	/**
+	 * Add a node with the given kind, which must then be added as a child of
+	 * another node.
+	 */
+	NodeRef add_node(std::string kind)
+	{
+		nodes.emplace_back(std::move(kind));
+		return {nodes.size() - 1};
+	}
+
+	/**
+	 * Returns the hole with the given name, creating it if necessary.
+	 */
+	HoleRef hole(std::string_view name)
+	{
+		auto [it, inserted] =
+		  holeIndexes.try_emplace(std::string(name), holeStorage.size());
+		if (inserted)
+		{
+			holeStorage.push_back({std::string(name)});
+		}
+		return {it->second};
+	}
+
+	/**
+	 * Add an attribute to a node.
+	 */
+	void add_attribute(NodeRef node, std::string name, Attribute value)
+	{
+		if (auto *hole = std::get_if<HoleRef>(&value))
+		{
+			holeStorage[hole->index].usedAsAttribute = true;
+		}
+		nodes[node.index].attributes.emplace_back(std::move(name),
+		                                          std::move(value));
+	}
+
+	/**
+	 * Add a child to a node.
+	 */
+	void add_child(NodeRef node, Item child)
+	{
+		if (auto *hole = std::get_if<HoleRef>(&child))
+		{
+			holeStorage[hole->index].usedAsChildren = true;
+		}
+		nodes[node.index].children.push_back(std::move(child));
+	}
+
+	/**
+	 * Returns the number of holes.  Holes are numbered from zero in the
+	 * order that they were first used.
+	 */
+	size_t hole_count() const
+	{
+		return holeStorage.size();
+	}
+
+	/**
+	 * Returns the name of a hole.
+	 */
+	const std::string &hole_name(size_t index) const
+	{
+		return holeStorage[index].name;
+	}
+
+	/**
+	 * Returns true if a hole stands for children anywhere.
+	 */
+	bool hole_used_as_children(size_t index) const
+	{
+		return holeStorage[index].usedAsChildren;
+	}
+
+	/**
+	 * Returns true if a hole stands for an attribute anywhere.
+	 */
+	bool hole_used_as_attribute(size_t index) const
+	{
+		return holeStorage[index].usedAsAttribute;
+	}
+
+	/**
+	 * Returns a new subtree with the shape of this template, with the holes
+	 * filled from `values`, which holds one value for each hole.
+	 */
+	TextTreePointer instantiate(std::span<const Value> values) const
+	{
+		std::vector<bool> used(holeStorage.size());
+		return instantiate(0, values, used);
+	}
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "document.hh"
+
+#include <limits>
+#include <vector>
+
+/**
+ * A cursor that walks the nodes of a tree in preorder without recursion, so
+ * that a Lua pass can visit a whole tree in a flat loop with one call into
+ * native code per node.  Text runs are not visited.
+ *
+ * The tree may be modified while it is being walked.  The walker remembers
+ * the last node that it returned at each level and finds it again in its
+ * parent before moving on, so inserting or removing its siblings does not
+ * make it skip or repeat nodes.  If that node has itself been removed, the
+ * walk resumes from the node that followed it or, if that has also gone,
+ * from the position where it was.  Nodes that replace the current node with
+ * `replace` are not visited.
+ */
+class TreeWalker
+{
+	/// Marks a level whose remaining children should not be visited.
+	static constexpr size_t Exhausted = std::numeric_limits<size_t>::max();
+
+	/**
+	 * A node whose children are being walked.
+	 */
+	struct Frame
+	{
+		/// The node.
+		TextTreePointer node;
+
+		/// The index of the next child to look at.
+		size_t next = 0;
+
+		/**
+		 * The child that the walk resumes from, if any.  `next` is found
+		 * from it again before it is used.
+		 */
+		TextTreePointer anchor;
+
+		/**
+		 * True if `anchor` is the next child to look at, false if it is the
+		 * last child that was returned.
+		 */
+		bool anchorIsNext = false;
+
+		/**
+		 * The first child node after `anchor`, if any, from which the walk
+		 * resumes if `anchor` has been removed.
+		 */
+		TextTreePointer follower;
+
+		/**
+		 * The index of `anchor` when it was recorded, from which the walk
+		 * resumes if `anchor` and `follower` have both been removed.
+		 */
+		size_t anchorIndex = 0;
+
+		Frame(TextTreePointer node) : node(std::move(node)) {}
+
+		/**
+		 * Resume the walk from `child`, at `index`.  If `isNext` is true,
+		 * `child` is the next child to look at, otherwise it is the child
+		 * that was just returned.
+		 */
+		void set_anchor(const TextTreePointer &child, size_t index, bool isNext)
+		{
+			anchor       = child;
+			anchorIsNext = isNext;
+			anchorIndex  = index;
+			follower     = nullptr;
+
+			auto &children = node->children();
+			for (size_t i = index + 1; i < children.size(); i++)
+			{
+				auto *sibling = std::get_if<TextTreePointer>(&children[i]);
+				if ((sibling != nullptr) && (*sibling != nullptr))
+				{
+					follower = *sibling;
+					break;
+				}
+			}
+		}
+
+		/**
+		 * Set `next` from the anchor, which may have moved.
+		 */
+		void resolve_anchor()
+		{
+			if (auto index = node->child_index(anchor))
+			{
+				next = *index + (anchorIsNext ? 0 : 1);
+			}
+			else if (auto index = follower ? node->child_index(follower)
+			                               : std::nullopt)
+			{
+				next = *index;
+			}
+			else
+			{
+				next = anchorIndex;
+			}
+			anchor   = nullptr;
+			follower = nullptr;
+		}
+	};
+
+	/// The nodes whose children are being walked, innermost last.
+	std::vector<Frame> stack;
+
+	/// The node returned by the last call to `next`, if it is still there.
+	TextTreePointer currentNode;
+
+	/// True if the next call to `next` should visit the current node's
+	/// children.
+	bool descend = false;
+
+	public:
+	/**
+	 * Create a walker over the descendants of `root`.  The root itself is
+	 * not visited.
+	 */
+	TreeWalker(TextTreePointer root)
+	{
+		stack.emplace_back(std::move(root));
+	}
+
+	/**
+	 * Move to the next node in preorder and return it, or null at the end
+	 * of the walk.
+	 */
+	TextTreePointer next()
+	{
+		if (descend && currentNode)
+		{
+			stack.emplace_back(currentNode);
+		}
+		descend     = false;
+		currentNode = nullptr;
+		while (!stack.empty())
+		{
+			auto &frame    = stack.back();
+			auto &children = frame.node->children();
+			if (frame.anchor && (frame.next != Exhausted))
+			{
+				frame.resolve_anchor();
+			}
+			while (frame.next < children.size())
+			{
+				auto *child =
+				  std::get_if<TextTreePointer>(&children[frame.next++]);
+				if ((child != nullptr) && (*child != nullptr))
+				{
+					frame.set_anchor(*child, frame.next - 1, false);
+					currentNode = *child;
+					descend     = true;
+					return currentNode;
+				}
+			}
+			stack.pop_back();
+		}
+		return nullptr;
+	}
+
+	/**
+	 * Do not visit the children of the current node.
+	 */
+	void skip_children()
+	{
+		descend = false;
+	}
+
+	/**
+	 * Replace the current node with `replacements`, which are not visited.
+	 * The walk continues with the node that followed it.
+	 */
+	void replace(std::vector<TextTree::Child> replacements)
+	{
+		if (!currentNode || (stack.empty()))
+		{
+			return;
+		}
+		auto &frame    = stack.back();
+		auto &children = frame.node->children();
+		auto  index    = frame.node->child_index(currentNode);
+		if (!index)
+		{
+			return;
+		}
+		// Resume from the next node sibling, which keeps its identity
+		// however the replacements change the indexes.
+		frame.anchor = nullptr;
+		frame.next   = Exhausted;
+		for (size_t i = *index + 1; i < children.size(); i++)
+		{
+			auto *child = std::get_if<TextTreePointer>(&children[i]);
+			if ((child != nullptr) && (*child != nullptr))
+			{
+				frame.set_anchor(*child, i, true);
+				break;
+			}
+		}
+		// The sibling moves by the difference between the number of
+		// replacements and the one node that they replace.
+		size_t added = replacements.size();
+		frame.node->replace_child(currentNode, std::move(replacements));
+		if (frame.anchor)
+		{
+			frame.anchorIndex = frame.anchorIndex + added - 1;
+			frame.next        = frame.anchorIndex;
+		}
+		currentNode = nullptr;
+		descend     = false;
+	}
+
+	/**
+	 * Remove the current node.  The walk continues with the node that
+	 * followed it.
+	 */
+	void remove()
+	{
+		replace({});
+	}
+
+	/**
+	 * Returns the node returned by the last call to `next`, or null if
+	 * there is none or it has been replaced.
+	 */
+	const TextTreePointer &current() const
+	{
+		return currentNode;
+	}
+
+	/**
+	 * Returns the depth of the current node.  Children of the root are at
+	 * depth one.
+	 */
+	size_t depth() const
+	{
+		return stack.size();
+	}
+};
@@ -1,5 +1,7 @@
 #include "document.hh"
+#include "pass_timer.hh"
 #include "sol.hh"
+#include "trace.hh"
 
 #include <iostream>
 #include <string>
@@ -117,6 +119,8 @@ class TreeSitterTextBuilder
 	TextTreePointer process_string(const std::string &source,
 	                               std::string_view   commentMarker)
 	{
+		PassTimer::Scope    timer(PassTimer::Category::TreeSitter);
+		TraceRecorder::Span span("process_string", "tree-sitter");
 		ranges.clear();
 		currentSource = source;
 		if (commentMarker == "")
@@ -147,30 +151,30 @@ class TreeSitterTextBuilder
 		auto cursor = ts_tree_cursor_new(root_node);
 		dfs(&cursor);
 		auto root  = TextTree::create();
-		root->kind = "code";
-		root->attribute_set("first-line", std::to_string(firstLine));
+		root->kind("code");
+		root->attribute_set("first-line", int64_t(firstLine));
 
 		if (!ranges.empty())
 		{
-			uint32_t last = ranges[0].start;
-			for (auto r : ranges)
+			std::string_view text = source;
+			CodeSpans        spans;
+			uint32_t         last = ranges[0].start;
+			for (auto &r : ranges)
 			{
 				if (r.start > last)
 				{
-					root->append_text(source.substr(last, r.start - last));
+					spans.append_text(text.substr(last, r.start - last));
 				}
-				auto        run  = root->new_child();
-				std::string kind = r.kind;
-				if (auto i = LanguageTraits::kindNames.find(kind);
+				std::string_view kind = r.kind;
+				if (auto i = LanguageTraits::kindNames.find(r.kind);
 				    i != LanguageTraits::kindNames.end())
 				{
 					kind = i->second;
 				}
-				run->kind = "code-run";
-				run->attribute_set("token-kind", kind);
-				run->append_text(source.substr(r.start, r.end - r.start));
+				spans.append_span(text.substr(r.start, r.end - r.start), kind);
 				last = r.end;
 			}
+			root->code_spans(std::move(spans));
 		}
 		ts_tree_delete(tree);
 		ts_parser_delete(parser);